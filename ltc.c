@@ -0,0 +1,1891 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "ltc.h"
+#include "probes.h"
+
+static const char false = 0;
+static const char true = 1;
+
+// Unsigned error return value
+static const size_t ST_ERROR = 0xffffffff;
+
+static const char* SYNC_WORD_STR = "0011111111111101";
+
+#define countof(x)  (sizeof(x) / sizeof(x[0]))
+
+/*
+ * Logging
+ */
+static void log_error(LtcDecoder* decoder, int status_code, const char* fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+
+  if (decoder->log)
+  {
+    decoder->log(decoder->log_context, 0, status_code, fmt, args);
+  }
+
+  va_end(args);
+}
+
+static void log_info(LtcDecoder* decoder, int level, const char* fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+
+  if (decoder->log)
+  {
+    decoder->log(decoder->log_context, level, 0, fmt, args);
+  }
+
+  va_end(args);
+}
+
+
+char* timecode_to_str(SMPTETimecode* stime)
+{
+  // Ring buffer of 5 returns values, before we start to overwrite. One per
+  // thread, so that threads can decode at the same time.
+  static WAV_THREAD_LOCAL char buffers[5][13];
+  static WAV_THREAD_LOCAL size_t i = 0;
+
+  char* buffer = buffers[i];
+
+  snprintf(buffer, sizeof(buffers[i]),
+           "%02d:%02d:%02d:%02d",
+           (int)stime->hours,
+           (int)stime->mins,
+           (int)stime->secs,
+           (int)stime->frame);
+
+  i = (i+1) % countof(buffers);
+
+  return buffer;
+}
+
+int timecode_from_str(const char* str, SMPTETimecode* stime)
+{
+  unsigned hours, mins, secs, frame;
+
+  if (sscanf(str, "%2u:%2u:%2u%*1[:;.]%2u", &hours, &mins, &secs, &frame) != 4
+      || hours > 23 || mins > 59 || secs > 59)
+  {
+    return -1;
+  }
+
+  memset(stime, 0, sizeof(SMPTETimecode));
+  stime->hours = hours;
+  stime->mins = mins;
+  stime->secs = secs;
+  stime->frame = frame;
+  return 0;
+}
+
+long timecode_to_frames(const SMPTETimecode* stime, int fps)
+{
+  return ((stime->hours * 60L + stime->mins) * 60L + stime->secs) * fps + stime->frame;
+}
+
+void frames_to_timecode(SMPTETimecode* stime, long frames, int fps)
+{
+  const long frames_per_day = 24L * 60 * 60 * fps;
+
+  frames %= frames_per_day;
+  if (frames < 0) frames += frames_per_day;
+
+  memset(stime, 0, sizeof(SMPTETimecode));
+  sprintf(stime->timezone,"+0000");
+
+  stime->frame = frames % fps;
+  frames /= fps;
+  stime->secs = frames % 60;
+  frames /= 60;
+  stime->mins = frames % 60;
+  stime->hours = frames / 60;
+}
+
+static void ltc_frame_to_time(SMPTETimecode *stime, LTCFrame *frame/*, int flags*/) {
+        if (!stime) return;
+
+/*        if (flags & LTC_USE_DATE) {
+                smpte_set_timezone_string(frame, stime);
+
+                stime->years  = frame->user5 + frame->user6*10;
+                stime->months = frame->user3 + frame->user4*10;
+                stime->days   = frame->user1 + frame->user2*10;
+        } else { */
+                stime->years  = 0;
+                stime->months = 0;
+                stime->days   = 0;
+                sprintf(stime->timezone,"+0000");
+/*        } */
+
+        stime->hours = frame->hours_units + frame->hours_tens*10;
+        stime->mins  = frame->mins_units  + frame->mins_tens*10;
+        stime->secs  = frame->secs_units  + frame->secs_tens*10;
+        stime->frame = frame->frame_units + frame->frame_tens*10;
+}
+
+SMPTETimecodeRange* create_timecode_range(SMPTETimecode* start, SMPTETimecode* end)
+{
+  SMPTETimecodeRange* obj = wav_malloc(sizeof(SMPTETimecodeRange));
+  if (!obj) return NULL;
+
+  memcpy(&obj->start, start, sizeof(SMPTETimecode));
+  memcpy(&obj->end, end, sizeof(SMPTETimecode));
+  obj->start_sample = 0;
+  obj->next_ptr = NULL;
+  return obj;
+}
+
+void timecode_range_append(SMPTETimecodeRange** first_pptr, SMPTETimecodeRange* new_ptr)
+{
+  if (!*first_pptr)
+  {
+    *first_pptr = new_ptr;
+  }
+  else
+  {
+    SMPTETimecodeRange* node_ptr = *first_pptr;
+    for (;
+         node_ptr->next_ptr;
+         node_ptr = node_ptr->next_ptr);
+
+    node_ptr->next_ptr = new_ptr;
+    new_ptr->next_ptr = NULL;
+  }
+}
+
+void free_timecode_ranges(SMPTETimecodeRange* first_ptr)
+{
+  while (first_ptr)
+  {
+    SMPTETimecodeRange* next_ptr = first_ptr->next_ptr;
+    wav_free(first_ptr);
+    first_ptr = next_ptr;
+  }
+}
+
+void free_drift_segments(LtcDriftSegment* first_ptr)
+{
+  while (first_ptr)
+  {
+    LtcDriftSegment* next_ptr = first_ptr->next_ptr;
+    wav_free(first_ptr);
+    first_ptr = next_ptr;
+  }
+}
+
+
+/*
+ * Per minute counts of frames and errors at 'sample'.
+ */
+static WavU32* frames_in_minute(LtcDecoder* decoder, WavU64 sample)
+{
+  LtcSignalStats* stats = &decoder->stats;
+  size_t minute = decoder->sample_rate ? sample / (60 * (WavU64)decoder->sample_rate) : 0;
+
+  if (minute >= LTC_STATS_MINUTES) minute = LTC_STATS_MINUTES - 1;
+  if (minute >= stats->num_minutes) stats->num_minutes = minute + 1;
+
+  return &stats->frames_per_minute[minute];
+}
+
+static void count_error(LtcDecoder* decoder, WavU64 sample)
+{
+  WavU32* frames = frames_in_minute(decoder, sample);
+
+  decoder->stats.errors_per_minute[frames - decoder->stats.frames_per_minute]++;
+}
+
+/*
+ * Decode a string containg characters '0' and '1' which represent a
+ * sequence of LTC frames, passing each frame to handle_frame().
+ *
+ * If the bits where a frame should end aren't a sync word, we've lost
+ * synchronisation, so we drop back to searching for the sync word. The frame
+ * after that is flagged as following a gap.
+ *
+ * Digits are only consumed up to the last 80, unless 'at_end' says that no
+ * more will follow them.
+ *
+ * Returns the number of digits consumed. '*got_frame_ptr' is set if at least
+ * one frame was decoded.
+ */
+static void handle_frame(LtcDecoder* decoder, const SMPTETimecode* timecode,
+                         WavU64 sample, bool after_gap);
+
+static size_t consume_digits(LtcDecoder* decoder,
+                             char* digits, size_t n, bool at_end,
+                             bool* got_frame_ptr)
+{
+  LTCFrame frame;
+  SMPTETimecode timecode;
+  size_t i = 0;
+  if (got_frame_ptr) *got_frame_ptr = false;
+
+  /*
+   * We're looking for 80 characters that end in SYNC_WORD_STR
+   */
+  while (n - i > 80 || (at_end && n - i == 80))
+  {
+    if (strncmp(&digits[i + 80-16], SYNC_WORD_STR, 16) != 0)
+    {
+      if (!decoder->in_gap && decoder->seen_starting_timecode)
+      {
+        log_info(decoder, 1, "Lost synchronisation at sample %llu; resyncing",
+                 (unsigned long long)decoder->digit_samples[i]);
+        count_error(decoder, decoder->digit_samples[i]);
+      }
+
+      log_info(decoder, 2, "Looking for sync word %.80s", &digits[i]);
+
+      if (!decoder->seen_starting_timecode)
+      {
+        decoder->discarded_bits_at_start++;
+      }
+
+      decoder->in_gap = true;
+      ++i;
+      continue;
+    }
+
+    PROBE1(ltc, sync, decoder->digit_samples[i]);
+
+    if (!*got_frame_ptr)
+    {
+      log_info(decoder, 2, "Got frame: %.80s", &digits[i]);
+    }
+
+    // Consume 80 bits
+    for (size_t byte_count = 0; byte_count < 10; ++byte_count)
+    {
+      uint8_t byte = 0;
+
+      byte |= digits[i + byte_count*8 + 0] == '1' ? 1 : 0;
+      byte |= digits[i + byte_count*8 + 1] == '1' ? 2 : 0;
+      byte |= digits[i + byte_count*8 + 2] == '1' ? 4 : 0;
+      byte |= digits[i + byte_count*8 + 3] == '1' ? 8 : 0;
+      byte |= digits[i + byte_count*8 + 4] == '1' ? 16 : 0;
+      byte |= digits[i + byte_count*8 + 5] == '1' ? 32 : 0;
+      byte |= digits[i + byte_count*8 + 6] == '1' ? 64 : 0;
+      byte |= digits[i + byte_count*8 + 7] == '1' ? 128 : 0;
+
+      *(((uint8_t*)&frame) + byte_count) = byte;
+    }
+
+    ltc_frame_to_time(&timecode, &frame);
+
+    PROBE5(ltc, frame, timecode.hours, timecode.mins, timecode.secs, timecode.frame,
+           decoder->digit_samples[i]);
+
+    (*frames_in_minute(decoder, decoder->digit_samples[i]))++;
+    if (decoder->digit_signs[i] > 0) decoder->stats.positive_frames++;
+    if (decoder->digit_signs[i] < 0) decoder->stats.negative_frames++;
+
+    handle_frame(decoder, &timecode, decoder->digit_samples[i],
+                 decoder->in_gap && decoder->seen_starting_timecode);
+
+    decoder->in_gap = false;
+    *got_frame_ptr = true;
+    i += 80;
+  }
+
+  return i;
+}
+
+/*
+ * Compute the arithmetic mean of tha data in 'data' for which the
+ * corresponding element of include is true.
+ */
+static size_t average(size_t* data, size_t n, int8_t* labels, int8_t label)
+{
+  size_t num = 0;
+  size_t sum = 0;
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (labels[i] == label)
+    {
+      num++;
+      sum += data[i];
+    }
+  }
+
+  return num == 0 ? ST_ERROR : sum / num;
+}
+
+static size_t max(size_t* data, size_t n)
+{
+  size_t max = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    max = data[i] > max ? data[i] : max;
+  }
+  return max;
+}
+
+static size_t min(size_t* data, size_t n)
+{
+  size_t min = SIZE_MAX;
+  for (size_t i = 0; i < n; ++i)
+  {
+    min = data[i] < min ? data[i] : min;
+  }
+  return min;
+}
+
+/*
+ * Stats for each sub-distribution in bimodel; see below.
+ */
+typedef struct
+{
+  int16_t mean;
+  size_t num_samples_outside_threshold;
+  size_t num_samples;
+  bool is_valid;
+} DistStats;
+
+
+static int detect_fps(const int16_t* audio_samples, size_t n,
+                      size_t num_samples_per_sec,
+                      size_t spike_threshold)
+{
+  bool seen_spike = false; // Have we seen a spike yet
+  size_t samples_since_spike = 0;
+  size_t samples_between_spikes[100];
+  size_t spike_count = 0;
+  int8_t labels[countof(samples_between_spikes)];
+
+  for (size_t i = 0; i < n; ++i, ++samples_since_spike)
+  {
+    // NB: Sometimes the sampling puts two samples in a peak.
+    if (abs(audio_samples[i]) > spike_threshold && samples_since_spike > 1)
+    {
+      if (seen_spike && spike_count < countof(samples_between_spikes))
+      {
+        samples_between_spikes[spike_count++] = samples_since_spike;
+      }
+      samples_since_spike = 0;
+      seen_spike = true;
+    }
+  }
+
+  // If no spikes, then this is not a valid LTC wav file.
+  if (!seen_spike || spike_count == 0) return -1;
+
+  // There should be a tight bimodel distribution about two peaks.
+  // The lower peak corrsponding to 0s and the upper to 1s
+  // The bit rate is given by the lower peak.
+  //
+  // So, we split into two distributions by dividing the data into those
+  // samples that lie above and below the halfway point between the maximum and
+  // minimum values.  set. Then, to check that we have reasonable looking data,
+  // we check that each distribution is tighly clustered about it's average.
+  //
+  size_t mid_point = (max(samples_between_spikes, spike_count)
+          + min(samples_between_spikes, spike_count)) >> 1;
+
+  // Partition into values above and below mean.
+  for (size_t i = 0; i < spike_count; ++i)
+  {
+    labels[i] = samples_between_spikes[i] < mid_point ? 0 : 1;
+  }
+
+  DistStats low = {0}, high = {0};
+  low.mean = average(samples_between_spikes, spike_count, labels, /* label = */ 0);
+  high.mean = average(samples_between_spikes, spike_count, labels, /* label = */ 1);
+
+  if (low.mean == ST_ERROR || high.mean == ST_ERROR) return -1;
+
+  // Check that 90% of the samples are within 15% of mean
+  size_t threshold = high.mean / 7;
+  for (size_t i = 0; i < spike_count; ++i)
+  {
+    if (labels[i] == 0)
+    {
+      if (abs(samples_between_spikes[i] - low.mean) > threshold)
+      {
+        low.num_samples_outside_threshold++;
+      }
+      ++low.num_samples;
+    }
+    else
+    {
+      if (abs(samples_between_spikes[i] - high.mean) > threshold)
+      {
+        high.num_samples_outside_threshold++;
+      }
+      ++high.num_samples;
+    }
+  }
+
+  low.is_valid = 1.0 * low.num_samples_outside_threshold / low.num_samples < 0.1;
+  high.is_valid = 1.0 * high.num_samples_outside_threshold / high.num_samples < 0.1;
+
+  if (!low.is_valid || !high.is_valid)
+  {
+    return -1;
+  }
+
+  // bits per second = samples per sec / samples per bit
+  // FPS = bits per second / 80 bits per frame
+  return num_samples_per_sec / high.mean / 80;
+}
+
+
+void ltc_decoder_init(LtcDecoder* decoder, WavU32 sample_rate, int fps,
+                      LtcLogFunc log, void* log_context)
+{
+  memset(decoder, 0, sizeof(LtcDecoder));
+
+  decoder->fps = fps;
+  decoder->sample_rate = sample_rate;
+  decoder->log = log;
+  decoder->log_context = log_context;
+}
+
+void ltc_decoder_free(LtcDecoder* decoder)
+{
+  free_timecode_ranges(decoder->timecode_range_ptr);
+  decoder->timecode_range_ptr = NULL;
+  free_drift_segments(decoder->drift_segment_ptr);
+  decoder->drift_segment_ptr = NULL;
+}
+
+/*
+ * Saved state
+ *
+ * The fields that carry a decode on are written one by one, after a header
+ * that identifies the format, so that a change to LtcDecoder can't be loaded
+ * as something else. Bump LTC_STATE_VERSION whenever the fields change.
+ */
+#define LTC_STATE_MAGIC     "LTCS"
+#define LTC_STATE_VERSION   1
+
+#define LTC_DRIFT_FIT_FIELDS(X, fit) \
+  X(fit.num_frames) X(fit.num_runs) X(fit.sxx) X(fit.sxy) X(fit.syy) \
+  X(fit.start_sample) X(fit.end_sample)
+
+#define LTC_DRIFT_SEGMENT_FIELDS(X, segment) \
+  X(segment.start_sample) X(segment.end_sample) X(segment.num_frames) \
+  X(segment.ppm) X(segment.ppm_error)
+
+#define LTC_RANGE_FIELDS(X, range) \
+  X(range.start) X(range.end) X(range.start_sample)
+
+#define LTC_STATE_FIELDS(X, d) \
+  X(d.fps) X(d.sample_rate) X(d.split_on_jump) \
+  X(d.digits) X(d.digit_samples) X(d.digit_signs) X(d.digit_count) \
+  X(d.seen_spike) X(d.samples_since_spike) X(d.last_spike_sample) X(d.last_spike_sign) \
+  X(d.last_digit_was_one) X(d.sample_count) X(d.fps_search_samples) \
+  X(d.gate_level) X(d.in_silence) \
+  X(d.starting_timecode) X(d.starting_sample) X(d.last_timecode) X(d.last_sample) \
+  X(d.seen_starting_timecode) \
+  X(d.in_gap) X(d.have_candidate) X(d.candidate_timecode) X(d.candidate_sample) \
+  LTC_DRIFT_FIT_FIELDS(X, d.drift_window) X(d.drift_mean_x) X(d.drift_mean_y) X(d.drift_x) \
+  LTC_DRIFT_FIT_FIELDS(X, d.drift_segment) LTC_DRIFT_FIT_FIELDS(X, d.drift_total) \
+  X(d.seen_first_timecode) X(d.first_timecode) X(d.first_sample) \
+  X(d.discarded_bits_at_start) \
+  X(d.stats.signal_samples) X(d.stats.signal_sum) X(d.stats.signal_sum_squares) \
+  X(d.stats.silent_samples) X(d.stats.silent_sum_squares) X(d.stats.peak) \
+  X(d.stats.jitter) X(d.stats.rise_time_sum) X(d.stats.num_rise_times) \
+  X(d.stats.positive_frames) X(d.stats.negative_frames) X(d.stats.num_minutes) \
+  X(d.stats.frames_per_minute) X(d.stats.errors_per_minute) \
+  LTC_DRIFT_SEGMENT_FIELDS(X, d.drift)
+
+typedef struct
+{
+  char    magic[4];
+  WavU32  version;
+  WavU32  state_size;     // Of the fields, which changes with their types
+  WavU32  range_size;
+  WavU32  segment_size;
+} LtcStateHeader;
+
+#define SIZE_OF(field)      + sizeof(field)
+#define SAVE(field)         if (fwrite(&(field), sizeof(field), 1, fptr) != 1) return -1;
+#define LOAD(field)         if (fread(&(field), sizeof(field), 1, fptr) != 1) goto fail;
+
+static void state_header(LtcStateHeader* header)
+{
+  // Only used in sizeof.
+  LtcDecoder decoder;
+  SMPTETimecodeRange range;
+  LtcDriftSegment segment;
+
+  memset(header, 0, sizeof(LtcStateHeader));
+  memcpy(header->magic, LTC_STATE_MAGIC, sizeof(header->magic));
+  header->version = LTC_STATE_VERSION;
+  header->state_size = 0 LTC_STATE_FIELDS(SIZE_OF, decoder);
+  header->range_size = 0 LTC_RANGE_FIELDS(SIZE_OF, range);
+  header->segment_size = 0 LTC_DRIFT_SEGMENT_FIELDS(SIZE_OF, segment);
+}
+
+int ltc_decoder_save(const LtcDecoder* decoder, FILE* fptr)
+{
+  LtcStateHeader header;
+  WavU32 num_ranges = 0, num_segments = 0;
+
+  for (SMPTETimecodeRange* ptr = decoder->timecode_range_ptr; ptr; ptr = ptr->next_ptr) num_ranges++;
+  for (LtcDriftSegment* ptr = decoder->drift_segment_ptr; ptr; ptr = ptr->next_ptr) num_segments++;
+
+  state_header(&header);
+  SAVE(header)
+  LTC_STATE_FIELDS(SAVE, (*decoder))
+
+  SAVE(num_ranges)
+  for (SMPTETimecodeRange* ptr = decoder->timecode_range_ptr; ptr; ptr = ptr->next_ptr)
+  {
+    LTC_RANGE_FIELDS(SAVE, (*ptr))
+  }
+
+  SAVE(num_segments)
+  for (LtcDriftSegment* ptr = decoder->drift_segment_ptr; ptr; ptr = ptr->next_ptr)
+  {
+    LTC_DRIFT_SEGMENT_FIELDS(SAVE, (*ptr))
+  }
+
+  return 0;
+}
+
+int ltc_decoder_load(LtcDecoder* decoder, FILE* fptr)
+{
+  LtcStateHeader header, expected;
+  LtcDecoder loaded;
+  WavU32 count;
+
+  state_header(&expected);
+  if (fread(&header, sizeof(header), 1, fptr) != 1
+      || memcmp(&header, &expected, sizeof(header)) != 0)
+  {
+    return -1;
+  }
+
+  // Everything that isn't saved, such as the callbacks, is kept.
+  ltc_decoder_init(&loaded, decoder->sample_rate, decoder->fps,
+                   decoder->log, decoder->log_context);
+  loaded.on_frame = decoder->on_frame;
+  loaded.frame_context = decoder->frame_context;
+
+  LTC_STATE_FIELDS(LOAD, loaded)
+
+  // Counts that index the decoder's arrays.
+  if (loaded.digit_count > countof(loaded.digits)
+      || loaded.stats.num_minutes > LTC_STATS_MINUTES)
+  {
+    goto fail;
+  }
+
+  LOAD(count)
+  for (WavU32 i = 0; i < count; ++i)
+  {
+    SMPTETimecodeRange range;
+    LTC_RANGE_FIELDS(LOAD, range)
+
+    SMPTETimecodeRange* range_ptr = create_timecode_range(&range.start, &range.end);
+    if (!range_ptr) goto fail;
+
+    range_ptr->start_sample = range.start_sample;
+    timecode_range_append(&loaded.timecode_range_ptr, range_ptr);
+  }
+
+  LOAD(count)
+  for (LtcDriftSegment** pptr = &loaded.drift_segment_ptr; count > 0; --count)
+  {
+    LtcDriftSegment* segment_ptr = wav_calloc(1, sizeof(LtcDriftSegment));
+    if (!segment_ptr) goto fail;
+
+    // Linked in first, so that it's freed with the rest on failure.
+    *pptr = segment_ptr;
+    pptr = &segment_ptr->next_ptr;
+
+    LTC_DRIFT_SEGMENT_FIELDS(LOAD, (*segment_ptr))
+  }
+
+  ltc_decoder_free(decoder);
+  *decoder = loaded;
+  return 0;
+
+fail:
+  ltc_decoder_free(&loaded);
+  return -1;
+}
+
+#undef SIZE_OF
+#undef SAVE
+#undef LOAD
+
+/*
+ * Add the range that runs from the starting timecode to the last timecode
+ * to the list of ranges.
+ */
+static void close_range(LtcDecoder* decoder)
+{
+  log_info(decoder, 0, "Timecode range %s --> %s",
+              timecode_to_str(&decoder->starting_timecode),
+              timecode_to_str(&decoder->last_timecode));
+
+  SMPTETimecodeRange* range_ptr = create_timecode_range(&decoder->starting_timecode,
+                                                        &decoder->last_timecode);
+  if (!range_ptr)
+  {
+    log_error(decoder, 500, "Out of memory recording a timecode range");
+    return;
+  }
+
+  range_ptr->start_sample = decoder->starting_sample;
+
+  PROBE3(ltc, range_closed, timecode_to_frames(&range_ptr->start, decoder->fps),
+         timecode_to_frames(&range_ptr->end, decoder->fps), range_ptr->start_sample);
+
+  // Add to linked list of ranges for JSON.
+  timecode_range_append(&decoder->timecode_range_ptr, range_ptr);
+}
+
+/*
+ * Difference in frames from 'from' to 'to', allowing for midnight.
+ */
+static long timecode_diff(const SMPTETimecode* to, const SMPTETimecode* from, int fps)
+{
+  const long frames_per_day = 24L * 60 * 60 * fps;
+  long diff = (timecode_to_frames(to, fps) - timecode_to_frames(from, fps)) % frames_per_day;
+
+  if (diff > frames_per_day / 2) diff -= frames_per_day;
+  if (diff <= -frames_per_day / 2) diff += frames_per_day;
+
+  return diff;
+}
+
+#define DRIFT_WINDOW_SECONDS  60      // Frames fitted before checking for a change of rate...
+#define DRIFT_MIN_SECONDS     10      // ...or fewer, if a gap or jump cuts the run short
+#define DRIFT_MIN_CHANGE_PPM  2.0     // Smallest change of rate that starts a segment
+
+/*
+ * Add the runs in 'from' to 'into'.
+ */
+static void pool_drift_fit(LtcDriftFit* into, const LtcDriftFit* from)
+{
+  if (into->num_frames == 0)
+  {
+    into->start_sample = from->start_sample;
+  }
+  into->end_sample = from->end_sample;
+
+  into->num_frames += from->num_frames;
+  into->num_runs += from->num_runs;
+  into->sxx += from->sxx;
+  into->sxy += from->sxy;
+  into->syy += from->syy;
+}
+
+/*
+ * The rate of the recorder relative to the LTC clock in ppm from the slope
+ * of 'fit', and the half width of its 95% confidence interval in
+ * '*error_ptr'. Returns -1 if there aren't enough frames for an estimate.
+ */
+static int drift_fit_ppm(const LtcDecoder* decoder, const LtcDriftFit* fit,
+                         double* ppm_ptr, double* error_ptr)
+{
+  double dof = (double)fit->num_frames - fit->num_runs - 1;
+
+  if (dof < 1 || fit->sxx <= 0)
+  {
+    return -1;
+  }
+
+  double slope = fit->sxy / fit->sxx;
+  double residual = fit->syy - slope * fit->sxy;
+  double slope_error = sqrt((residual > 0 ? residual : 0) / dof / fit->sxx);
+  double scale = 1e6 * decoder->fps / decoder->sample_rate;
+
+  *ppm_ptr = (slope * decoder->fps / decoder->sample_rate - 1) * 1e6;
+  *error_ptr = 1.96 * slope_error * scale;
+  return 0;
+}
+
+/*
+ * End the current drift segment, adding it to the list and the total.
+ */
+static void close_drift_segment(LtcDecoder* decoder)
+{
+  LtcDriftFit* segment = &decoder->drift_segment;
+  double ppm, ppm_error;
+
+  if (drift_fit_ppm(decoder, segment, &ppm, &ppm_error) == 0)
+  {
+    LtcDriftSegment* new_ptr = wav_malloc(sizeof(LtcDriftSegment));
+
+    if (new_ptr)
+    {
+      new_ptr->start_sample = segment->start_sample;
+      new_ptr->end_sample = segment->end_sample;
+      new_ptr->num_frames = segment->num_frames;
+      new_ptr->ppm = ppm;
+      new_ptr->ppm_error = ppm_error;
+      new_ptr->next_ptr = NULL;
+
+      LtcDriftSegment** pptr = &decoder->drift_segment_ptr;
+      while (*pptr)
+      {
+        pptr = &(*pptr)->next_ptr;
+      }
+      *pptr = new_ptr;
+    }
+
+    log_info(decoder, 1, "Clock drift %+.2f ppm (+/- %.2f) from sample %llu to %llu",
+             ppm, ppm_error, (unsigned long long)segment->start_sample,
+             (unsigned long long)segment->end_sample);
+  }
+
+  pool_drift_fit(&decoder->drift_total, segment);
+  memset(segment, 0, sizeof(LtcDriftFit));
+}
+
+/*
+ * End the current run of frames. A run that disagrees with the rate of the
+ * segment so far starts a new segment; very short runs are too noisy to tell
+ * and join the current one.
+ */
+static void end_drift_window(LtcDecoder* decoder)
+{
+  LtcDriftFit* window = &decoder->drift_window;
+  double window_ppm, window_error, segment_ppm, segment_error;
+
+  if (window->num_frames >= 3)
+  {
+    if (window->num_frames >= (WavU64)DRIFT_MIN_SECONDS * decoder->fps
+        && drift_fit_ppm(decoder, window, &window_ppm, &window_error) == 0
+        && drift_fit_ppm(decoder, &decoder->drift_segment, &segment_ppm, &segment_error) == 0)
+    {
+      double change = fabs(window_ppm - segment_ppm);
+
+      if (change > DRIFT_MIN_CHANGE_PPM
+          && change > 1.5 * sqrt(window_error * window_error + segment_error * segment_error))
+      {
+        close_drift_segment(decoder);
+      }
+    }
+
+    pool_drift_fit(&decoder->drift_segment, window);
+  }
+
+  memset(window, 0, sizeof(LtcDriftFit));
+}
+
+/*
+ * Add a frame that started at 'sample' to the clock drift estimate, before
+ * 'last_timecode' moves on to it.
+ */
+static void track_drift(LtcDecoder* decoder, const SMPTETimecode* timecode, WavU64 sample)
+{
+  LtcDriftFit* window = &decoder->drift_window;
+
+  if (window->num_frames > 0
+      && timecode_diff(timecode, &decoder->last_timecode, decoder->fps) == 1)
+  {
+    decoder->drift_x++;
+  }
+  else
+  {
+    end_drift_window(decoder);
+
+    window->num_runs = 1;
+    window->start_sample = sample;
+    decoder->drift_x = 0;
+    decoder->drift_mean_x = 0;
+    decoder->drift_mean_y = 0;
+  }
+
+  // Welford's update of the means and the sums about them.
+  double x = decoder->drift_x;
+  double y = sample - window->start_sample;
+  double n = ++window->num_frames;
+  double dx = x - decoder->drift_mean_x;
+  double dy = y - decoder->drift_mean_y;
+
+  decoder->drift_mean_x += dx / n;
+  decoder->drift_mean_y += dy / n;
+  window->sxx += dx * (x - decoder->drift_mean_x);
+  window->sxy += dx * (y - decoder->drift_mean_y);
+  window->syy += dy * (y - decoder->drift_mean_y);
+  window->end_sample = sample;
+
+  if (window->num_frames >= (WavU64)DRIFT_WINDOW_SECONDS * decoder->fps)
+  {
+    end_drift_window(decoder);
+  }
+}
+
+/*
+ * Record a frame that started at 'sample'.
+ *
+ * After a gap, we check the frame against the timecode we'd expect from the
+ * last good frame and the time elapsed since. If it doesn't match, the sync
+ * word might have been found in noise, so we only accept the frame once the
+ * frame after it follows on. Either way, the gap ends the current range.
+ * With 'split_on_jump', so does a frame that doesn't follow on from the last.
+ */
+static void handle_frame(LtcDecoder* decoder, const SMPTETimecode* timecode,
+                         WavU64 sample, bool after_gap)
+{
+  if (!decoder->seen_starting_timecode)
+  {
+    decoder->first_timecode = *timecode;
+    decoder->first_sample = sample;
+    decoder->seen_first_timecode = true;
+
+    decoder->starting_timecode = *timecode;
+    decoder->starting_sample = sample;
+    decoder->seen_starting_timecode = true;
+  }
+  else if (after_gap || decoder->have_candidate)
+  {
+    SMPTETimecode start = *timecode;
+    WavU64 start_sample = sample;
+
+    if (!decoder->have_candidate)
+    {
+      double samples_per_frame = (double)decoder->sample_rate / decoder->fps;
+      long elapsed = lround((sample - decoder->last_sample) / samples_per_frame);
+      SMPTETimecode predicted;
+
+      frames_to_timecode(&predicted,
+                         timecode_to_frames(&decoder->last_timecode, decoder->fps) + elapsed,
+                         decoder->fps);
+
+      if (labs(timecode_diff(timecode, &predicted, decoder->fps)) > 1)
+      {
+        log_info(decoder, 1, "Re-locked at %s, but expected %s; waiting for next frame",
+                 timecode_to_str((SMPTETimecode*)timecode), timecode_to_str(&predicted));
+
+        decoder->candidate_timecode = *timecode;
+        decoder->candidate_sample = sample;
+        decoder->have_candidate = true;
+        return;
+      }
+    }
+    else
+    {
+      decoder->have_candidate = false;
+
+      if (after_gap || timecode_diff(timecode, &decoder->candidate_timecode, decoder->fps) != 1)
+      {
+        log_info(decoder, 1, "Rejected false lock at %s",
+                 timecode_to_str(&decoder->candidate_timecode));
+        count_error(decoder, decoder->candidate_sample);
+
+        // Check this frame against the prediction instead.
+        handle_frame(decoder, timecode, sample, true);
+        return;
+      }
+
+      // The range starts at the candidate, which this frame confirmed.
+      start = decoder->candidate_timecode;
+      start_sample = decoder->candidate_sample;
+
+      if (decoder->on_frame)
+      {
+        decoder->on_frame(decoder->frame_context, &start, start_sample);
+      }
+    }
+
+    log_info(decoder, 1, "Warning: Gap between LTC frames");
+
+    close_range(decoder);
+
+    decoder->starting_timecode = start;
+    decoder->starting_sample = start_sample;
+  }
+  else if (decoder->split_on_jump
+           && timecode_diff(timecode, &decoder->last_timecode, decoder->fps) != 1)
+  {
+    log_info(decoder, 1, "Timecode jumped from %s to %s",
+             timecode_to_str(&decoder->last_timecode), timecode_to_str((SMPTETimecode*)timecode));
+
+    close_range(decoder);
+
+    decoder->starting_timecode = *timecode;
+    decoder->starting_sample = sample;
+  }
+
+  track_drift(decoder, timecode, sample);
+
+  if (decoder->on_frame)
+  {
+    decoder->on_frame(decoder->frame_context, timecode, sample);
+  }
+
+  decoder->last_timecode = *timecode;
+  decoder->last_sample = sample;
+}
+
+/*
+ * Silence gate
+ *
+ * Where the LTC generator was off, there are no spikes, but noise would still
+ * go over a threshold chosen from the peak of the noise itself, and become
+ * bogus bits. So the input is split into windows a few bits long, and windows
+ * whose peak is under the gate are skipped without looking for spikes. The
+ * gate follows the level of the LTC, and falls while it's closed so that a
+ * quieter source is picked up again.
+ */
+#define GATE_FLOOR        328     // -40 dBFS
+#define GATE_MAX_WINDOWS  64      // Windows per chunk; one bit each in a mask
+
+/*
+ * Decimation
+ *
+ * LTC needs no more than a few kHz, so inputs at 88.2 kHz and over are
+ * brought down by a power of two to between 40 and 80 kHz before looking for
+ * spikes. Each group of samples is reduced to the one with the largest
+ * magnitude, which keeps spikes at full height, and where it was in the
+ * group, so that bits still start at the exact input sample.
+ */
+#define DECIMATE_MIN_RATE     40000
+#define DECIMATED_MAX_WINDOW  ((2 * DECIMATE_MIN_RATE / 600 + 7) & ~7)
+
+static size_t decimation_factor(const LtcDecoder* decoder)
+{
+  size_t factor = 1;
+
+  while (decoder->sample_rate / (2 * factor) >= DECIMATE_MIN_RATE) factor *= 2;
+  return factor;
+}
+
+/*
+ * Halve 'n' samples that were each reduced from a group of 'step', keeping
+ * the larger magnitude of each pair and its offset in the group; 'offsets'
+ * is NULL for offsets of zero. 'out' and 'out_offsets' may be the inputs. An
+ * odd sample at the end is kept as it is. Returns the number of samples out.
+ */
+static size_t reduce_pairs(const WavI16* samples, const WavU16* offsets, size_t n,
+                           WavU16 step, WavI16* out, WavU16* out_offsets)
+{
+  size_t i = 0, j = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i steps = _mm_set1_epi16(step);
+
+  for (; i + 16 <= n; i += 16, j += 8)
+  {
+    __m128i v0 = _mm_loadu_si128((const __m128i*)(samples + i));
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(samples + i + 8));
+    __m128i even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(v0, 16), 16),
+                                   _mm_srai_epi32(_mm_slli_epi32(v1, 16), 16));
+    __m128i odd = _mm_packs_epi32(_mm_srai_epi32(v0, 16), _mm_srai_epi32(v1, 16));
+    __m128i even_offsets = zero, odd_offsets = zero;
+
+    if (offsets)
+    {
+      __m128i o0 = _mm_loadu_si128((const __m128i*)(offsets + i));
+      __m128i o1 = _mm_loadu_si128((const __m128i*)(offsets + i + 8));
+      even_offsets = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(o0, 16), 16),
+                                     _mm_srai_epi32(_mm_slli_epi32(o1, 16), 16));
+      odd_offsets = _mm_packs_epi32(_mm_srai_epi32(o0, 16), _mm_srai_epi32(o1, 16));
+    }
+
+    // Magnitudes saturate, so -32768 doesn't wrap round to itself.
+    __m128i even_mag = _mm_max_epi16(even, _mm_subs_epi16(zero, even));
+    __m128i odd_mag = _mm_max_epi16(odd, _mm_subs_epi16(zero, odd));
+    __m128i take_odd = _mm_cmpgt_epi16(odd_mag, even_mag);
+
+    odd_offsets = _mm_add_epi16(odd_offsets, steps);
+
+    _mm_storeu_si128((__m128i*)(out + j),
+                     _mm_or_si128(_mm_and_si128(take_odd, odd),
+                                  _mm_andnot_si128(take_odd, even)));
+    _mm_storeu_si128((__m128i*)(out_offsets + j),
+                     _mm_or_si128(_mm_and_si128(take_odd, odd_offsets),
+                                  _mm_andnot_si128(take_odd, even_offsets)));
+  }
+#endif
+
+  for (; i < n; i += 2, ++j)
+  {
+    WavI16 sample = samples[i];
+    WavU16 offset = offsets ? offsets[i] : 0;
+
+    if (i + 1 < n && abs(samples[i + 1]) > abs(sample))
+    {
+      sample = samples[i + 1];
+      offset = (offsets ? offsets[i + 1] : 0) + step;
+    }
+
+    out[j] = sample;
+    out_offsets[j] = offset;
+  }
+
+  return j;
+}
+
+/*
+ * Decimate 'n' samples by 'factor' into 'out', with the offset of each in
+ * its group in 'offsets'. Returns the number of samples out.
+ */
+static size_t decimate(const WavI16* samples, size_t n, size_t factor,
+                       WavI16* out, WavU16* offsets)
+{
+  n = reduce_pairs(samples, NULL, n, 1, out, offsets);
+
+  for (WavU16 step = 2; step < factor; step *= 2)
+  {
+    n = reduce_pairs(out, offsets, n, step, out, offsets);
+  }
+
+  return n;
+}
+
+/*
+ * A chunk of samples to decode, which may have been decimated.
+ */
+typedef struct
+{
+  const WavI16* samples;
+  const WavU16* offsets;            // In each group, if decimated; else NULL
+  size_t        n;
+  size_t        factor;             // Input samples per sample
+  size_t        num_input_samples;
+} Chunk;
+
+// Offset in the input of the start of the group that sample 'i' is from.
+static inline size_t input_start(const Chunk* chunk, size_t i)
+{
+  return i < chunk->n ? i * chunk->factor : chunk->num_input_samples;
+}
+
+// Offset in the input of sample 'i' itself.
+static inline size_t input_offset(const Chunk* chunk, size_t i)
+{
+  return i * chunk->factor + (chunk->offsets ? chunk->offsets[i] : 0);
+}
+
+/*
+ * Windows cover more than two bits at the lowest frame rate, so there's
+ * always a spike in a window of LTC.
+ */
+static size_t gate_window_size(const LtcDecoder* decoder)
+{
+  size_t rate = decoder->sample_rate / decimation_factor(decoder);
+  size_t size = rate ? rate / 600 : 64;
+  return (size + 7) & ~(size_t)7;
+}
+
+typedef struct
+{
+  int16_t peak;           // Largest magnitude
+  int16_t max;            // Largest value
+  int64_t sum;
+  WavU64  sum_squares;
+} WindowLevels;
+
+static void window_levels(const WavI16* samples, size_t n, WindowLevels* levels)
+{
+  int16_t peak = 0;
+  int16_t max = 0;
+  int64_t sum = 0;
+  WavU64 sum_squares = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  if (n >= 8)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i peak8 = zero;
+    __m128i max8 = zero;
+    __m128i sum4 = zero;
+    __m128i squares2 = zero;
+    int32_t sums[4];
+    WavU64 squares[2];
+
+    for (; i + 8 <= n; i += 8)
+    {
+      __m128i x = _mm_loadu_si128((const __m128i*)(samples + i));
+      // Pairs of squares only reach 2^31, so they fit unsigned.
+      __m128i squares4 = _mm_madd_epi16(x, x);
+
+      peak8 = _mm_max_epi16(peak8, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+      max8 = _mm_max_epi16(max8, x);
+      sum4 = _mm_add_epi32(sum4, _mm_madd_epi16(x, ones));
+      squares2 = _mm_add_epi64(squares2, _mm_unpacklo_epi32(squares4, zero));
+      squares2 = _mm_add_epi64(squares2, _mm_unpackhi_epi32(squares4, zero));
+    }
+
+    peak8 = _mm_max_epi16(peak8, _mm_srli_si128(peak8, 8));
+    peak8 = _mm_max_epi16(peak8, _mm_srli_si128(peak8, 4));
+    peak8 = _mm_max_epi16(peak8, _mm_srli_si128(peak8, 2));
+    max8 = _mm_max_epi16(max8, _mm_srli_si128(max8, 8));
+    max8 = _mm_max_epi16(max8, _mm_srli_si128(max8, 4));
+    max8 = _mm_max_epi16(max8, _mm_srli_si128(max8, 2));
+    peak = (int16_t)_mm_cvtsi128_si32(peak8);
+    max = (int16_t)_mm_cvtsi128_si32(max8);
+
+    _mm_storeu_si128((__m128i*)sums, sum4);
+    _mm_storeu_si128((__m128i*)squares, squares2);
+    sum = (int64_t)sums[0] + sums[1] + sums[2] + sums[3];
+    sum_squares = squares[0] + squares[1];
+  }
+#endif
+
+  for (; i < n; ++i)
+  {
+    int16_t magnitude = samples[i] >= 0 ? samples[i]
+                      : samples[i] == INT16_MIN ? INT16_MAX : -samples[i];
+
+    if (magnitude > peak) peak = magnitude;
+    if (samples[i] > max) max = samples[i];
+    sum += samples[i];
+    sum_squares += (int32_t)samples[i] * samples[i];
+  }
+
+  levels->peak = peak;
+  levels->max = max;
+  levels->sum = sum;
+  levels->sum_squares = sum_squares;
+}
+
+/*
+ * Count the error in an interval of 'samples' between spikes against the
+ * 'expected' interval.
+ */
+static void count_jitter(LtcSignalStats* stats, size_t samples, double expected)
+{
+  double error = (samples - expected) / expected;
+  long bin = lround(error / 0.05) + LTC_JITTER_BINS / 2;
+
+  if (bin < 0) bin = 0;
+  if (bin >= LTC_JITTER_BINS) bin = LTC_JITTER_BINS - 1;
+  stats->jitter[bin]++;
+}
+
+/*
+ * Measure the 10-90% rise time of the edge whose spike is first over the
+ * threshold at 'i'. The edge runs from where the signal last turned before
+ * 'i' to where it peaks after it; edges that run off the block are skipped.
+ * Samples are 'factor' input samples apart.
+ */
+static void measure_rise_time(LtcSignalStats* stats, const WavI16* samples, size_t n, size_t i,
+                              size_t factor)
+{
+  const int sign = samples[i] > 0 ? 1 : -1;
+  const size_t max_len = 64;
+  size_t start = i, end = i;
+
+  while (start > 0 && i - start < max_len
+         && sign * samples[start - 1] < sign * samples[start]) --start;
+  while (end + 1 < n && end - i < max_len
+         && sign * samples[end + 1] > sign * samples[end]) ++end;
+
+  if (start == 0 || end + 1 == n) return;
+
+  double low = samples[start];
+  double step = samples[end] - low;
+  double t10 = -1, t90 = -1;
+
+  // Crossing points, interpolated between samples.
+  for (size_t j = start; j < end; ++j)
+  {
+    double a = (samples[j] - low) / step;
+    double b = (samples[j + 1] - low) / step;
+
+    if (t10 < 0 && a <= 0.1 && b > 0.1) t10 = j + (0.1 - a) / (b - a);
+    if (t90 < 0 && a <= 0.9 && b > 0.9) t90 = j + (0.9 - a) / (b - a);
+  }
+
+  if (t10 < 0 || t90 < 0) return;
+
+  stats->rise_time_sum += (t90 - t10) * factor;
+  stats->num_rise_times++;
+}
+
+/*
+ * Consume digits and output time code
+ */
+static void consume_buffered_digits(LtcDecoder* decoder, bool at_end)
+{
+  char* digits = decoder->digits;
+  bool got_frame;
+  size_t num_digits_consumed = consume_digits(decoder, digits, decoder->digit_count,
+                                              at_end, &got_frame);
+
+  // Remove consumed digits from buffer
+  memmove(digits, digits + num_digits_consumed, decoder->digit_count - num_digits_consumed);
+  memmove(decoder->digit_samples, decoder->digit_samples + num_digits_consumed,
+          (decoder->digit_count - num_digits_consumed) * sizeof(WavU64));
+  memmove(decoder->digit_signs, decoder->digit_signs + num_digits_consumed,
+          decoder->digit_count - num_digits_consumed);
+  decoder->digit_count -= num_digits_consumed;
+
+  if (got_frame)
+  {
+    log_info(decoder, 2, "Frame: %s", timecode_to_str(&decoder->last_timecode));
+  }
+}
+
+/*
+ * Skip a silent window that starts at 'sample'. The next spike starts afresh,
+ * and bits either side of the silence can't be part of the same frame, so
+ * the frames before it are decoded and the rest of the bits are dropped.
+ */
+static void skip_silence(LtcDecoder* decoder, WavU64 sample, size_t n)
+{
+  if (!decoder->in_silence)
+  {
+    log_info(decoder, 1, "Silence at sample %llu", (unsigned long long)sample);
+    decoder->in_silence = true;
+
+    consume_buffered_digits(decoder, true);
+
+    if (!decoder->seen_starting_timecode)
+    {
+      decoder->discarded_bits_at_start += decoder->digit_count;
+    }
+    decoder->digit_count = 0;
+
+    if (decoder->seen_starting_timecode) decoder->in_gap = true;
+  }
+
+  decoder->seen_spike = false;
+  decoder->last_digit_was_one = false;
+  decoder->samples_since_spike += n;
+}
+
+/*
+ * Decode up to GATE_MAX_WINDOWS windows of samples.
+ */
+static int process_chunk(LtcDecoder* decoder, const Chunk* chunk, size_t window_size)
+{
+  const WavI16* audio_samples = chunk->samples;
+  const size_t num_audio_samples = chunk->n;
+  const size_t num_windows = (num_audio_samples + window_size - 1) / window_size;
+  LtcSignalStats* stats = &decoder->stats;
+  bool silent = decoder->in_silence;
+  uint64_t active = 0;
+  size_t first_active = num_windows;
+
+  // Analyse the data to determine the mognitude of the spikes.
+  // - We expect a distribution like this
+  //
+  //                   *|*
+  //                   *|*
+  //   **             **|**                **
+  // -------------------|----------------------
+  //
+  // Most data is clustered around zero with some outliers,
+  // which are the spikes.
+  // So, we can consider any sample with a magnitude
+  // greater than half the max value to be a spike
+  int16_t max = 0;
+  for (size_t w = 0; w < num_windows; ++w)
+  {
+    size_t start = w * window_size;
+    size_t len = num_audio_samples - start < window_size ? num_audio_samples - start : window_size;
+    WindowLevels levels;
+
+    window_levels(audio_samples + start, len, &levels);
+
+    bool open = levels.peak >= GATE_FLOOR && levels.peak >= decoder->gate_level / 8;
+
+    // A window cut short by the end of the block might fall between spikes,
+    // so it can carry on a silence but not start one.
+    silent = !open && (len == window_size || silent);
+
+    size_t input_len = input_start(chunk, start + len) - input_start(chunk, start);
+
+    if (!silent)
+    {
+      active |= (uint64_t)1 << w;
+      if (first_active == num_windows) first_active = w;
+      stats->signal_samples += input_len;
+      stats->signal_sum += levels.sum;
+      stats->signal_sum_squares += levels.sum_squares;
+    }
+    else
+    {
+      stats->silent_samples += input_len;
+      stats->silent_sum_squares += levels.sum_squares;
+    }
+
+    if (levels.peak > stats->peak) stats->peak = levels.peak;
+
+    if (open)
+    {
+      if (levels.max > max) max = levels.max;
+      decoder->gate_level = levels.peak;
+    }
+    else
+    {
+      decoder->gate_level -= decoder->gate_level / 8;
+    }
+  }
+
+  // Only the end of the signal; spikes are at the level it was at.
+  if (active && max == 0) max = decoder->gate_level;
+
+  if (!active)
+  {
+    skip_silence(decoder, decoder->sample_count, num_audio_samples);
+    decoder->sample_count += chunk->num_input_samples;
+    return 0;
+  }
+
+  int16_t threshold = max >> 1;
+
+  log_info(decoder, 2, "Using threshold %d", threshold);
+  PROBE2(ltc, threshold, threshold, decoder->sample_count);
+
+  /*
+   * If it's the first block of data, calibrate the FPS
+   */
+  if (decoder->digit_count == 0 && decoder->fps == 0)
+  {
+    size_t start = first_active * window_size;
+
+    decoder->fps = detect_fps(audio_samples + start, num_audio_samples - start,
+                              decoder->sample_rate / chunk->factor, threshold);
+
+    if (decoder->fps == -1)
+    {
+      decoder->fps = 0;
+
+      // There may not have been enough bits to tell, if the signal only
+      // started in this block or the sample rate is high; keep trying with
+      // the next, for up to a second of signal.
+      decoder->fps_search_samples += chunk->num_input_samples - input_start(chunk, start);
+
+      if (decoder->fps_search_samples < decoder->sample_rate)
+      {
+        decoder->in_silence = false;
+        decoder->samples_since_spike += num_audio_samples;
+        decoder->sample_count += chunk->num_input_samples;
+        return 0;
+      }
+
+      log_error(decoder, 415, "Failed to detect FPS; input does not contain LTC.");
+      return -1;
+    }
+
+    log_info(decoder, 1, "Detected FPS=%d", decoder->fps);
+  }
+
+
+  /*
+   * Process audio samples to digits.
+   */
+  double samples_per_bit = (double)decoder->sample_rate / chunk->factor / (decoder->fps * 80);
+  size_t short_long_threshold = 0.75 * samples_per_bit;
+  char* digits = decoder->digits;
+
+  for (size_t w = 0; w < num_windows; ++w)
+  {
+    size_t start = w * window_size;
+    size_t end = start + window_size < num_audio_samples ? start + window_size : num_audio_samples;
+
+    if (!(active & ((uint64_t)1 << w)))
+    {
+      skip_silence(decoder, decoder->sample_count + input_start(chunk, start), end - start);
+      continue;
+    }
+
+    decoder->in_silence = false;
+
+    for (size_t i = start; i < end; ++i, ++decoder->samples_since_spike)
+    {
+      if ((abs(audio_samples[i]) > (max >> 1))
+          // The sampling might give two adjacent samples in the spike
+          && decoder->samples_since_spike > 1
+          )
+      {
+        PROBE1(ltc, spike, decoder->sample_count + input_offset(chunk, i));
+
+        measure_rise_time(stats, audio_samples, num_audio_samples, i, chunk->factor);
+
+        // If this is not the first spike, then it makes sense
+        // to calculate the duration since the last spike.
+        if (decoder->seen_spike)
+        {
+          // The bit started at the previous spike.
+          decoder->digit_samples[decoder->digit_count] = decoder->last_spike_sample;
+          decoder->digit_signs[decoder->digit_count] = decoder->last_spike_sign;
+
+          if (decoder->samples_since_spike < short_long_threshold)
+          {
+            count_jitter(stats, decoder->samples_since_spike, samples_per_bit / 2);
+
+            // Short -> 1
+            // (Two spikes equates to a '1', so skip the second)
+            if (!decoder->last_digit_was_one)
+            {
+              PROBE2(ltc, bit, 1, decoder->last_spike_sample);
+              digits[decoder->digit_count++] = '1';
+              decoder->last_digit_was_one = true;
+            }
+            else
+            {
+              decoder->last_digit_was_one = false;
+            }
+          }
+          else
+          {
+            // Long --> 0
+            count_jitter(stats, decoder->samples_since_spike, samples_per_bit);
+            PROBE2(ltc, bit, 0, decoder->last_spike_sample);
+            decoder->last_digit_was_one = false;
+            digits[decoder->digit_count++] = '0';
+          }
+        }
+
+        decoder->seen_spike = true;
+        decoder->samples_since_spike = 0;
+        decoder->last_spike_sample = decoder->sample_count + input_offset(chunk, i);
+        decoder->last_spike_sign = audio_samples[i] > 0 ? 1 : -1;
+
+        /*
+         * If we've over-filled the digits buffer then it's likely that
+         * consume_digits() has not found any valid LTC frames.
+         */
+        if (decoder->digit_count == sizeof(decoder->digits))
+        {
+          log_error(decoder, 415, "No LTC frames found in input file.");
+          return -1;
+        }
+      }
+    }
+  }
+
+  decoder->sample_count += chunk->num_input_samples;
+
+  consume_buffered_digits(decoder, false);
+
+  return 0;
+}
+
+int ltc_decoder_process(LtcDecoder* decoder, const WavI16* audio_samples, size_t num_audio_samples)
+{
+  const size_t factor = decimation_factor(decoder);
+  const size_t window_size = gate_window_size(decoder);
+  const size_t chunk_size = window_size * GATE_MAX_WINDOWS * factor;
+  WavI16 decimated[GATE_MAX_WINDOWS * DECIMATED_MAX_WINDOW];
+  WavU16 offsets[GATE_MAX_WINDOWS * DECIMATED_MAX_WINDOW];
+
+  for (size_t offset = 0; offset < num_audio_samples; offset += chunk_size)
+  {
+    size_t n = num_audio_samples - offset < chunk_size ? num_audio_samples - offset : chunk_size;
+    Chunk chunk = {audio_samples + offset, NULL, n, factor, n};
+
+    if (factor > 1)
+    {
+      chunk.n = decimate(audio_samples + offset, n, factor, decimated, offsets);
+      chunk.samples = decimated;
+      chunk.offsets = offsets;
+    }
+
+    if (process_chunk(decoder, &chunk, window_size) != 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void ltc_decoder_finish(LtcDecoder* decoder)
+{
+  if (decoder->have_candidate)
+  {
+    log_info(decoder, 1, "Rejected false lock at %s",
+             timecode_to_str(&decoder->candidate_timecode));
+    count_error(decoder, decoder->candidate_sample);
+    decoder->have_candidate = false;
+  }
+
+  if (decoder->seen_starting_timecode)
+  {
+    close_range(decoder);
+  }
+
+  end_drift_window(decoder);
+  close_drift_segment(decoder);
+
+  LtcDriftFit* total = &decoder->drift_total;
+  LtcDriftSegment* drift = &decoder->drift;
+
+  if (drift_fit_ppm(decoder, total, &drift->ppm, &drift->ppm_error) == 0)
+  {
+    drift->start_sample = total->start_sample;
+    drift->end_sample = total->end_sample;
+    drift->num_frames = total->num_frames;
+
+    log_info(decoder, 1, "Clock drift %+.2f ppm (+/- %.2f) over %llu frames",
+             drift->ppm, drift->ppm_error, (unsigned long long)drift->num_frames);
+  }
+}
+
+size_t ltc_decoder_pad_to_frame(LtcDecoder* decoder, SMPTETimecode* start_ptr)
+{
+  double samples_per_frame = (double)decoder->sample_rate / decoder->fps;
+
+  // Number of frames, partial or not, in front of the first complete frame.
+  long frames_before = (long)ceil(decoder->first_sample / samples_per_frame);
+
+  if (start_ptr)
+  {
+    frames_to_timecode(start_ptr,
+                       timecode_to_frames(&decoder->first_timecode, decoder->fps) - frames_before,
+                       decoder->fps);
+  }
+
+  return (size_t)(frames_before * samples_per_frame + 0.5) - decoder->first_sample;
+}
+
+int ltc_decoder_find_first_frame(LtcDecoder* decoder, const char* filename,
+                                 unsigned channel, int fps,
+                                 LtcLogFunc log, void* log_context,
+                                 size_t* frame_size_ptr)
+{
+  int rv = -1;
+  int16_t buffer[512];
+  WavFile* fptr = wav_open(filename, "r");
+
+  // Logging goes through the decoder, so set it up before anything can fail.
+  ltc_decoder_init(decoder, 0, fps, log, log_context);
+
+  if (!fptr)
+  {
+    log_error(decoder, 500, "Out of memory opening input file");
+    return -1;
+  }
+
+  if (wav_file_err(fptr)->code != WAV_OK)
+  {
+    log_error(decoder, 404, "%s", wav_file_err(fptr)->message);
+    goto exit;
+  }
+
+  WavU16 n_channels = wav_get_num_channels(fptr);
+
+  if (channel >= n_channels)
+  {
+    log_error(decoder, 415, "Input has no channel %u", channel);
+    goto exit;
+  }
+
+  if (frame_size_ptr) *frame_size_ptr = n_channels * wav_get_sample_size(fptr);
+
+  decoder->sample_rate = wav_get_sample_rate(fptr);
+
+  while (!decoder->seen_first_timecode)
+  {
+    size_t num_audio_samples = wav_read_channel_i16(fptr, channel, buffer, countof(buffer));
+
+    if (num_audio_samples == 0)
+    {
+      if (wav_file_err(fptr)->code != WAV_OK)
+      {
+        log_error(decoder, 415, "%s", wav_file_err(fptr)->message);
+      }
+      else
+      {
+        log_error(decoder, 415, "No timecode found in file.");
+      }
+      goto exit;
+    }
+
+    if (ltc_decoder_process(decoder, buffer, num_audio_samples) != 0)
+    {
+      goto exit;
+    }
+  }
+
+  rv = 0;
+
+exit:
+  wav_close(fptr);
+  return rv;
+}
+
+/*
+ * Seeking to a timecode
+ *
+ * The sample that the target frame starts at is predicted from the frames
+ * either side of it, and checked by decoding a few frames from just before
+ * there. Where the frames either side don't follow on from each other at the
+ * frame rate, there's a gap or jump between them, so the stretch is split
+ * where a probe lands and each part is searched in turn; a part whose ends
+ * do follow on only needs searching if the target is between them. So a
+ * recording that runs on costs a probe or two, and each discontinuity a few
+ * more. Frames are numbered from the first frame of the input, and a frame
+ * only counts once the frame after it, or before it, follows on, as the
+ * first frame after seeking may be a false lock.
+ */
+#define FIND_LEAD_FRAMES    3       // Decoded ahead of the prediction, to lock on
+#define FIND_PROBE_FRAMES   16      // Most frames a probe decodes
+#define FIND_MAX_PROBES     256
+#define FIND_MAX_PPM        1000    // Clock drift allowed between frames that follow on
+
+typedef struct
+{
+  WavU64  sample;
+  long    frame;
+} FindPoint;
+
+typedef struct
+{
+  LtcDecoder*         decoder;        // For the frame rate and logging...
+  LtcDecoder*         probe;          // ...and to decode each probe with
+  WavFile*            fptr;
+  unsigned            channel;
+  WavU64              length;
+  double              samples_per_frame;
+  long                target;
+  int                 num_probes;
+
+  // Frames of the current probe
+  WavU64              start;
+  FindPoint           points[FIND_PROBE_FRAMES];
+  size_t              num_points;
+  FindPoint           prev;           // Last frame, until the next follows on
+  bool                have_prev;
+  bool                found;
+  WavU64              sample;         // Of the target, once found
+} Finder;
+
+static void add_find_point(Finder* finder, const FindPoint* point)
+{
+  if (point->frame == finder->target)
+  {
+    finder->found = true;
+    finder->sample = point->sample;
+  }
+
+  if (finder->num_points < countof(finder->points))
+  {
+    finder->points[finder->num_points++] = *point;
+  }
+}
+
+static void find_frame(void* context, const SMPTETimecode* timecode, WavU64 sample)
+{
+  Finder* finder = context;
+  FindPoint point = {finder->start + sample,
+                     timecode_diff(timecode, &finder->decoder->first_timecode,
+                                   finder->decoder->fps)};
+
+  if (finder->have_prev && point.frame == finder->prev.frame + 1)
+  {
+    // The previous frame was only counted if it followed on from the one before.
+    if (finder->num_points == 0 || finder->points[finder->num_points - 1].sample != finder->prev.sample)
+    {
+      add_find_point(finder, &finder->prev);
+    }
+    add_find_point(finder, &point);
+  }
+
+  finder->prev = point;
+  finder->have_prev = true;
+}
+
+/*
+ * Decode from 'start' until 'end', the target is found, or the probe has as
+ * many frames as it can hold. Returns -1 if the input can't be read.
+ */
+static int probe_frames(Finder* finder, WavU64 start, WavU64 end)
+{
+  LtcDecoder* decoder = finder->decoder;
+  LtcDecoder* probe = finder->probe;
+  int16_t buffer[512];
+  WavU64 pos = start;
+
+  finder->num_probes++;
+  finder->start = start;
+  finder->num_points = 0;
+  finder->have_prev = false;
+
+  if (end > finder->length) end = finder->length;
+
+  if (wav_seek(finder->fptr, (long)start, SEEK_SET) != 0)
+  {
+    log_error(decoder, 415, "%s", wav_file_err(finder->fptr)->message);
+    return -1;
+  }
+
+  ltc_decoder_init(probe, decoder->sample_rate, decoder->fps, NULL, NULL);
+  probe->on_frame = find_frame;
+  probe->frame_context = finder;
+
+  while (!finder->found && finder->num_points < countof(finder->points) && pos < end)
+  {
+    size_t n = end - pos < countof(buffer) ? (size_t)(end - pos) : countof(buffer);
+    size_t num_audio_samples = wav_read_channel_i16(finder->fptr, finder->channel, buffer, n);
+
+    if (num_audio_samples == 0)
+    {
+      if (wav_file_err(finder->fptr)->code != WAV_OK)
+      {
+        log_error(decoder, 415, "%s", wav_file_err(finder->fptr)->message);
+        ltc_decoder_free(probe);
+        return -1;
+      }
+      break;
+    }
+
+    ltc_decoder_process(probe, buffer, num_audio_samples);
+    pos += num_audio_samples;
+  }
+
+  ltc_decoder_free(probe);
+
+  log_info(decoder, 1, "Probe %d from sample %llu: %zu frames",
+           finder->num_probes, (unsigned long long)start, finder->num_points);
+
+  return 0;
+}
+
+/*
+ * Search between the frames 'lo' and 'hi', or from 'lo' to where the frames
+ * end at 'hi.sample' if '!hi_known'. Returns 1 if the target was found, 0 if
+ * it isn't there, or -1 on an error.
+ */
+static int search_frames(Finder* finder, FindPoint lo, FindPoint hi, bool hi_known)
+{
+  const double samples_per_frame = finder->samples_per_frame;
+  const WavU64 lead = (WavU64)(FIND_LEAD_FRAMES * samples_per_frame);
+
+  while (hi.sample > lo.sample + samples_per_frame)
+  {
+    const long frames = hi.frame - lo.frame;
+    const double elapsed = (hi.sample - lo.sample) / samples_per_frame;
+    double predicted;
+
+    if (hi_known && fabs(frames - elapsed) <= 1 + elapsed * FIND_MAX_PPM * 1e-6)
+    {
+      // No gaps or jumps, so the target is here if it's between the ends.
+      if (finder->target <= lo.frame || finder->target >= hi.frame) return 0;
+
+      predicted = lo.sample + (finder->target - lo.frame) * (hi.sample - lo.sample) / (double)frames;
+    }
+    else if (finder->target > lo.frame
+             && lo.sample + (finder->target - lo.frame) * samples_per_frame < hi.sample)
+    {
+      // Carry on from 'lo', as the frames usually do.
+      predicted = lo.sample + (finder->target - lo.frame) * samples_per_frame;
+    }
+    else
+    {
+      predicted = (lo.sample + hi.sample) / 2.0 + lead;
+    }
+
+    if (finder->num_probes == FIND_MAX_PROBES)
+    {
+      log_error(finder->decoder, 416, "Gave up after %d probes", finder->num_probes);
+      return -1;
+    }
+
+    WavU64 start = predicted > lo.sample + lead ? (WavU64)predicted - lead : lo.sample;
+    if (start >= hi.sample) start = lo.sample;
+
+    if (probe_frames(finder, start, hi.sample + 2 * (WavU64)samples_per_frame) != 0) return -1;
+    if (finder->found) return 1;
+
+    if (finder->num_points == 0)
+    {
+      // Nothing from 'start' on, so the frames end before it.
+      hi.sample = start;
+      hi_known = false;
+      continue;
+    }
+
+    FindPoint first = finder->points[0];
+    FindPoint last = finder->points[finder->num_points - 1];
+
+    int rv = search_frames(finder, lo, first, true);
+    if (rv != 0) return rv;
+
+    lo = last;
+  }
+
+  return 0;
+}
+
+int ltc_decoder_find_timecode(LtcDecoder* decoder, const char* filename,
+                              unsigned channel, int fps, const SMPTETimecode* target,
+                              LtcLogFunc log, void* log_context, WavU64* sample_ptr)
+{
+  int rv = -1;
+  Finder finder;
+
+  if (ltc_decoder_find_first_frame(decoder, filename, channel, fps,
+                                   log, log_context, NULL) != 0)
+  {
+    return -1;
+  }
+
+  if (target->frame >= decoder->fps)
+  {
+    log_error(decoder, 416, "%s isn't a frame at %d fps",
+              timecode_to_str((SMPTETimecode*)target), decoder->fps);
+    return -1;
+  }
+
+  memset(&finder, 0, sizeof(finder));
+  finder.decoder = decoder;
+  finder.channel = channel;
+  finder.samples_per_frame = (double)decoder->sample_rate / decoder->fps;
+  finder.target = timecode_diff(target, &decoder->first_timecode, decoder->fps);
+
+  if (finder.target == 0)
+  {
+    *sample_ptr = decoder->first_sample;
+    return 0;
+  }
+
+  finder.fptr = wav_open(filename, "r");
+  finder.probe = wav_malloc(sizeof(LtcDecoder));
+
+  if (!finder.fptr || !finder.probe)
+  {
+    log_error(decoder, 500, "Out of memory opening input file");
+    goto exit;
+  }
+
+  if (wav_file_err(finder.fptr)->code != WAV_OK)
+  {
+    log_error(decoder, 404, "%s", wav_file_err(finder.fptr)->message);
+    goto exit;
+  }
+
+  finder.length = wav_get_length(finder.fptr);
+
+  FindPoint first = {decoder->first_sample, 0};
+  FindPoint end = {finder.length, 0};
+
+  switch (search_frames(&finder, first, end, false))
+  {
+    case 1:
+      *sample_ptr = finder.sample;
+      rv = 0;
+      break;
+
+    case 0:
+      log_error(decoder, 416, "%s isn't in the file",
+                timecode_to_str((SMPTETimecode*)target));
+      break;
+
+    default:
+      break;
+  }
+
+exit:
+  if (finder.fptr) wav_close(finder.fptr);
+  wav_free(finder.probe);
+  return rv;
+}
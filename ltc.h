@@ -0,0 +1,301 @@
+/*
+ * LTC decoder shared by ltcdump and the tools that need to know where the
+ * timecode in a recording starts.
+ *
+ * The decoder is fed blocks of 16 bit mono audio. High sample rates are
+ * decimated and silent stretches are skipped; the rest of each block is
+ * analysed on its own to choose a spike threshold, spikes are turned into
+ * bits and bits into LTC frames. Contiguous runs of frames are collected
+ * into a linked list of timecode ranges.
+ */
+#ifndef __LTC_H__
+#define __LTC_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+#include "wav.h"
+
+typedef char bool;
+
+/*
+ * The 80 bits of the LTC frame as a C struct.
+ * Taken from libltc
+ *
+ * Little Endian version -- and doxygen doc
+ * */
+struct LTCFrame {
+        unsigned int frame_units:4; ///< SMPTE framenumber BCD unit 0..9
+        unsigned int user1:4;
+
+        unsigned int frame_tens:2; ///< SMPTE framenumber BCD tens 0..3
+        unsigned int dfbit:1; ///< indicated drop-frame timecode
+        unsigned int col_frame:1; ///< colour-frame: timecode intentionally synchronized to a colour TV field sequence
+        unsigned int user2:4;
+
+        unsigned int secs_units:4; ///< SMPTE seconds BCD unit 0..9
+        unsigned int user3:4;
+
+        unsigned int secs_tens:3; ///< SMPTE seconds BCD tens 0..6
+        unsigned int biphase_mark_phase_correction:1; ///< see note on Bit 27 in description and \ref ltc_frame_set_parity .
+        unsigned int user4:4;
+
+        unsigned int mins_units:4; ///< SMPTE minutes BCD unit 0..9
+        unsigned int user5:4;
+
+        unsigned int mins_tens:3; ///< SMPTE minutes BCD tens 0..6
+        unsigned int binary_group_flag_bit0:1; ///< indicate user-data char encoding, see table above - bit 43
+        unsigned int user6:4;
+
+        unsigned int hours_units:4; ///< SMPTE hours BCD unit 0..9
+        unsigned int user7:4;
+
+        unsigned int hours_tens:2; ///< SMPTE hours BCD tens 0..2
+        unsigned int binary_group_flag_bit1:1; ///< indicate timecode is local time wall-clock, see table above - bit 58        unsigned int binary_group_flag_bit2:1; ///< indicate user-data char encoding (or parity with 25fps), see table above - bit 59
+        unsigned int user8:4;
+
+        unsigned int sync_word:16;
+};
+typedef struct LTCFrame LTCFrame;
+
+/**
+ * Human readable time representation, decimal values.
+ */
+struct SMPTETimecode {
+        char timezone[6];   ///< the timezone 6bytes: "+HHMM" textual representation
+        unsigned char years; ///< LTC-date uses 2-digit year 00.99
+        unsigned char months; ///< valid months are 1..12
+        unsigned char days; ///< day of month 1..31
+
+        unsigned char hours; ///< hour 0..23
+        unsigned char mins; ///< minute 0..60
+        unsigned char secs; ///< second 0..60
+        unsigned char frame; ///< sub-second frame 0..(FPS - 1)
+};
+typedef struct SMPTETimecode SMPTETimecode;
+
+/*
+ * Encapsulate a node in a linked list of ranges of timecodes.
+ */
+typedef struct _SMPTETimecodeRange
+{
+  SMPTETimecode start, end;
+  WavU64 start_sample;    // Sample index of the first bit of 'start'
+  struct _SMPTETimecodeRange* next_ptr;
+} SMPTETimecodeRange;
+
+char* timecode_to_str(SMPTETimecode* stime);
+
+/*
+ * Parse "HH:MM:SS:FF", with ';' or '.' allowed before the frames, into
+ * 'stime'. Returns 0 on success or -1 if it isn't a time of day.
+ */
+int timecode_from_str(const char* str, SMPTETimecode* stime);
+
+/*
+ * Convert between a timecode and the number of frames since midnight.
+ */
+long timecode_to_frames(const SMPTETimecode* stime, int fps);
+void frames_to_timecode(SMPTETimecode* stime, long frames, int fps);
+
+SMPTETimecodeRange* create_timecode_range(SMPTETimecode* start, SMPTETimecode* end);
+void timecode_range_append(SMPTETimecodeRange** first_pptr, SMPTETimecodeRange* new_ptr);
+void free_timecode_ranges(SMPTETimecodeRange* first_ptr);
+
+/*
+ * Health of the LTC signal, gathered as it's decoded. Levels are of 16 bit
+ * samples. Everything is a fixed size, however long the input is.
+ */
+#define LTC_JITTER_BINS     17      // Bit period error, in 5% bins centred on -40% to +40%
+#define LTC_STATS_MINUTES   1440    // Later minutes are counted in the last
+
+typedef struct
+{
+  WavU64  signal_samples;         // Samples that passed the silence gate...
+  double  signal_sum;             // ...for the DC offset...
+  double  signal_sum_squares;     // ...and RMS of the signal
+  WavU64  silent_samples;         // Samples that didn't...
+  double  silent_sum_squares;     // ...for the RMS of the noise floor
+  WavI16  peak;                   // Largest magnitude
+  WavU64  jitter[LTC_JITTER_BINS];// Intervals between spikes by their error
+  double  rise_time_sum;          // Total 10-90% rise time of the edges...
+  WavU64  num_rise_times;         // ...measured, in samples
+  WavU64  positive_frames;        // Frames that start with a rising edge...
+  WavU64  negative_frames;        // ...or a falling edge
+  size_t  num_minutes;
+  WavU32  frames_per_minute[LTC_STATS_MINUTES];
+  WavU32  errors_per_minute[LTC_STATS_MINUTES];  // Lost syncs and false locks
+} LtcSignalStats;
+
+/*
+ * Least squares fit of the sample index at which frames start against their
+ * frame number, pooled over runs of contiguous frames that each have their
+ * own offset. The slope is the number of samples per frame.
+ */
+typedef struct
+{
+  WavU64  num_frames;
+  size_t  num_runs;
+  double  sxx, sxy, syy;          // Sums of squares and products about each run's means
+  WavU64  start_sample, end_sample;
+} LtcDriftFit;
+
+/*
+ * Stretch of the input over which the recorder's sample rate, relative to
+ * the LTC clock, stayed the same.
+ */
+typedef struct _LtcDriftSegment
+{
+  WavU64  start_sample, end_sample;
+  WavU64  num_frames;
+  double  ppm;                    // Effective sample rate over nominal, less one, in ppm...
+  double  ppm_error;              // ...within this at 95% confidence
+  struct _LtcDriftSegment* next_ptr;
+} LtcDriftSegment;
+
+void free_drift_segments(LtcDriftSegment* first_ptr);
+
+/*
+ * Messages from the decoder. A 'status_code' of zero is informational and
+ * 'level' is its verbosity level; otherwise it is an error.
+ */
+typedef void (*LtcLogFunc)(void* context, int level, int status_code,
+                           const char* fmt, va_list args);
+
+/*
+ * Told of each frame the decoder accepts, and the sample its first bit
+ * started at, in order.
+ */
+typedef void (*LtcFrameFunc)(void* context, const SMPTETimecode* timecode, WavU64 sample);
+
+typedef struct
+{
+  // Configuration
+  int                 fps;            // 0 until detected or overridden
+  WavU32              sample_rate;
+  LtcLogFunc          log;
+  void*               log_context;
+  bool                split_on_jump;  // End ranges where the timecode jumps
+  LtcFrameFunc        on_frame;       // Optional
+  void*               frame_context;
+
+  // Bits decoded from the audio, and the sample index at which each started.
+  char                digits[512];
+  WavU64              digit_samples[512];
+  signed char         digit_signs[512];   // ...and the sign of that spike
+  size_t              digit_count;
+
+  // Spike detection
+  bool                seen_spike;     // Have we seen a spike yet
+  size_t              samples_since_spike;
+  WavU64              last_spike_sample;
+  signed char         last_spike_sign;
+  bool                last_digit_was_one; // Was the last digit output a 1 ?
+  WavU64              sample_count;   // Samples processed so far
+  WavU64              fps_search_samples; // Signal that the FPS couldn't be detected in
+
+  // Silence gate
+  WavI16              gate_level;     // Peak of the last window of signal
+  bool                in_silence;     // Skipping windows under the gate
+
+  // Frames
+  SMPTETimecode       starting_timecode;  // 1st code in current range.
+  WavU64              starting_sample;    // ...and the sample it started at.
+  SMPTETimecode       last_timecode;      // Last code we saw
+  WavU64              last_sample;        // ...and the sample it started at.
+  bool                seen_starting_timecode;
+
+  // Resynchronisation after losing the sync word.
+  bool                in_gap;             // Discarding bits since the last frame
+  bool                have_candidate;     // Unconfirmed frame after a gap...
+  SMPTETimecode       candidate_timecode;
+  WavU64              candidate_sample;   // ...and the sample it started at.
+
+  // Clock drift: the run of frames since the last discontinuity or window,
+  // their means, and the windows so far that agree on the rate.
+  LtcDriftFit         drift_window;
+  double              drift_mean_x, drift_mean_y;
+  long                drift_x;            // Frame number of the last in the run
+  LtcDriftFit         drift_segment;
+  LtcDriftFit         drift_total;        // ...and the segments before it
+
+  // First frame in the input and the sample index of its first bit.
+  bool                seen_first_timecode;
+  SMPTETimecode       first_timecode;
+  WavU64              first_sample;
+
+  // Results
+  SMPTETimecodeRange* timecode_range_ptr;
+  size_t              discarded_bits_at_start;
+  LtcSignalStats      stats;
+  LtcDriftSegment     drift;              // Over the whole input, once finished
+  LtcDriftSegment*    drift_segment_ptr;
+} LtcDecoder;
+
+/*
+ * Initialise 'decoder'. If 'fps' is zero, it's detected from the first block.
+ */
+void ltc_decoder_init(LtcDecoder* decoder, WavU32 sample_rate, int fps,
+                      LtcLogFunc log, void* log_context);
+
+/*
+ * Decode a block of mono samples. Returns 0 on success or -1 if the input
+ * could not be decoded; the reason will have been logged.
+ */
+int ltc_decoder_process(LtcDecoder* decoder, const WavI16* samples, size_t n);
+
+/*
+ * Close the current timecode range at the end of the input and the clock
+ * drift estimate.
+ */
+void ltc_decoder_finish(LtcDecoder* decoder);
+
+void ltc_decoder_free(LtcDecoder* decoder);
+
+/*
+ * Write the state of 'decoder', with its ranges and drift segments so far,
+ * to 'fptr', so that decoding can carry on from 'sample_count' later.
+ * Returns 0 on success or -1 on a write error.
+ */
+int ltc_decoder_save(const LtcDecoder* decoder, FILE* fptr);
+
+/*
+ * Restore 'decoder' from state written by ltc_decoder_save(), keeping its
+ * log function. Returns 0 on success or -1 if the state is truncated or was
+ * written by a build of the decoder with a different version or layout of
+ * the state.
+ */
+int ltc_decoder_load(LtcDecoder* decoder, FILE* fptr);
+
+/*
+ * Number of samples to pad the start of the input with so that it begins on
+ * a frame boundary, given that the first complete frame started at
+ * 'first_sample'. '*start_ptr' is set to the timecode of the frame that the
+ * padded input starts with.
+ */
+size_t ltc_decoder_pad_to_frame(LtcDecoder* decoder, SMPTETimecode* start_ptr);
+
+/*
+ * Initialise 'decoder' and decode 'channel' of 'filename' until the first
+ * complete frame. Returns 0 on success, or -1 if no frame was found; the
+ * reason will have been logged. The size of an interleaved frame of the input
+ * is returned in '*frame_size_ptr' if it's not NULL.
+ */
+int ltc_decoder_find_first_frame(LtcDecoder* decoder, const char* filename,
+                                 unsigned channel, int fps,
+                                 LtcLogFunc log, void* log_context,
+                                 size_t* frame_size_ptr);
+
+/*
+ * Initialise 'decoder' and find the sample at which the frame 'target' of
+ * 'channel' of 'filename' starts, without decoding the whole file: the
+ * frame's position is predicted from the first frame, and checked and
+ * refined by decoding a few frames around it. Returns 0 on success with the
+ * sample in '*sample_ptr', or -1 if the frame isn't in the file or the file
+ * couldn't be decoded; the reason will have been logged. Where the timecode
+ * goes back on itself, the frame found may not be the first with 'target'.
+ */
+int ltc_decoder_find_timecode(LtcDecoder* decoder, const char* filename,
+                              unsigned channel, int fps, const SMPTETimecode* target,
+                              LtcLogFunc log, void* log_context, WavU64* sample_ptr);
+
+#endif /* __LTC_H__ */
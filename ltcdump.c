@@ -2,84 +2,322 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 #include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "wav.h"
+#include "ltc.h"
+#include "probes.h"
 
-typedef char bool;
 static const char false = 0;
 static const char true = 1;
 
 int verbosity = 0;
 bool json_output = false;
 
+#define countof(x)  (sizeof(x) / sizeof(x[0]))
+
+/*
+ * Memory
+ *
+ * Everything that ltcdump and libwav allocate goes through wav_malloc(),
+ * which is pointed at these counters so that --stats can show what a decode
+ * costs. Each block is preceded by its size.
+ */
+typedef struct
+{
+  WavU64 allocations;     // Calls to malloc and realloc...
+  WavU64 frees;           // ...and free
+  WavU64 total_bytes;     // Allocated over the run
+  WavU64 bytes;           // In use now...
+  WavU64 peak_bytes;      // ...and at most
+} MemoryStats;
 
-// Unsigned error return value
-static const size_t ST_ERROR = 0xffffffff;
+static MemoryStats memory_stats;
 
-static const char* SYNC_WORD_STR = "0011111111111101";
-static unsigned int SYNC_WORD = 0xbffc;
+#define BLOCK_HEADER_SIZE  16     // Keeps blocks aligned as malloc() does
+
+static void count_allocation(WavU64 size)
+{
+  WavU64 bytes = __atomic_add_fetch(&memory_stats.bytes, size, __ATOMIC_RELAXED);
+  WavU64 peak = __atomic_load_n(&memory_stats.peak_bytes, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&memory_stats.allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&memory_stats.total_bytes, size, __ATOMIC_RELAXED);
+
+  while (bytes > peak
+         && !__atomic_compare_exchange_n(&memory_stats.peak_bytes, &peak, bytes, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void count_free(WavU64 size)
+{
+  __atomic_sub_fetch(&memory_stats.bytes, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&memory_stats.frees, 1, __ATOMIC_RELAXED);
+}
+
+static void* counted_malloc(void* context, size_t size)
+{
+  (void)context;
+  WavU64* block = malloc(BLOCK_HEADER_SIZE + size);
+
+  if (!block) return NULL;
+
+  *block = size;
+  count_allocation(size);
+  return (char*)block + BLOCK_HEADER_SIZE;
+}
+
+static void* counted_realloc(void* context, void* p, size_t size)
+{
+  if (!p) return counted_malloc(context, size);
+
+  WavU64* block = (WavU64*)((char*)p - BLOCK_HEADER_SIZE);
+  WavU64 old_size = *block;
+
+  block = realloc(block, BLOCK_HEADER_SIZE + size);
+  if (!block) return NULL;
+
+  *block = size;
+  count_free(old_size);
+  count_allocation(size);
+  return (char*)block + BLOCK_HEADER_SIZE;
+}
+
+static void counted_free(void* context, void* p)
+{
+  (void)context;
+  WavU64* block = (WavU64*)((char*)p - BLOCK_HEADER_SIZE);
+
+  count_free(*block);
+  free(block);
+}
+
+static WavAllocFuncs counted_alloc_funcs = {
+  &counted_malloc,
+  &counted_realloc,
+  &counted_free
+};
+
+static void print_memory_stats(void)
+{
+  fprintf(stderr, "Memory: %llu allocations, %llu frees, %llu bytes allocated, "
+          "%llu bytes at peak, %llu bytes in use\n",
+          (unsigned long long)memory_stats.allocations,
+          (unsigned long long)memory_stats.frees,
+          (unsigned long long)memory_stats.total_bytes,
+          (unsigned long long)memory_stats.peak_bytes,
+          (unsigned long long)memory_stats.bytes);
+}
 
-#define countof(x)  (sizeof(x) / sizeof(x[0]))
 
 /*
  * Logging
+ *
+ * Message text is kept in blocks that are reused when the queue is cleared,
+ * so that logging doesn't allocate once there's enough room.
  */
-typedef struct 
+#define TEXT_BLOCK_SIZE  16384
+
+typedef struct _TextBlock
+{
+  struct _TextBlock* next_ptr;
+  size_t size, used;
+  char text[];
+} TextBlock;
+
+typedef struct
 {
   const char* string;
   int level;
   int status_code;
 } Msg;
 
-typedef struct 
+typedef struct
 {
   Msg msgs[4096];
   size_t n;
+  TextBlock* text_ptr;    // Newest block first
 } Queue;
 
-static Queue info_queue = {0};
-static Queue error_queue = {0};
+static char* queue_text(Queue* queue, size_t len)
+{
+  TextBlock* block = queue->text_ptr;
+
+  if (!block || block->size - block->used < len)
+  {
+    size_t size = len > TEXT_BLOCK_SIZE ? len : TEXT_BLOCK_SIZE;
+
+    block = wav_malloc(sizeof(TextBlock) + size);
+    if (!block) return NULL;
+
+    block->size = size;
+    block->used = 0;
+    block->next_ptr = queue->text_ptr;
+    queue->text_ptr = block;
+  }
+
+  char* text = block->text + block->used;
+  block->used += len;
+  return text;
+}
 
 static void vqueue_msg(Queue* queue, int level, int status_code, const char*fmt, va_list args)
 {
+  if (queue->n == countof(queue->msgs))
+  {
+    return;
+  }
+
   va_list args_copy;
   va_copy(args_copy, args);
   int size = vsnprintf(NULL, (size_t)0, fmt, args_copy);
   va_end(args_copy);
 
-  char* str = malloc(size + 1);
-  vsprintf(str, fmt, args);
+  char* str = queue_text(queue, size + 1);
+  if (!str) return;
+
+  vsnprintf(str, size + 1, fmt, args);
+
+  Msg* msg = &queue->msgs[queue->n++];
+
+  msg->string = str;
+  msg->level = level;
+  msg->status_code = status_code;
+}
+
+/*
+ * Empty 'queue', keeping its newest block of text for the next messages.
+ */
+static void clear_queue(Queue* queue)
+{
+  TextBlock* block = queue->text_ptr;
 
-  if (queue->n < countof(queue->msgs))
+  if (block)
   {
-    Msg* msg = &queue->msgs[queue->n++];
+    while (block->next_ptr)
+    {
+      TextBlock* next_ptr = block->next_ptr->next_ptr;
+      wav_free(block->next_ptr);
+      block->next_ptr = next_ptr;
+    }
+    block->used = 0;
+  }
 
-    msg->string = str;
-    msg->level = level;
-    msg->status_code = status_code;
-  } 
+  queue->n = 0;
 }
 
-/* SUPRESS UNUSED FUNC WARNING
-static void queue_msg(Queue* queue, int level, int status_code, const char*fmt, ...)
+static void free_queue(Queue* queue)
 {
-  va_list args;
-  va_start(args, fmt);
+  clear_queue(queue);
+  wav_free(queue->text_ptr);
+  wav_free(queue);
+}
 
-  vqueue_msg(queue, level, status_code, fmt, args);
 
-  va_end(args);
+/*
+ * Output data for JSON
+ */
+typedef struct
+{
+  Queue*              info_queue;
+  Queue*              error_queue;
+  int                 verbosity;
+  SMPTETimecodeRange* timecode_range_ptr;
+  size_t              discarded_bits_at_start;
+  SMPTETimecode       start, end;
+  LtcSignalStats      stats;
+  WavU32              sample_rate;        // Of the input, if it was decoded
+  LtcDriftSegment     drift;
+  LtcDriftSegment*    drift_segment_ptr;
+  char**              files;              // Parts of a split recording...
+  WavU64*             file_start_samples; // ...and the sample each starts at
+  size_t              num_files;
+  bool                found;              // Looked for a timecode with --find...
+  SMPTETimecode       found_timecode;
+  WavU64              found_sample;       // ...and found it here
+} OutputData;
+
+static OutputData* create_output_data(void)
+{
+  OutputData* obj = wav_calloc(1, sizeof(OutputData));
+
+  obj->timecode_range_ptr = NULL;
+  obj->info_queue = wav_calloc(1, sizeof(Queue));
+  obj->error_queue = wav_calloc(1, sizeof(Queue));
+  obj->verbosity = verbosity;
+  obj->discarded_bits_at_start = 0;
+
+  return obj;
 }
-*/
 
-static void log_error(int status_code, const char* fmt, ...)
+/*
+ * Empty 'obj' so that it can be used for another file, keeping its queues.
+ */
+static void reset_output_data(OutputData* obj)
 {
-  va_list args;
-  va_start(args, fmt);
+  clear_queue(obj->info_queue);
+  clear_queue(obj->error_queue);
+
+  free_timecode_ranges(obj->timecode_range_ptr);
+  obj->timecode_range_ptr = NULL;
+  obj->verbosity = verbosity;
+  obj->discarded_bits_at_start = 0;
+  memset(&obj->start, 0, sizeof(obj->start));
+  memset(&obj->end, 0, sizeof(obj->end));
+  memset(&obj->stats, 0, sizeof(obj->stats));
+  obj->sample_rate = 0;
+  free_drift_segments(obj->drift_segment_ptr);
+  obj->drift_segment_ptr = NULL;
+  memset(&obj->drift, 0, sizeof(obj->drift));
+
+  for (size_t i = 0; i < obj->num_files; ++i) wav_free(obj->files[i]);
+  wav_free(obj->files);
+  wav_free(obj->file_start_samples);
+  obj->files = NULL;
+  obj->file_start_samples = NULL;
+  obj->num_files = 0;
+  obj->found = false;
+}
 
+static void free_output_data(OutputData* obj)
+{
+  reset_output_data(obj);
+  free_queue(obj->info_queue);
+  free_queue(obj->error_queue);
+  wav_free(obj);
+}
+
+/*
+ * Note that 'filename', part of a split recording, starts at 'start_sample'.
+ */
+static void add_output_file(OutputData* obj, const char* filename, WavU64 start_sample)
+{
+  obj->files = wav_realloc(obj->files, (obj->num_files + 1) * sizeof(char*));
+  obj->file_start_samples = wav_realloc(obj->file_start_samples,
+                                    (obj->num_files + 1) * sizeof(WavU64));
+  obj->files[obj->num_files] = wav_strdup(filename);
+  obj->file_start_samples[obj->num_files++] = start_sample;
+}
+
+/*
+ * Messages are queued in 'data' for JSON output, or printed straight away.
+ */
+static void vlog_error(OutputData* data, int status_code, const char* fmt, va_list args)
+{
   if (json_output)
   {
-    vqueue_msg(&error_queue, 0, status_code, fmt, args);
+    vqueue_msg(data->error_queue, 0, status_code, fmt, args);
   }
   else
   {
@@ -87,20 +325,15 @@ static void log_error(int status_code, const char* fmt, ...)
     vfprintf(stderr, fmt, args);
     fprintf(stderr, "\n");
   }
-
-  va_end(args);
 }
 
-static void log_info(int level, const char* fmt, ...)
+static void vlog_info(OutputData* data, int level, const char* fmt, va_list args)
 {
-  va_list args;
-  va_start(args, fmt);
-
-  if (verbosity >= level)
+  if (data->verbosity >= level)
   {
     if (json_output)
     {
-      vqueue_msg(&info_queue, level, 0, fmt, args);
+      vqueue_msg(data->info_queue, level, 0, fmt, args);
     }
     else
     {
@@ -109,169 +342,182 @@ static void log_info(int level, const char* fmt, ...)
       printf("\n");
     }
   }
+}
 
+static void log_error(OutputData* data, int status_code, const char* fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  vlog_error(data, status_code, fmt, args);
   va_end(args);
 }
 
+static void log_info(OutputData* data, int level, const char* fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  vlog_info(data, level, fmt, args);
+  va_end(args);
+}
 
-/* 
- * The 80 bits of the LTC frame as a C struct.
- * Taken from libltc
- *
- * Little Endian version -- and doxygen doc 
- * */
-struct LTCFrame {
-        unsigned int frame_units:4; ///< SMPTE framenumber BCD unit 0..9
-        unsigned int user1:4;
-
-        unsigned int frame_tens:2; ///< SMPTE framenumber BCD tens 0..3
-        unsigned int dfbit:1; ///< indicated drop-frame timecode
-        unsigned int col_frame:1; ///< colour-frame: timecode intentionally synchronized to a colour TV field sequence
-        unsigned int user2:4;
-
-        unsigned int secs_units:4; ///< SMPTE seconds BCD unit 0..9
-        unsigned int user3:4;
-
-        unsigned int secs_tens:3; ///< SMPTE seconds BCD tens 0..6
-        unsigned int biphase_mark_phase_correction:1; ///< see note on Bit 27 in description and \ref ltc_frame_set_parity .
-        unsigned int user4:4;
-
-        unsigned int mins_units:4; ///< SMPTE minutes BCD unit 0..9
-        unsigned int user5:4;
-
-        unsigned int mins_tens:3; ///< SMPTE minutes BCD tens 0..6
-        unsigned int binary_group_flag_bit0:1; ///< indicate user-data char encoding, see table above - bit 43
-        unsigned int user6:4;
-
-        unsigned int hours_units:4; ///< SMPTE hours BCD unit 0..9
-        unsigned int user7:4;
-
-        unsigned int hours_tens:2; ///< SMPTE hours BCD tens 0..2
-        unsigned int binary_group_flag_bit1:1; ///< indicate timecode is local time wall-clock, see table above - bit 58        unsigned int binary_group_flag_bit2:1; ///< indicate user-data char encoding (or parity with 25fps), see table above - bit 59
-        unsigned int user8:4;
-
-        unsigned int sync_word:16;
-};
-typedef struct LTCFrame LTCFrame;
-
-/**
- * Human readable time representation, decimal values.
+/*
+ * Receives the decoder's messages. 'context' is the file's OutputData.
  */
-struct SMPTETimecode {
-        char timezone[6];   ///< the timezone 6bytes: "+HHMM" textual representation
-        unsigned char years; ///< LTC-date uses 2-digit year 00.99
-        unsigned char months; ///< valid months are 1..12
-        unsigned char days; ///< day of month 1..31
+static void decoder_log(void* context, int level, int status_code,
+                        const char* fmt, va_list args)
+{
+  OutputData* data = context;
 
-        unsigned char hours; ///< hour 0..23
-        unsigned char mins; ///< minute 0..60
-        unsigned char secs; ///< second 0..60
-        unsigned char frame; ///< sub-second frame 0..(FPS - 1)
-};
-typedef struct SMPTETimecode SMPTETimecode;
+  if (status_code != 0)
+  {
+    vlog_error(data, status_code, fmt, args);
+  }
+  else
+  {
+    vlog_info(data, level, fmt, args);
+  }
+}
 
-static char* timecode_to_str(SMPTETimecode* stime)
+/*
+ * Level relative to full scale, or null for silence.
+ */
+static void dbfs_to_json(const char* key, double level, FILE* out)
 {
-  // Ring buffer of 5 returns values, before we start to overwrite.
-  static char buffers[5][13];
-  static size_t i = 0;
+  if (level > 0)
+  {
+    fprintf(out, "\t\t\"%s\": %.1f,\n", key, 20 * log10(level / 32768));
+  }
+  else
+  {
+    fprintf(out, "\t\t\"%s\": null,\n", key);
+  }
+}
 
-  char* buffer = buffers[i];
+static void signal_health_to_json(const LtcSignalStats* stats, WavU32 sample_rate, FILE* out)
+{
+  WavU64 num_frames = stats->positive_frames + stats->negative_frames;
+  const char* polarity = "unknown";
 
-  snprintf(buffer, sizeof(buffers[i]),
-           "%02d:%02d:%02d:%02d",
-           (int)stime->hours, 
-           (int)stime->mins, 
-           (int)stime->secs, 
-           (int)stime->frame);
+  if (num_frames > 0)
+  {
+    polarity = stats->positive_frames >= num_frames * 0.95 ? "positive"
+             : stats->negative_frames >= num_frames * 0.95 ? "negative"
+             : "mixed";
+  }
 
-  i = (i+1) % countof(buffers);
+  fprintf(out, "\t\"SignalHealth\": {\n");
+  fprintf(out, "\t\t\"SignalSeconds\": %.3f,\n", (double)stats->signal_samples / sample_rate);
+  fprintf(out, "\t\t\"SilentSeconds\": %.3f,\n", (double)stats->silent_samples / sample_rate);
+  dbfs_to_json("PeakDBFS", stats->peak, out);
+  dbfs_to_json("RmsDBFS", stats->signal_samples
+               ? sqrt(stats->signal_sum_squares / stats->signal_samples) : 0, out);
+  dbfs_to_json("NoiseFloorDBFS", stats->silent_samples
+               ? sqrt(stats->silent_sum_squares / stats->silent_samples) : 0, out);
+  fprintf(out, "\t\t\"DCOffset\": %.6f,\n", stats->signal_samples
+          ? stats->signal_sum / stats->signal_samples / 32768 : 0.0);
+
+  if (stats->num_rise_times > 0)
+  {
+    fprintf(out, "\t\t\"RiseTimeMicroseconds\": %.1f,\n",
+            stats->rise_time_sum / stats->num_rise_times * 1e6 / sample_rate);
+  }
+  else
+  {
+    fprintf(out, "\t\t\"RiseTimeMicroseconds\": null,\n");
+  }
 
-  return buffer;
-}
+  fprintf(out, "\t\t\"Polarity\": \"%s\",\n", polarity);
 
-static void ltc_frame_to_time(SMPTETimecode *stime, LTCFrame *frame/*, int flags*/) {
-        if (!stime) return;
+  fprintf(out, "\t\t\"BitPeriodJitter\": {\"FirstBinPercent\": -40, \"BinPercent\": 5, \"Counts\": [");
+  for (size_t i = 0; i < LTC_JITTER_BINS; ++i)
+  {
+    fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)stats->jitter[i]);
+  }
+  fprintf(out, "]},\n");
 
-/*        if (flags & LTC_USE_DATE) {
-                smpte_set_timezone_string(frame, stime);
+  fprintf(out, "\t\t\"Minutes\": [\n");
+  for (size_t i = 0; i < stats->num_minutes; ++i)
+  {
+    WavU32 frames = stats->frames_per_minute[i];
+    WavU32 errors = stats->errors_per_minute[i];
 
-                stime->years  = frame->user5 + frame->user6*10;
-                stime->months = frame->user3 + frame->user4*10;
-                stime->days   = frame->user1 + frame->user2*10;
-        } else { */
-                stime->years  = 0;
-                stime->months = 0;
-                stime->days   = 0;
-                sprintf(stime->timezone,"+0000");
-/*        } */
+    fprintf(out, "\t\t\t{\"Frames\": %u, \"Errors\": %u, \"ErrorRate\": %.4f}%s\n",
+            frames, errors, frames + errors ? (double)errors / (frames + errors) : 0.0,
+            i + 1 < stats->num_minutes ? "," : "");
+  }
+  fprintf(out, "\t\t]\n");
 
-        stime->hours = frame->hours_units + frame->hours_tens*10;
-        stime->mins  = frame->mins_units  + frame->mins_tens*10;
-        stime->secs  = frame->secs_units  + frame->secs_tens*10;
-        stime->frame = frame->frame_units + frame->frame_tens*10;
+  fprintf(out, "\t}, \n");
 }
 
 /*
- * Encapsulate a node in a linked list of ranges of timecodes.
+ * Write 'str' as the inside of a JSON string. Bytes from 0x80 up are passed
+ * through, as names and messages are taken to be UTF-8.
  */
-typedef struct _SMPTETimecodeRange
-{
-  SMPTETimecode start, end;
-  struct _SMPTETimecodeRange* next_ptr;
-} SMPTETimecodeRange;
-
-SMPTETimecodeRange* create_timecode_range(SMPTETimecode* start, SMPTETimecode* end)
+static void json_escape(const char* str, FILE* out)
 {
-  SMPTETimecodeRange* obj = malloc(sizeof(SMPTETimecodeRange));
-  memcpy(&obj->start, start, sizeof(SMPTETimecode));
-  memcpy(&obj->end, end, sizeof(SMPTETimecode));
-  return obj;
+  for (const unsigned char* ptr = (const unsigned char*)str; *ptr; ++ptr)
+  {
+    switch (*ptr)
+    {
+      case '"':  fputs("\\\"", out); break;
+      case '\\': fputs("\\\\", out); break;
+      case '\n': fputs("\\n", out); break;
+      case '\r': fputs("\\r", out); break;
+      case '\t': fputs("\\t", out); break;
+      default:
+        if (*ptr < 0x20) fprintf(out, "\\u%04x", *ptr);
+        else fputc(*ptr, out);
+    }
+  }
 }
 
-void timecode_range_append(SMPTETimecodeRange** first_pptr, SMPTETimecodeRange* new_ptr)
+static void messages_to_json(const Queue* queue, FILE* out)
 {
-  if (!*first_pptr)
-  {
-    *first_pptr = new_ptr;
-  }
-  else
+  for (size_t i = 0; i < queue->n; ++i)
   {
-    SMPTETimecodeRange* node_ptr = *first_pptr;
-    for (;
-         node_ptr->next_ptr;
-         node_ptr = node_ptr->next_ptr);
+    const Msg* m = &queue->msgs[i];
 
-    node_ptr->next_ptr = new_ptr;
-    new_ptr->next_ptr = NULL;
+    fprintf(out, "\t\t{\"status_code\": %d, \"string\":\" ", m->status_code);
+    json_escape(m->string, out);
+    fprintf(out, "\", \"level\": %d}%s\n", m->level, i + 1 < queue->n ? "," : "");
   }
 }
 
 /*
- * Output data for JSON
+ * The recorder's sample rate relative to the LTC clock, over the whole input
+ * and each stretch over which it held steady.
  */
-typedef struct
-{
-  Queue*              info_queue;
-  Queue*              error_queue;
-  SMPTETimecodeRange* timecode_range_ptr;
-  size_t              discarded_bits_at_start;
-  SMPTETimecode       start, end;
-} OutputData;
-
-static OutputData* create_output_data(Queue* info_queue, Queue* error_queue)
+static void clock_drift_to_json(const LtcDriftSegment* drift, const LtcDriftSegment* segment_ptr,
+                                WavU32 sample_rate, FILE* out)
 {
-  OutputData* obj = malloc(sizeof(OutputData));
-
-  obj->timecode_range_ptr = NULL;
-  obj->info_queue = info_queue;
-  obj->error_queue = error_queue;
-  obj->discarded_bits_at_start = 0;
+  fprintf(out, "\t\"ClockDrift\": {\n");
+  fprintf(out, "\t\t\"PPM\": %.3f,\n", drift->ppm);
+  fprintf(out, "\t\t\"PPMError\": %.3f,\n", drift->ppm_error);
+  fprintf(out, "\t\t\"EffectiveSampleRate\": %.3f,\n", sample_rate * (1 + drift->ppm / 1e6));
+  fprintf(out, "\t\t\"Frames\": %llu,\n", (unsigned long long)drift->num_frames);
+
+  fprintf(out, "\t\t\"Segments\": [\n");
+  for (; segment_ptr; segment_ptr = segment_ptr->next_ptr)
+  {
+    fprintf(out, "\t\t\t{\"StartSample\": %llu, \"EndSample\": %llu, \"Frames\": %llu, "
+            "\"PPM\": %.3f, \"PPMError\": %.3f}%s\n",
+            (unsigned long long)segment_ptr->start_sample,
+            (unsigned long long)segment_ptr->end_sample,
+            (unsigned long long)segment_ptr->num_frames,
+            segment_ptr->ppm, segment_ptr->ppm_error,
+            segment_ptr->next_ptr ? "," : "");
+  }
+  fprintf(out, "\t\t]\n");
 
-  return obj;
+  fprintf(out, "\t}, \n");
 }
 
-static void output_data_to_json(OutputData* data)
+/*
+ * Write 'data' as JSON to 'out'. If 'filename' isn't NULL, it's included so
+ * that results in a stream can be told apart.
+ */
+static void output_data_to_json(OutputData* data, const char* filename, FILE* out)
 {
 
   /*
@@ -293,363 +539,1476 @@ static void output_data_to_json(OutputData* data)
   }
 
 
-  /*
-   * Output JSON.
-   */
-  printf("{\n"); 
+  /*
+   * Output JSON.
+   */
+  fprintf(out, "{\n");
+
+  if (filename)
+  {
+    fprintf(out, "\t\"File\": \"");
+    json_escape(filename, out);
+    fprintf(out, "\",\n");
+  }
+
+  if (data->num_files > 0)
+  {
+    fprintf(out, "\t\"Files\": [\n");
+    for (size_t i = 0; i < data->num_files; ++i)
+    {
+      fprintf(out, "\t\t{\"File\": \"");
+      json_escape(data->files[i], out);
+      fprintf(out, "\", \"StartSample\": %llu}%s\n",
+              (unsigned long long)data->file_start_samples[i],
+              i + 1 < data->num_files ? "," : "");
+    }
+    fprintf(out, "\t], \n");
+  }
+
+  fprintf(out, "\t\"InfoMessages\": [\n");
+
+  messages_to_json(data->info_queue, out);
+
+  fprintf(out, "\t], \n");
+
+
+  fprintf(out, "\t\"ErrorMessages\": [\n");
+
+  messages_to_json(data->error_queue, out);
+
+  fprintf(out, "\t], \n");
+
+
+  if (result_code == 200 && !data->found)
+  {
+    fprintf(out, "\t\"TimecodeRanges\": [\n");
+
+    if (data->timecode_range_ptr)
+    {
+      SMPTETimecodeRange* node = data->timecode_range_ptr;
+
+      fprintf(out, "\t\t[\"%s\", \"%s\"]", timecode_to_str(&node->start),
+          timecode_to_str(&node->end));
+
+
+      for (node = node->next_ptr; node; node = node->next_ptr)
+      {
+        fprintf(out, ",\n");
+        fprintf(out, "\t\t[\"%s\", \"%s\"]", timecode_to_str(&node->start),
+            timecode_to_str(&node->end));
+      }
+      fprintf(out, "\n");
+
+    }
+
+    fprintf(out, "\t], \n");
+  }
+
+  if (data->sample_rate != 0)
+  {
+    signal_health_to_json(&data->stats, data->sample_rate, out);
+  }
+
+  if (data->drift.num_frames > 0)
+  {
+    clock_drift_to_json(&data->drift, data->drift_segment_ptr, data->sample_rate, out);
+  }
+
+  fprintf(out, "\t\"ResultCode\": %d,\n", result_code);
+  fprintf(out, "\t\"ErrorMsg\": \"");
+  json_escape(error_msg, out);
+  fprintf(out, "\"");
+
+  if (data->found)
+  {
+    fprintf(out, ",\n");
+    fprintf(out, "\t\"Timecode\": \"%s\",\n", timecode_to_str(&data->found_timecode));
+    fprintf(out, "\t\"Sample\": %llu\n", (unsigned long long)data->found_sample);
+  }
+  else if (result_code == 200)
+  {
+    fprintf(out, ",\n");
+    fprintf(out, "\t\"DiscardedBitsAtStart\": %ld,\n", data->discarded_bits_at_start);
+    fprintf(out, "\t\"Start\": \"%s\",\n", timecode_to_str(&data->start));
+    fprintf(out, "\t\"End\": \"%s\"\n", timecode_to_str(&data->end));
+  }
+
+  fprintf(out, "}\n");
+}
+
+
+/*
+ * Decoding a file
+ *
+ * A file can be decoded in one go, or a bit at a time as it's written.
+ */
+typedef struct _DumpJob
+{
+  char*             filename;
+  WavFile*          fptr;
+  unsigned          channel;
+  int               fps;
+  LtcDecoder        decoder;
+  OutputData*       output_data;
+  bool              failed;
+  bool              live;             // Print frames as they're decoded
+  bool              reported_frame;
+  WavU64            reported_sample;  // Start of the last frame printed
+  WavU64            checkpoint_interval;  // Samples between checkpoints, or 0
+  WavU64            next_checkpoint;      // Sample count to write the next at
+  struct _DumpJob*  next_ptr;
+} DumpJob;
+
+static DumpJob* create_dump_job(const char* filename, unsigned channel, int fps)
+{
+  DumpJob* job = wav_calloc(1, sizeof(DumpJob));
+
+  job->filename = wav_strdup(filename);
+  job->channel = channel;
+  job->fps = fps;
+  job->output_data = create_output_data();
+
+  return job;
+}
+
+/*
+ * Release the input and decoder, but not the results.
+ */
+static void close_dump_job(DumpJob* job)
+{
+  if (job->fptr) wav_close(job->fptr);
+  job->fptr = NULL;
+  ltc_decoder_free(&job->decoder);
+}
+
+static void free_dump_job(DumpJob* job)
+{
+  close_dump_job(job);
+  free_output_data(job->output_data);
+  wav_free(job->filename);
+  wav_free(job);
+}
+
+/*
+ * Open the input and set up the decoder. Returns -1 if the file can't be
+ * read; the reason is only logged if 'log_failure' is set, as a file that's
+ * still being written may not have a complete header yet.
+ */
+static int dump_job_open(DumpJob* job, bool log_failure)
+{
+  job->fptr = wav_open(job->filename, "r");
+
+  if (!job->fptr)
+  {
+    if (log_failure) log_error(job->output_data, 500, "Out of memory opening input file");
+    return -1;
+  }
+
+  if (wav_file_err(job->fptr)->code != WAV_OK)
+  {
+    if (log_failure) log_error(job->output_data, 404, "%s", wav_file_err(job->fptr)->message);
+    wav_close(job->fptr);
+    job->fptr = NULL;
+    return -1;
+  }
+
+  if (job->channel >= wav_get_num_channels(job->fptr))
+  {
+    log_error(job->output_data, 415, "Input has no channel %u", job->channel);
+    job->failed = true;
+    return -1;
+  }
+
+  ltc_decoder_init(&job->decoder, wav_get_sample_rate(job->fptr), job->fps,
+                   decoder_log, job->output_data);
+
+  return 0;
+}
+
+/*
+ * Checkpoints
+ *
+ * A long decode can save its state to a sidecar next to the input every so
+ * often, and carry on from there with --resume if it's killed. The input is
+ * identified by its size and modification time; if either has changed, it's
+ * decoded from the start. The sidecar is removed once the decode finishes.
+ */
+#define CHECKPOINT_MAGIC            "KCTL"
+#define CHECKPOINT_VERSION          1
+#define DEFAULT_CHECKPOINT_SECONDS  600
+
+typedef struct
+{
+  char    magic[4];
+  WavU32  version;
+  WavU64  file_size;          // Of the input...
+  WavI64  file_mtime;         // ...and when it was last modified
+  WavU32  channel;
+  WavI32  fps;                // As requested, 0 to detect
+} CheckpointHeader;
+
+static char* checkpoint_path(const char* filename)
+{
+  size_t len = strlen(filename) + 16;
+  char* path = wav_malloc(len);
+
+  snprintf(path, len, "%s.checkpoint", filename);
+  return path;
+}
+
+static int checkpoint_header(DumpJob* job, CheckpointHeader* header)
+{
+  struct stat st;
+
+  if (stat(job->filename, &st) != 0) return -1;
+
+  memset(header, 0, sizeof(CheckpointHeader));
+  memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+  header->version = CHECKPOINT_VERSION;
+  header->file_size = st.st_size;
+  header->file_mtime = st.st_mtime;
+  header->channel = job->channel;
+  header->fps = job->fps;
+  return 0;
+}
+
+/*
+ * The info messages so far are saved too, so that the results of a resumed
+ * decode are the same as those of one that wasn't interrupted.
+ */
+static int write_queue(const Queue* queue, FILE* out)
+{
+  WavU32 n = queue->n;
+
+  if (fwrite(&n, sizeof(n), 1, out) != 1) return -1;
+
+  for (size_t i = 0; i < queue->n; ++i)
+  {
+    const Msg* msg = &queue->msgs[i];
+    WavI32 fields[2] = {msg->level, msg->status_code};
+    WavU32 len = strlen(msg->string);
+
+    if (fwrite(fields, sizeof(fields), 1, out) != 1
+        || fwrite(&len, sizeof(len), 1, out) != 1
+        || fwrite(msg->string, 1, len, out) != len)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Longer saved messages are taken as damage.
+#define CHECKPOINT_MAX_MSG_LENGTH  65536
+
+static int read_queue(Queue* queue, FILE* in)
+{
+  WavU32 n;
+  struct stat st;
+
+  if (fstat(fileno(in), &st) != 0
+      || fread(&n, sizeof(n), 1, in) != 1 || n > countof(queue->msgs))
+  {
+    return -1;
+  }
+
+  for (queue->n = 0; queue->n < n; )
+  {
+    WavI32 fields[2];
+    WavU32 len;
+
+    if (fread(fields, sizeof(fields), 1, in) != 1
+        || fread(&len, sizeof(len), 1, in) != 1)
+    {
+      return -1;
+    }
+
+    long pos = ftell(in);
+    if (len > CHECKPOINT_MAX_MSG_LENGTH || pos < 0 || (off_t)len > st.st_size - pos)
+    {
+      return -1;
+    }
+
+    char* str = queue_text(queue, (size_t)len + 1);
+    if (!str || fread(str, 1, len, in) != len)
+    {
+      return -1;
+    }
+    str[len] = '\0';
+
+    Msg* msg = &queue->msgs[queue->n++];
+    msg->string = str;
+    msg->level = fields[0];
+    msg->status_code = fields[1];
+  }
+
+  return 0;
+}
+
+/*
+ * Save the state of the decode, replacing the last checkpoint.
+ */
+static void write_checkpoint(DumpJob* job)
+{
+  char* path = checkpoint_path(job->filename);
+  size_t len = strlen(path) + 8;
+  char* tmp = wav_malloc(len);
+  CheckpointHeader header;
+
+  snprintf(tmp, len, "%s.tmp", path);
+
+  FILE* out = fopen(tmp, "wb");
+  if (!out)
+  {
+    fprintf(stderr, "Failed to create '%s': %s\n", tmp, strerror(errno));
+  }
+  else
+  {
+    bool written = checkpoint_header(job, &header) == 0
+                   && fwrite(&header, sizeof(header), 1, out) == 1
+                   && write_queue(job->output_data->info_queue, out) == 0
+                   && ltc_decoder_save(&job->decoder, out) == 0
+                   && fflush(out) == 0
+                   && fsync(fileno(out)) == 0;
+
+    if (fclose(out) != 0 || !written || rename(tmp, path) != 0)
+    {
+      fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+      unlink(tmp);
+    }
+  }
+
+  wav_free(path);
+  wav_free(tmp);
+}
+
+/*
+ * Carry on from the last checkpoint of the input, if there is one that
+ * matches it. Otherwise, the input is decoded from the start.
+ */
+static void dump_job_resume(DumpJob* job)
+{
+  char* path = checkpoint_path(job->filename);
+  FILE* in = fopen(path, "rb");
+  CheckpointHeader header, expected;
+
+  if (!in)
+  {
+    wav_free(path);
+    return;
+  }
+
+  if (fread(&header, sizeof(header), 1, in) != 1
+      || checkpoint_header(job, &expected) != 0
+      || memcmp(&header, &expected, sizeof(header)) != 0)
+  {
+    log_info(job->output_data, 0, "Checkpoint '%s' is for another version of the input; "
+             "decoding from the start", path);
+  }
+  else if (read_queue(job->output_data->info_queue, in) != 0
+           || ltc_decoder_load(&job->decoder, in) != 0
+           || wav_seek(job->fptr, (long)job->decoder.sample_count, SEEK_SET) != 0)
+  {
+    log_info(job->output_data, 0, "Checkpoint '%s' is damaged; decoding from the start", path);
+
+    clear_queue(job->output_data->info_queue);
+    ltc_decoder_free(&job->decoder);
+    ltc_decoder_init(&job->decoder, wav_get_sample_rate(job->fptr), job->fps,
+                     decoder_log, job->output_data);
+    wav_seek(job->fptr, 0, SEEK_SET);
+  }
+  else
+  {
+    log_info(job->output_data, 1, "Resumed from checkpoint at sample %llu",
+             (unsigned long long)job->decoder.sample_count);
+  }
+
+  fclose(in);
+  wav_free(path);
+}
+
+/*
+ * Decode all of the input that's available.
+ */
+static int dump_job_read(DumpJob* job)
+{
+  // The LTC channel, converted to 16 bit signed audio.
+  int16_t audio_samples[512];
+
+  while (true)
+  {
+    // Fill up our audio buffer
+    size_t num_audio_samples = wav_read_channel_i16(job->fptr, job->channel,
+                                                    audio_samples, countof(audio_samples));
+
+    PROBE2(ltcdump, block_read, num_audio_samples, job->decoder.sample_count);
+
+    if (num_audio_samples == 0)
+    {
+      if (wav_file_err(job->fptr)->code != WAV_OK)
+      {
+        log_error(job->output_data, 415, "%s", wav_file_err(job->fptr)->message);
+        job->failed = true;
+        return -1;
+      }
+      return 0;
+    }
+
+    if (ltc_decoder_process(&job->decoder, audio_samples, num_audio_samples) != 0)
+    {
+      job->failed = true;
+      return -1;
+    }
+
+    if (job->checkpoint_interval > 0 && job->decoder.sample_count >= job->next_checkpoint)
+    {
+      write_checkpoint(job);
+      job->next_checkpoint = job->decoder.sample_count + job->checkpoint_interval;
+    }
+
+    if (job->live && job->decoder.seen_first_timecode
+        && (!job->reported_frame || job->decoder.last_sample != job->reported_sample))
+    {
+      printf("Frame %s at sample %llu\n", timecode_to_str(&job->decoder.last_timecode),
+             (unsigned long long)job->decoder.last_sample);
+      fflush(stdout);
+
+      job->reported_frame = true;
+      job->reported_sample = job->decoder.last_sample;
+    }
+  }
+}
+
+/*
+ * Carry on decoding with 'filename', the next part of a recording that was
+ * split across files. The decoder isn't reset, so frames that straddle the
+ * split are decoded and the ranges run on into it.
+ */
+static int dump_job_continue(DumpJob* job, const char* filename)
+{
+  WavU32 sample_rate = wav_get_sample_rate(job->fptr);
+  WavU16 num_channels = wav_get_num_channels(job->fptr);
+
+  wav_close(job->fptr);
+
+  job->fptr = wav_open(filename, "r");
+
+  if (!job->fptr)
+  {
+    log_error(job->output_data, 500, "Out of memory opening input file");
+    job->failed = true;
+    return -1;
+  }
+
+  if (wav_file_err(job->fptr)->code != WAV_OK)
+  {
+    log_error(job->output_data, 404, "%s: %s", filename, wav_file_err(job->fptr)->message);
+  }
+  else if (wav_get_sample_rate(job->fptr) != sample_rate
+           || wav_get_num_channels(job->fptr) != num_channels)
+  {
+    log_error(job->output_data, 415, "%s has a different format to the files before it",
+              filename);
+  }
+  else
+  {
+    log_info(job->output_data, 1, "Continuing with %s at sample %llu", filename,
+             (unsigned long long)job->decoder.sample_count);
+    add_output_file(job->output_data, filename, job->decoder.sample_count);
+    return 0;
+  }
+
+  wav_close(job->fptr);
+  job->fptr = NULL;
+  job->failed = true;
+  return -1;
+}
+
+/*
+ * Close the last range and collect the results.
+ */
+static void dump_job_finish(DumpJob* job)
+{
+  OutputData* output_data = job->output_data;
+
+  if (job->fptr && !job->failed)
+  {
+    ltc_decoder_finish(&job->decoder);
+  }
+
+  output_data->timecode_range_ptr = job->decoder.timecode_range_ptr;
+  output_data->discarded_bits_at_start = job->decoder.discarded_bits_at_start;
+  job->decoder.timecode_range_ptr = NULL;
+
+  if (job->fptr)
+  {
+    output_data->stats = job->decoder.stats;
+    output_data->sample_rate = job->decoder.sample_rate;
+    output_data->drift = job->decoder.drift;
+    output_data->drift_segment_ptr = job->decoder.drift_segment_ptr;
+    job->decoder.drift_segment_ptr = NULL;
+  }
+
+  // Extract start and end timecodes.
+  if (!output_data->timecode_range_ptr)
+  {
+    log_error(output_data, 415, "No timecode found in file.");
+  }
+  else
+  {
+    output_data->start = output_data->timecode_range_ptr->start;
+
+    for (SMPTETimecodeRange* ptr = output_data->timecode_range_ptr;
+         ptr;
+         ptr = ptr->next_ptr)
+    {
+      if (!ptr->next_ptr)
+      {
+        output_data->end = ptr->end;
+      }
+    }
+  }
+}
+
+/*
+ * Find where 'target' starts in the job's file, by seeking to where it
+ * should be rather than decoding the whole file.
+ */
+static int dump_job_find(DumpJob* job, const SMPTETimecode* target)
+{
+  OutputData* output_data = job->output_data;
+  WavU64 sample;
+
+  if (ltc_decoder_find_timecode(&job->decoder, job->filename, job->channel, job->fps,
+                                target, decoder_log, output_data, &sample) != 0)
+  {
+    return -1;
+  }
+
+  output_data->found = true;
+  output_data->found_timecode = *target;
+  output_data->found_sample = sample;
+
+  log_info(output_data, 0, "Timecode %s at sample %llu",
+           timecode_to_str(&output_data->found_timecode), (unsigned long long)sample);
+
+  return 0;
+}
+
+
+/*
+ * Watching directories
+ *
+ * Files are decoded as they're written, and the results are written out when
+ * the file is closed; either to a sidecar next to the file or to a stream.
+ */
+typedef struct
+{
+  int   wd;
+  char* path;
+} Watch;
+
+typedef struct
+{
+  int       fd;
+  Watch*    watches;
+  size_t    num_watches;
+  DumpJob*  jobs;
+  unsigned  channel;
+  int       fps;
+  FILE*     out;          // NULL to write sidecars
+} Watcher;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int sig)
+{
+  (void)sig;
+  stop_requested = 1;
+}
+
+// No SA_RESTART, so that a blocking read() returns when we're asked to stop.
+static void catch_stop_signals(void)
+{
+  struct sigaction action = {0};
+
+  action.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
+
+static bool is_wav_filename(const char* name)
+{
+  size_t len = strlen(name);
+  return len > 4 && strcasecmp(name + len - 4, ".wav") == 0;
+}
+
+/*
+ * Watch 'path' and, recursively, the directories in it.
+ */
+static int add_watch(Watcher* watcher, const char* path)
+{
+  int wd = inotify_add_watch(watcher->fd, path,
+                             IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd == -1)
+  {
+    fprintf(stderr, "Failed to watch '%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  watcher->watches = wav_realloc(watcher->watches, (watcher->num_watches + 1) * sizeof(Watch));
+  watcher->watches[watcher->num_watches].wd = wd;
+  watcher->watches[watcher->num_watches].path = wav_strdup(path);
+  watcher->num_watches++;
+
+  DIR* dir = opendir(path);
+  struct dirent* entry;
+
+  while (dir && (entry = readdir(dir)))
+  {
+    if (entry->d_type == DT_DIR && entry->d_name[0] != '.')
+    {
+      char* sub_path = wav_malloc(strlen(path) + strlen(entry->d_name) + 2);
+      sprintf(sub_path, "%s/%s", path, entry->d_name);
+      add_watch(watcher, sub_path);
+      wav_free(sub_path);
+    }
+  }
+
+  if (dir) closedir(dir);
+
+  return 0;
+}
+
+static const char* watch_path(Watcher* watcher, int wd)
+{
+  for (size_t i = 0; i < watcher->num_watches; ++i)
+  {
+    if (watcher->watches[i].wd == wd) return watcher->watches[i].path;
+  }
+  return NULL;
+}
+
+static DumpJob* find_job(Watcher* watcher, const char* filename, bool create)
+{
+  for (DumpJob* job = watcher->jobs; job; job = job->next_ptr)
+  {
+    if (strcmp(job->filename, filename) == 0) return job;
+  }
+
+  if (!create) return NULL;
+
+  DumpJob* job = create_dump_job(filename, watcher->channel, watcher->fps);
+  job->next_ptr = watcher->jobs;
+  watcher->jobs = job;
+
+  return job;
+}
+
+static void remove_job(Watcher* watcher, DumpJob* job)
+{
+  for (DumpJob** pptr = &watcher->jobs; *pptr; pptr = &(*pptr)->next_ptr)
+  {
+    if (*pptr == job)
+    {
+      *pptr = job->next_ptr;
+      break;
+    }
+  }
+
+  free_dump_job(job);
+}
+
+/*
+ * Write the results for 'job'. Sidecars are written to a temporary file and
+ * renamed, so readers never see part of one.
+ */
+static void write_results(Watcher* watcher, DumpJob* job)
+{
+  if (watcher->out)
+  {
+    output_data_to_json(job->output_data, job->filename, watcher->out);
+    fflush(watcher->out);
+    return;
+  }
+
+  size_t len = strlen(job->filename) + 16;
+  char* sidecar = wav_malloc(len);
+  char* tmp = wav_malloc(len);
+
+  snprintf(sidecar, len, "%.*s.json", (int)strlen(job->filename) - 4, job->filename);
+  snprintf(tmp, len, "%s.tmp", sidecar);
+
+  FILE* out = fopen(tmp, "w");
+  if (!out)
+  {
+    fprintf(stderr, "Failed to create '%s': %s\n", tmp, strerror(errno));
+  }
+  else
+  {
+    output_data_to_json(job->output_data, job->filename, out);
+
+    if (fclose(out) != 0 || rename(tmp, sidecar) != 0)
+    {
+      fprintf(stderr, "Failed to write '%s': %s\n", sidecar, strerror(errno));
+      unlink(tmp);
+    }
+  }
+
+  wav_free(sidecar);
+  wav_free(tmp);
+}
+
+/*
+ * 'filename' has been written to. Decode whatever has been added.
+ */
+static void file_modified(Watcher* watcher, const char* filename)
+{
+  DumpJob* job = find_job(watcher, filename, true);
+
+  if (job->failed) return;
+
+  if (!job->fptr && dump_job_open(job, false) != 0) return;
+
+  // Recorders often only write the size of the data when they stop.
+  if (wav_set_follow(job->fptr, 1) == 0)
+  {
+    dump_job_read(job);
+  }
+}
+
+/*
+ * 'filename' is complete. Decode the rest of it and write the results.
+ */
+static void file_closed(Watcher* watcher, const char* filename)
+{
+  DumpJob* job = find_job(watcher, filename, true);
+
+  if (!job->failed && (job->fptr || dump_job_open(job, true) == 0))
+  {
+    // The header is final now, so trust it again.
+    if (wav_set_follow(job->fptr, 0) != 0)
+    {
+      log_error(job->output_data, 404, "%s", wav_file_err(job->fptr)->message);
+      job->failed = true;
+    }
+    else
+    {
+      dump_job_read(job);
+    }
+  }
+
+  dump_job_finish(job);
+  write_results(watcher, job);
+
+  if (verbosity >= 1)
+  {
+    fprintf(stderr, "Decoded %s\n", filename);
+  }
+
+  remove_job(watcher, job);
+}
+
+static int watch(char** dirs, size_t num_dirs, unsigned channel, int fps, FILE* out)
+{
+  Watcher watcher = {0};
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  watcher.channel = channel;
+  watcher.fps = fps;
+  watcher.out = out;
+  watcher.fd = inotify_init1(IN_CLOEXEC);
+
+  if (watcher.fd == -1)
+  {
+    fprintf(stderr, "inotify_init1() failed: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < num_dirs; ++i)
+  {
+    if (add_watch(&watcher, dirs[i]) != 0) return EXIT_FAILURE;
+  }
+
+  catch_stop_signals();
+
+  while (!stop_requested)
+  {
+    ssize_t len = read(watcher.fd, buffer, sizeof(buffer));
+
+    if (len == -1)
+    {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to read inotify events: %s\n", strerror(errno));
+      break;
+    }
+
+    for (char* ptr = buffer; ptr < buffer + len; )
+    {
+      struct inotify_event* event = (struct inotify_event*)ptr;
+      const char* dir = watch_path(&watcher, event->wd);
+
+      ptr += sizeof(struct inotify_event) + event->len;
+
+      if (!dir || event->len == 0) continue;
+
+      char* path = wav_malloc(strlen(dir) + strlen(event->name) + 2);
+      sprintf(path, "%s/%s", dir, event->name);
+
+      if (event->mask & IN_ISDIR)
+      {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) add_watch(&watcher, path);
+      }
+      else if (is_wav_filename(event->name))
+      {
+        if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        {
+          file_closed(&watcher, path);
+        }
+        else if (event->mask & IN_MODIFY)
+        {
+          file_modified(&watcher, path);
+        }
+      }
+
+      wav_free(path);
+    }
+  }
+
+  while (watcher.jobs) remove_job(&watcher, watcher.jobs);
+  for (size_t i = 0; i < watcher.num_watches; ++i) wav_free(watcher.watches[i].path);
+  wav_free(watcher.watches);
+  close(watcher.fd);
+
+  return EXIT_SUCCESS;
+}
+
+
+/*
+ * Following a file
+ *
+ * Decode a file that's still being recorded, printing frames as they're
+ * decoded, until the recorder closes it or we're interrupted. The data
+ * chunk is taken to run to the end of the file until then, as its size in
+ * the header isn't written until the recording stops.
+ */
+static int follow(DumpJob* job)
+{
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  bool closed = false;
+  int fd = inotify_init1(IN_CLOEXEC);
+
+  if (fd == -1 || inotify_add_watch(fd, job->filename, IN_MODIFY | IN_CLOSE_WRITE) == -1)
+  {
+    log_error(job->output_data, 404, "Failed to watch %s: %s", job->filename, strerror(errno));
+    if (fd != -1) close(fd);
+    return -1;
+  }
+
+  catch_stop_signals();
+  job->live = !json_output;
+
+  while (!stop_requested && !job->failed)
+  {
+    if (!job->fptr)
+    {
+      // The header may not have been written yet.
+      if (dump_job_open(job, closed) != 0 && (closed || job->failed)) break;
+    }
+
+    if (job->fptr)
+    {
+      if (closed)
+      {
+        // The header is final now, so trust it again.
+        if (wav_set_follow(job->fptr, 0) == 0) dump_job_read(job);
+        break;
+      }
+
+      if (wav_set_follow(job->fptr, 1) != 0)
+      {
+        log_error(job->output_data, 404, "%s", wav_file_err(job->fptr)->message);
+        job->failed = true;
+        break;
+      }
+
+      dump_job_read(job);
+    }
+
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+
+    for (char* ptr = buffer; len > 0 && ptr < buffer + len; )
+    {
+      struct inotify_event* event = (struct inotify_event*)ptr;
+
+      if (event->mask & IN_CLOSE_WRITE) closed = true;
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  close(fd);
+
+  return job->failed ? -1 : 0;
+}
+
+
+/*
+ * Server
+ *
+ * Decode requests are read from clients of a UNIX domain socket and handled
+ * by a fixed pool of worker threads, each of which keeps its buffers between
+ * requests. A client connection is served by one worker until it's closed.
+ *
+ * Each request is a line holding the path of the file, optionally followed
+ * by tab separated options: channel=<num>, fps=<num> and verbose=<num>. The
+ * answer is the JSON that -j would print, followed by an empty line.
+ */
+typedef struct _Server Server;
+
+typedef struct
+{
+  Server*     server;
+  pthread_t   thread;
+  OutputData* output_data;      // Reused for each request
+  int         client_fd;        // -1 when idle
+} Worker;
+
+struct _Server
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  int*            pending_fds;  // Accepted connections waiting for a worker, in
+  size_t          pending_head; // a ring so they are served in arrival order
+  size_t          pending_tail;
+  size_t          num_pending;
+  size_t          max_pending;
+  bool            stopping;
+  Worker*         workers;
+  size_t          num_workers;
+  unsigned        channel;
+  int             fps;
+};
+
+/*
+ * Queue an accepted connection. Call with the mutex held.
+ */
+static void add_pending(Server* server, int fd)
+{
+  if (server->num_pending == server->max_pending)
+  {
+    size_t old_max = server->max_pending;
+
+    server->max_pending *= 2;
+    server->pending_fds = wav_realloc(server->pending_fds, server->max_pending * sizeof(int));
+
+    // Unwrap the ring: the fds before the head follow on from the old end.
+    memcpy(&server->pending_fds[old_max], server->pending_fds,
+           server->pending_head * sizeof(int));
+    server->pending_tail = old_max + server->pending_head;
+  }
+
+  server->pending_fds[server->pending_tail] = fd;
+  server->pending_tail = (server->pending_tail + 1) % server->max_pending;
+  server->num_pending++;
+}
+
+/*
+ * Take the longest waiting connection. Call with the mutex held and
+ * num_pending > 0.
+ */
+static int take_pending(Server* server)
+{
+  int fd = server->pending_fds[server->pending_head];
+
+  server->pending_head = (server->pending_head + 1) % server->max_pending;
+  server->num_pending--;
+  return fd;
+}
+
+static void serve_request(Worker* worker, char* line, FILE* out)
+{
+  Server* server = worker->server;
+  DumpJob job = {0};
+  char* saveptr = NULL;
+  char* path = strtok_r(line, "\t\r\n", &saveptr);
+  char* option;
+
+  reset_output_data(worker->output_data);
+
+  job.channel = server->channel;
+  job.fps = server->fps;
+  job.output_data = worker->output_data;
+
+  while ((option = strtok_r(NULL, "\t\r\n", &saveptr)))
+  {
+    if (strncmp(option, "channel=", 8) == 0)
+    {
+      job.channel = atoi(option + 8);
+    }
+    else if (strncmp(option, "fps=", 4) == 0)
+    {
+      job.fps = atoi(option + 4);
+    }
+    else if (strncmp(option, "verbose=", 8) == 0)
+    {
+      job.output_data->verbosity = atoi(option + 8);
+    }
+    else
+    {
+      log_error(job.output_data, 400, "Unknown option '%s'", option);
+    }
+  }
+
+  if (!path)
+  {
+    log_error(job.output_data, 400, "No file given");
+  }
+  else if (job.output_data->error_queue->n == 0)
+  {
+    job.filename = path;
+
+    if (dump_job_open(&job, true) == 0)
+    {
+      dump_job_read(&job);
+    }
+
+    dump_job_finish(&job);
+  }
+
+  output_data_to_json(job.output_data, path, out);
+  fprintf(out, "\n");
+  fflush(out);
+
+  close_dump_job(&job);
+}
+
+static void* server_worker(void* arg)
+{
+  Worker* worker = arg;
+  Server* server = worker->server;
+  char* line = NULL;
+  size_t line_size = 0;
+
+  while (true)
+  {
+    pthread_mutex_lock(&server->mutex);
+    while (server->num_pending == 0 && !server->stopping)
+    {
+      pthread_cond_wait(&server->cond, &server->mutex);
+    }
+
+    if (server->num_pending == 0)
+    {
+      pthread_mutex_unlock(&server->mutex);
+      break;
+    }
 
-  printf("\t\"InfoMessages\": [\n");
-  
-  if (data->info_queue->n > 0)
-  {
-    Msg* m = &data->info_queue->msgs[0];
+    int fd = take_pending(server);
+    worker->client_fd = fd;
+    pthread_mutex_unlock(&server->mutex);
+
+    FILE* in = fdopen(fd, "r");
+    FILE* out = fdopen(dup(fd), "w");
 
-    for (size_t i = 0; i < data->info_queue->n - 1; ++i, ++m)
+    while (in && out && getline(&line, &line_size, in) != -1)
     {
-      printf("\t\t{\"status_code\": %d, \"string\":\" %s\", \"level\": %d},\n",
-             m->status_code, m->string, m->level); 
+      serve_request(worker, line, out);
     }
 
-    printf("\t\t{\"status_code\": %d, \"string\":\" %s\", \"level\": %d}\n", 
-           m->status_code, m->string, m->level); 
+    pthread_mutex_lock(&server->mutex);
+    worker->client_fd = -1;
+    pthread_mutex_unlock(&server->mutex);
+
+    if (out) fclose(out);
+    if (in) fclose(in); else close(fd);
   }
 
-  printf("\t], \n");
+  free(line);
+  wav_err_clear();    // This thread's last error message
+  return NULL;
+}
 
+static int serve(const char* socket_path, size_t num_workers, unsigned channel, int fps)
+{
+  Server server = {0};
+  struct sockaddr_un addr = {0};
+  struct stat st;
+  sigset_t stop_signals, old_mask;
+  int rv = EXIT_SUCCESS;
+  int listen_fd;
 
-  printf("\t\"ErrorMessages\": [\n");
-  
-  if (data->error_queue->n > 0)
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
   {
-    Msg* m = &data->error_queue->msgs[0];
+    fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+    return EXIT_FAILURE;
+  }
 
-    for (size_t i = 0; i < data->error_queue->n - 1; ++i, ++m)
-    {
-      printf("\t\t{\"status_code\": %d, \"string\":\" %s\", \"level\": %d},\n",
-             m->status_code, m->string, m->level); 
-    }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
 
-    printf("\t\t{\"status_code\": %d, \"string\":\" %s\", \"level\": %d}\n", 
-           m->status_code, m->string, m->level); 
+  // Replace a socket left behind by a server that's gone.
+  if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+  {
+    unlink(socket_path);
   }
 
-  printf("\t], \n");
-
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1
+      || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+      || listen(listen_fd, 128) == -1)
+  {
+    fprintf(stderr, "Failed to listen on '%s': %s\n", socket_path, strerror(errno));
+    if (listen_fd != -1) close(listen_fd);
+    return EXIT_FAILURE;
+  }
 
-  if (result_code == 200)
+  pthread_mutex_init(&server.mutex, NULL);
+  pthread_cond_init(&server.cond, NULL);
+  server.channel = channel;
+  server.fps = fps;
+  server.max_pending = 128;
+  server.pending_fds = wav_malloc(server.max_pending * sizeof(int));
+  server.workers = wav_calloc(num_workers, sizeof(Worker));
+
+  // Stop signals are handled by this thread, which is waiting in accept().
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+  for (size_t i = 0; i < num_workers; ++i)
   {
-    printf("\t\"TimecodeRanges\": [\n");
+    Worker* worker = &server.workers[i];
 
-    if (data->timecode_range_ptr)
+    worker->server = &server;
+    worker->output_data = create_output_data();
+    worker->client_fd = -1;
+
+    if (pthread_create(&worker->thread, NULL, server_worker, worker) != 0)
     {
-      SMPTETimecodeRange* node = data->timecode_range_ptr;
+      free_output_data(worker->output_data);
+      break;
+    }
+    server.num_workers++;
+  }
 
-      printf("\t\t[\"%s\", \"%s\"]", timecode_to_str(&node->start), 
-          timecode_to_str(&node->end));
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  catch_stop_signals();
 
+  if (server.num_workers == 0)
+  {
+    fprintf(stderr, "Failed to start any worker threads\n");
+    rv = EXIT_FAILURE;
+    stop_requested = 1;
+  }
 
-      for (node = node->next_ptr; node; node = node->next_ptr)
-      {
-        printf(",\n");
-        printf("\t\t[\"%s\", \"%s\"]", timecode_to_str(&node->start), 
-            timecode_to_str(&node->end));
-      }
-      printf("\n");
+  while (!stop_requested)
+  {
+    int fd = accept(listen_fd, NULL, NULL);
 
+    if (fd == -1)
+    {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "accept() failed: %s\n", strerror(errno));
+      rv = EXIT_FAILURE;
+      break;
     }
 
-    printf("\t], \n");
+    pthread_mutex_lock(&server.mutex);
+    add_pending(&server, fd);
+    pthread_cond_signal(&server.cond);
+    pthread_mutex_unlock(&server.mutex);
   }
 
-  printf("\t\"ResultCode\": %d,\n", result_code);
-  printf("\t\"ErrorMsg\": \"%s\"",error_msg);
+  /*
+   * Stop: drop connections that haven't been picked up, and make workers
+   * waiting for a client's next request see the end of the connection.
+   */
+  close(listen_fd);
+  unlink(socket_path);
 
-  if (result_code == 200)
+  pthread_mutex_lock(&server.mutex);
+  server.stopping = true;
+  while (server.num_pending > 0) close(take_pending(&server));
+  for (size_t i = 0; i < server.num_workers; ++i)
   {
-    printf(",\n");
-    printf("\t\"DiscardedBitsAtStart\": %ld,\n", data->discarded_bits_at_start);
-    printf("\t\"Start\": \"%s\",\n", timecode_to_str(&data->start));
-    printf("\t\"End\": \"%s\"\n", timecode_to_str(&data->end));
+    if (server.workers[i].client_fd != -1) shutdown(server.workers[i].client_fd, SHUT_RD);
   }
+  pthread_cond_broadcast(&server.cond);
+  pthread_mutex_unlock(&server.mutex);
 
-  printf("}\n"); 
-}
+  for (size_t i = 0; i < server.num_workers; ++i)
+  {
+    pthread_join(server.workers[i].thread, NULL);
+    free_output_data(server.workers[i].output_data);
+  }
 
-static void usage (int status) 
-{
-  printf ("ltcdump - parse linear time code from a audio-file.\n\n");
-  printf ("Usage: ltcdump [ OPTIONS ] <filename>\n\n");
-  printf ("Options:\n\
-  -f, --fps <num>         override detected framerate\n\
-  -v, --verbose           set debug info display\n\
-  -j, --json              output results as JSON\n\
-  -h, --help              display this help and exit\n\
-\n");
+  wav_free(server.workers);
+  wav_free(server.pending_fds);
+  pthread_cond_destroy(&server.cond);
+  pthread_mutex_destroy(&server.mutex);
 
-  exit (status);
+  return rv;
 }
 
 
-static struct option const long_options[] =
-{
-  {"help", no_argument, 0, 'h'},
-  {"fps", required_argument, 0, 'f'},
-  {"verbose", no_argument, 0, 'v'},
-  {"json", no_argument, 0, 'j'},
-  {NULL, 0, NULL, 0}
-};
-
+/*
+ * Split recordings
+ *
+ * Recorders split long takes into files of 2 or 4 GB, numbering them in
+ * order. The file that follows another has the last number in its name one
+ * higher, with at least as many digits, and, if both have a bext chunk, a
+ * TimeReference that carries on where the other ends.
+ */
+static const uint32_t BEXT = (uint32_t)'txeb';
+static const uint32_t RIFF = (uint32_t)'FFIR';
+static const uint32_t WAVE = (uint32_t)'EVAW';
 
+// Offset of the 64 bit TimeReference field in the body of a bext chunk.
+static const size_t BEXT_TIME_REFERENCE_OFFSET = 338;
 
 /*
- * Decode a string containg characters '0' and '1' which represent a
- * sequence of LTC frame. Print the timestamps found in these frames
+ * Read the sample index that 'filename' starts at from its bext chunk.
+ * Returns 0 on success, or -1 if the file has no bext chunk.
  */
-static size_t consume_digits(char* digits, size_t n,
-                             size_t* digits_discarded_ptr,
-                             bool* got_frame_ptr,
-                             SMPTETimecode* timecode_ptr )
+static int read_time_reference(const char* filename, WavU64* time_reference_ptr)
 {
-  LTCFrame frame;
-  size_t frame_count = 0;
-  size_t digits_discarded = 0;
-  if (got_frame_ptr) *got_frame_ptr = false;
+  int rv = -1;
+  uint32_t header[3];
+  FILE* fptr = fopen(filename, "r");
 
-  /*
-   * We're looking for 80 characters that end in SYNC_WORD_STR
-   */
-  for (; n > 80; --n, ++digits, ++digits_discarded)
+  if (!fptr) return -1;
+
+  if (fread(header, 4, 3, fptr) != 3 || header[0] != RIFF || header[2] != WAVE)
   {
-    if (strncmp(&digits[80-16], SYNC_WORD_STR, 16) == 0)
-    {
-      log_info(2, "Got frame: %.80s", digits);
-      break;
-    }
-    else
-    {
-      log_info(2, "Looking for sync word %.80s", digits);
-      //*resynced_ptr = true;
-    }
+    goto exit;
   }
 
-  for (frame_count = 0; n > 80; ++frame_count, n -= 80)
+  while (true)
   {
-    // Consume 80 bits
-    for (size_t byte_count = 0; byte_count < 10; ++byte_count)
-    {
-      uint8_t byte = 0;
-    
-      byte |= digits[80*frame_count + byte_count*8 + 0] == '1' ? 1 : 0;
-      byte |= digits[80*frame_count + byte_count*8 + 1] == '1' ? 2 : 0;
-      byte |= digits[80*frame_count + byte_count*8 + 2] == '1' ? 4 : 0;
-      byte |= digits[80*frame_count + byte_count*8 + 3] == '1' ? 8 : 0;
-      byte |= digits[80*frame_count + byte_count*8 + 4] == '1' ? 16 : 0;
-      byte |= digits[80*frame_count + byte_count*8 + 5] == '1' ? 32 : 0;
-      byte |= digits[80*frame_count + byte_count*8 + 6] == '1' ? 64 : 0;
-      byte |= digits[80*frame_count + byte_count*8 + 7] == '1' ? 128 : 0;
-    
-      *(((uint8_t*)&frame) + byte_count) = byte;
-    }
+    uint32_t chunk_header[2];
 
-    // Checksum the frame
-    //  - Should be impossible because we syned above.
-    if (frame.sync_word != SYNC_WORD)
+    if (fread(chunk_header, 4, 2, fptr) != 2)
     {
-      return ST_ERROR;
+      break; // EOF
     }
 
-    if (got_frame_ptr)
-    {
-      *got_frame_ptr = true;
-    }
+    uint32_t chunk_size = chunk_header[1];
 
-    if (timecode_ptr)
+    if (chunk_header[0] == BEXT && chunk_size >= BEXT_TIME_REFERENCE_OFFSET + 8)
     {
-      ltc_frame_to_time(timecode_ptr, &frame);
-    }
-  }
+      uint32_t time_reference[2];   // Low, then high
 
-  if (digits_discarded_ptr) *digits_discarded_ptr = digits_discarded;
-
-  return frame_count * 80 + digits_discarded;
-}
+      if (fseek(fptr, BEXT_TIME_REFERENCE_OFFSET, SEEK_CUR) == 0
+          && fread(time_reference, 4, 2, fptr) == 2)
+      {
+        *time_reference_ptr = ((WavU64)time_reference[1] << 32) | time_reference[0];
+        rv = 0;
+      }
+      break;
+    }
 
-/*
-size_t find_first_frame(char* digits, size_t n)
-{
-  for (size_t i = 0 ; i < n - 16 ; i++)
-  {
-    if (strncmp(&digits[i], SYNC_WORD_STR, 16) == 0)
+    if (fseek(fptr, chunk_size + (chunk_size & 1), SEEK_CUR) != 0)
     {
-      return i + 16;
+      break;
     }
   }
-  return ST_ERROR;
+
+exit:
+  fclose(fptr);
+  return rv;
 }
-*/
 
 /*
- * Compute the arithmetic mean of tha data in 'data' for which the 
- * corresponding element of include is true.
+ * The name of the file that would follow 'filename', or NULL if there's no
+ * number in its name.
  */
-static size_t average(size_t* data, size_t n, int8_t* labels, int8_t label)
+static char* next_in_sequence(const char* filename)
 {
-  size_t num = 0;
-  size_t sum = 0;
+  const char* base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
 
-  for (size_t i = 0; i < n; ++i)
-  {
-    if (labels[i] == label)
-    {
-      num++;
-      sum += data[i];
-    }
-  }
+  const char* end = strrchr(base, '.');
+  if (!end) end = base + strlen(base);
 
-  return num == 0 ? ST_ERROR : sum / num;
-}
+  // The last run of digits before the extension.
+  const char* digits_end = end;
+  while (digits_end > base && !isdigit((unsigned char)digits_end[-1])) --digits_end;
 
-static size_t max(size_t* data, size_t n)
-{
-  size_t max = 0;
-  for (size_t i = 0; i < n; ++i)
-  {
-    max = data[i] > max ? data[i] : max; 
-  }
-  return max;
-}
+  const char* digits = digits_end;
+  while (digits > base && isdigit((unsigned char)digits[-1])) --digits;
 
-static size_t min(size_t* data, size_t n)
-{
-  size_t min = SIZE_MAX;
-  for (size_t i = 0; i < n; ++i)
-  {
-    min = data[i] < min ? data[i] : min; 
-  }
-  return min;
+  if (digits == digits_end) return NULL;
+
+  int width = digits_end - digits;
+  unsigned long long number = strtoull(digits, NULL, 10);
+  size_t len = strlen(filename) + 24;
+  char* next = wav_malloc(len);
+
+  snprintf(next, len, "%.*s%0*llu%s", (int)(digits - filename), filename,
+           width, number + 1, digits_end);
+  return next;
 }
 
 /*
- * Stats for each sub-distribution in bimodel; see below.
+ * 'filename' and the files that follow it, in order. The number of them is
+ * returned in '*num_files_ptr'.
  */
-typedef struct 
+static char** discover_sequence(const char* filename, size_t* num_files_ptr)
 {
-  int16_t mean;
-  size_t num_samples_outside_threshold;
-  size_t num_samples;
-  bool is_valid;
-} DistStats;
-
+  size_t num_files = 1;
+  char** files = wav_malloc(sizeof(char*));
 
-static int detect_fps(int16_t* audio_samples, size_t n, 
-                      size_t num_samples_per_sec,
-                      size_t spike_threshold)
-{
-  bool seen_spike = false; // Have we seen a spike yet
-  size_t samples_since_spike = 0;
-  size_t samples_between_spikes[100];
-  size_t spike_count = 0;
-  int8_t* labels = malloc(n * sizeof(int8_t)); 
+  files[0] = wav_strdup(filename);
 
-  for (size_t i = 0; i < n; ++i, ++samples_since_spike)
+  while (true)
   {
-    labels[i] = 0;
+    const char* last = files[num_files - 1];
+    char* next = next_in_sequence(last);
+    WavU64 last_reference, next_reference;
 
-    // NB: Sometimes the sampling puts two samples in a peak.
-    if (abs(audio_samples[i]) > spike_threshold && samples_since_spike > 1)
+    if (!next || access(next, R_OK) != 0)
     {
-      if (seen_spike && spike_count < countof(samples_between_spikes))
-      {
-        samples_between_spikes[spike_count++] = samples_since_spike;
-      }   
-      samples_since_spike = 0;
-      seen_spike = true;
+      wav_free(next);
+      break;
     }
-  }
-
-  // If no spikes, then this is not a valid LTC wav file.
-  if (!seen_spike || spike_count == 0) return -1;
-
-  // There should be a tight bimodel distribution about two peaks.
-  // The lower peak corrsponding to 0s and the upper to 1s
-  // The bit rate is given by the lower peak.
-  //
-  // So, we split into two distributions by dividing the data into those
-  // samples that lie above and below the halfway point between the maximum and
-  // minimum values.  set. Then, to check that we have reasonable looking data,
-  // we check that each distribution is tighly clustered about it's average.
-  //
-  size_t mid_point = (max(samples_between_spikes, spike_count) 
-          + min(samples_between_spikes, spike_count)) >> 1;
-
-  // Partition into values above and below mean.
-  for (size_t i = 0; i < spike_count; ++i)
-  {
-    labels[i] = samples_between_spikes[i] < mid_point ? 0 : 1;
-  }
 
-  DistStats low = {0}, high = {0};
-  low.mean = average(samples_between_spikes, spike_count, labels, /* label = */ 0);
-  high.mean = average(samples_between_spikes, spike_count, labels, /* label = */ 1);
+    if (read_time_reference(last, &last_reference) == 0
+        && read_time_reference(next, &next_reference) == 0)
+    {
+      WavFile* fptr = wav_open(last, "r");
+      bool follows = fptr && wav_file_err(fptr)->code == WAV_OK
+                     && last_reference + wav_get_length(fptr) == next_reference;
 
-  if (low.mean == ST_ERROR || high.mean == ST_ERROR) return -1;
+      if (fptr) wav_close(fptr);
 
-  // Check that 90% of the samples are within 15% of mean
-  size_t threshold = high.mean / 7;
-  for (size_t i = 0; i < spike_count; ++i) 
-  {
-    if (labels[i] == 0)
-    {
-      if (abs(samples_between_spikes[i] - low.mean) > threshold)
-      {
-        low.num_samples_outside_threshold++;
-      }
-      ++low.num_samples;
-    }
-    else
-    {
-      if (abs(samples_between_spikes[i] - high.mean) > threshold)
+      if (!follows)
       {
-        high.num_samples_outside_threshold++;
+        wav_free(next);
+        break;
       }
-      ++high.num_samples;
     }
-  }
 
-  free(labels);
+    files = wav_realloc(files, (num_files + 1) * sizeof(char*));
+    files[num_files++] = next;
+  }
 
-  low.is_valid = 1.0 * low.num_samples_outside_threshold / low.num_samples < 0.1;
-  high.is_valid = 1.0 * high.num_samples_outside_threshold / high.num_samples < 0.1;
+  *num_files_ptr = num_files;
+  return files;
+}
 
-  if (!low.is_valid || !high.is_valid)
-  {
-    return -1;
-  }
+static void usage (int status)
+{
+  printf ("ltcdump - parse linear time code from a audio-file.\n\n");
+  printf ("Usage: ltcdump [ OPTIONS ] <filename> [ <filename> ... ]\n");
+  printf ("       ltcdump [ OPTIONS ] -w <directory> [ -w <directory> ... ]\n");
+  printf ("       ltcdump [ OPTIONS ] --serve <socket>\n\n");
+  printf ("More than one <filename> are decoded as one recording, in the order given.\n\n");
+  printf ("Options:\n\
+  -c, --channel <num>     channel containing LTC (default 0)\n\
+  -f, --fps <num>         override detected framerate\n\
+  -v, --verbose           set debug info display\n\
+  -j, --json              output results as JSON\n\
+  -w, --watch <dir>       decode WAV files written to <dir>, writing JSON results\n\
+                          to a .json sidecar next to each\n\
+  -o, --output <file>     with --watch, append results to <file> instead;\n\
+                          '-' for stdout\n\
+  -F, --follow            keep decoding <filename> as it's recorded, printing\n\
+                          frames as they're found, until it's closed\n\
+  -s, --serve <socket>    answer decode requests on a UNIX domain socket\n\
+  -t, --threads <num>     with --serve, number of worker threads\n\
+                          (default: number of CPUs)\n\
+  -k, --checkpoint <sec>  save the state of the decode to <filename>.checkpoint\n\
+                          every <sec> seconds of input\n\
+  -r, --resume            carry on from <filename>.checkpoint, if there is one\n\
+                          (checkpoints every %d seconds unless -k is given)\n\
+  -S, --sequence          decode <filename> and the files that follow it in a\n\
+                          split recording as one\n\
+  -T, --find <timecode>   print the sample at which the frame HH:MM:SS:FF starts,\n\
+                          seeking to it rather than decoding the whole file\n\
+  -m, --stats             print how much memory was allocated when done\n\
+  -h, --help              display this help and exit\n\
+\n", DEFAULT_CHECKPOINT_SECONDS);
 
-  // bits per second = samples per sec / samples per bit  
-  // FPS = bits per second / 80 bits per frame
-  return num_samples_per_sec / high.mean / 80;
+  exit (status);
 }
 
+
+static struct option const long_options[] =
+{
+  {"help", no_argument, 0, 'h'},
+  {"channel", required_argument, 0, 'c'},
+  {"fps", required_argument, 0, 'f'},
+  {"verbose", no_argument, 0, 'v'},
+  {"json", no_argument, 0, 'j'},
+  {"watch", required_argument, 0, 'w'},
+  {"output", required_argument, 0, 'o'},
+  {"follow", no_argument, 0, 'F'},
+  {"serve", required_argument, 0, 's'},
+  {"threads", required_argument, 0, 't'},
+  {"checkpoint", required_argument, 0, 'k'},
+  {"resume", no_argument, 0, 'r'},
+  {"sequence", no_argument, 0, 'S'},
+  {"find", required_argument, 0, 'T'},
+  {"stats", no_argument, 0, 'm'},
+  {NULL, 0, NULL, 0}
+};
+
+
+
 #define return_fail {rv = EXIT_FAILURE; goto exit;}
 #define return_success {rv = EXIT_SUCCESS; goto exit;}
 
 int main(int argc, char **argv)
 {
   char* filename;
-  OutputData* output_data = create_output_data(&info_queue, &error_queue);
+  char** files = NULL;
+  size_t num_files = 0;
+  bool sequence = false;
+  bool show_stats = false;
   int fps = 0;
+  unsigned channel = 0;
   int c;
   int rv = EXIT_SUCCESS;
+  DumpJob* job = NULL;
+  char** watch_dirs = NULL;
+  size_t num_watch_dirs = 0;
+  const char* output_filename = NULL;
+  bool follow_file = false;
+  const char* socket_path = NULL;
+  long num_threads = 0;
+  double checkpoint_seconds = 0;
+  bool resume = false;
+  const char* find_str = NULL;
+  SMPTETimecode find_timecode;
+
+  wav_set_allocator(NULL, &counted_alloc_funcs);
 
   while ((c = getopt_long (argc, argv,
+         "c:" /* channel */
          "f:" /* fps */
          "h"  /* help */
          "v"  /* verbose */
-         "j", /* output JSON */
+         "j"  /* output JSON */
+         "w:" /* watch directory */
+         "o:" /* watch output */
+         "F"  /* follow */
+         "s:" /* serve */
+         "t:" /* server threads */
+         "k:" /* checkpoint */
+         "r" /* resume */
+         "S" /* sequence */
+         "T:" /* find */
+         "m", /* memory stats */
          long_options, (int *) 0)) != EOF)
   {
     switch (c) {
+      case 'c':
+        channel = atoi(optarg);
+        break;
+
       case 'f':
         {
         fps = atoi(optarg);
@@ -664,6 +2023,49 @@ int main(int argc, char **argv)
         json_output = true;
         break;
 
+      case 'w':
+        watch_dirs = wav_realloc(watch_dirs, (num_watch_dirs + 1) * sizeof(char*));
+        watch_dirs[num_watch_dirs++] = optarg;
+        break;
+
+      case 'o':
+        output_filename = optarg;
+        break;
+
+      case 'F':
+        follow_file = true;
+        break;
+
+      case 's':
+        socket_path = optarg;
+        break;
+
+      case 't':
+        num_threads = atol(optarg);
+        break;
+
+      case 'k':
+        checkpoint_seconds = atof(optarg);
+        if (checkpoint_seconds <= 0) usage (EXIT_FAILURE);
+        break;
+
+      case 'r':
+        resume = true;
+        break;
+
+      case 'S':
+        sequence = true;
+        break;
+
+      case 'T':
+        find_str = optarg;
+        if (timecode_from_str(find_str, &find_timecode) != 0) usage (EXIT_FAILURE);
+        break;
+
+      case 'm':
+        show_stats = true;
+        break;
+
       case 'h':
         usage (0);
 
@@ -672,239 +2074,169 @@ int main(int argc, char **argv)
     }
   }
 
-  if (optind >= argc) {
-    usage (EXIT_FAILURE);
+  if (resume && checkpoint_seconds == 0)
+  {
+    checkpoint_seconds = DEFAULT_CHECKPOINT_SECONDS;
   }
 
-  filename = argv[optind];
-
-
-  /*
-   * Do the work 
-   */
-  WavFile* fptr = wav_open(filename, "r");
-  
-  if (!fptr)
+  // Checkpoints are only for decoding a file that's already been recorded.
+  if (checkpoint_seconds > 0 && (socket_path || num_watch_dirs > 0 || follow_file))
   {
-    log_error(500, "Out of memory opening input file");
-    return_fail;
+    usage (EXIT_FAILURE);
   }
 
-  if (wav_err()->code != WAV_OK)
+  // Finding a timecode only decodes a few frames of one file.
+  if (find_str && (checkpoint_seconds > 0 || socket_path || num_watch_dirs > 0
+                   || follow_file || sequence))
   {
-    char* str = wav_err()->message;
-    log_error(404, "%s", str);
-    return_fail;
+    usage (EXIT_FAILURE);
   }
 
-
-  // We are assuming 16 bit signed audio.
-  int16_t audio_samples[512];
-  char digits[512];
-  size_t digit_count=0;
-  bool seen_spike = false; // Have we seen a spike yet
-  size_t samples_since_spike = 0;
-  bool last_digit_was_one = false; // Was the last digit output a 1 ?
-  SMPTETimecode starting_timecode;  // 1st code in current range.
-  SMPTETimecode last_timecode;      // Last code we saw
-  bool seen_starting_timecode = false;
-
-  while (true)
+  if (socket_path)
   {
-    // Fill up our audio buffer
-    size_t num_audio_samples = wav_read(fptr, audio_samples, countof(audio_samples));
+    if (optind < argc || num_watch_dirs > 0) usage (EXIT_FAILURE);
 
-    if (num_audio_samples == 0)
-    {
-      break;
-    }
+    if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0) num_threads = 1;
 
-    // Analyse the data to determine the mognitude of the spikes.
-    // - We expect a distribution like this
-    //
-    //                   *|*
-    //                   *|*                 
-    //   **             **|**                **
-    // -------------------|----------------------
-    //
-    // Most data is clustered around zero with some outliers,
-    // which are the spikes.
-    // So, we can consider any sample with a magnitude 
-    // greater than half the max value to be a spike
-    int16_t max = 0;
-    for (size_t i = 0; i < num_audio_samples; ++i)
-    {
-      if (audio_samples[i] > max)
-        max = audio_samples[i];
-    } 
-
-    int16_t threshold = max >> 1;
-
-    log_info(2, "Using threshold %d", threshold);
-
-    /*
-     * If it's the first block of data, calibrate the FPS
-     */
-    if (digit_count == 0 && fps == 0)
-    {
-      size_t freq = wav_get_sample_rate(fptr);
-      fps = detect_fps(audio_samples, num_audio_samples, freq, threshold);
-      
-      if (fps == -1)
-      {
-        log_error(415, "Failed to detect FPS; input does not contain LTC.");
-        return_fail;
-      }
+    // Results are only ever written as JSON.
+    json_output = true;
+    rv = serve(socket_path, num_threads, channel, fps);
 
-      log_info(1, "Detected FPS=%d", fps);
-    }
+    wav_err_clear();
+    if (show_stats) print_memory_stats();
+    return rv;
+  }
 
+  if (num_watch_dirs > 0)
+  {
+    FILE* out = NULL;
 
-    /*
-     * Process audio samples to digits.
-     */
-    size_t short_long_threshold = 0.72 * fps;
+    if (optind < argc) usage (EXIT_FAILURE);
 
-    for (size_t i = 0; i < num_audio_samples; ++i, ++samples_since_spike)
+    if (output_filename)
     {
-      if ((abs(audio_samples[i]) > (max >> 1)) 
-          // The sampling might give two adjacent samples in the spike
-          && samples_since_spike > 1
-          )
+      out = strcmp(output_filename, "-") == 0 ? stdout : fopen(output_filename, "a");
+      if (!out)
       {
-        // If this is not the first spike, then it makes sense
-        // to calculate the duration since the last spike.
-        if (seen_spike)
-        {
-          if (samples_since_spike < short_long_threshold)
-          {
-            // Short -> 1
-            // (Two spikes equates to a '1', so skip the second)
-            if (!last_digit_was_one)
-            {
-              digits[digit_count++] = '1';
-              last_digit_was_one = true;
-            }
-            else
-            {
-              last_digit_was_one = false;
-            }
-          }
-          else
-          {
-            // Long --> 0
-            last_digit_was_one = false;
-            digits[digit_count++] = '0';
-          } 
-        }
-  
-        seen_spike = true;
-        samples_since_spike = 0;
-
-        /*
-         * If we've over-filled the digits buffer then it's likely that
-         * consume_digits() has not found any valid LTC frames. 
-         */
-        if (digit_count == sizeof(digits))
-        {
-          log_error(415, "No LTC frames found in input file.");
-          return_fail
-        }
+        fprintf(stderr, "Failed to open '%s': %s\n", output_filename, strerror(errno));
+        return EXIT_FAILURE;
       }
     }
 
-    /*
-     * Consume digits and output time code
-     */
-    bool got_frame;
-    size_t digits_discarded = 0;
-    size_t num_digits_consumed = consume_digits(digits, digit_count, 
-                                                &digits_discarded, 
-                                                &got_frame, 
-                                                &last_timecode);
+    // Results are only ever written as JSON.
+    json_output = true;
+    rv = watch(watch_dirs, num_watch_dirs, channel, fps, out);
 
-    if (num_digits_consumed == ST_ERROR)
-    {
-      log_error(408, "Lost synchronisation");
-      return_fail;
-    }
+    if (out && out != stdout) fclose(out);
+    wav_free(watch_dirs);
 
-    if (!seen_starting_timecode)
-    {
-      output_data->discarded_bits_at_start += digits_discarded;
-    }
+    wav_err_clear();
+    if (show_stats) print_memory_stats();
+    return rv;
+  }
 
+  if (optind >= argc) {
+    usage (EXIT_FAILURE);
+  }
 
-    // Remove consumed digits from buffer
-    memmove(digits, digits + num_digits_consumed, digit_count - num_digits_consumed);
-    digit_count -= num_digits_consumed;
+  filename = argv[optind];
 
-    if (got_frame > 0)
-    {
-      log_info(2, "Frame: %s", timecode_to_str(&last_timecode));
+  if (find_str)
+  {
+    if (optind + 1 < argc) usage (EXIT_FAILURE);
 
-      if (digits_discarded > 0 && seen_starting_timecode)
-      {
-        log_info(1, "Warning: Gap between LTC frames");
-      
-        log_info(0, "Timecode range %s --> %s", 
-                    timecode_to_str(&starting_timecode),
-                    timecode_to_str(&last_timecode));
+    job = create_dump_job(filename, channel, fps);
+    rv = dump_job_find(job, &find_timecode) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 
-        // Add to linked list of ranges for JSON.
-        timecode_range_append(&output_data->timecode_range_ptr, 
-                              create_timecode_range(&starting_timecode, &last_timecode));
+    if (json_output)
+    {
+      output_data_to_json(job->output_data, NULL, stdout);
+    }
 
-        starting_timecode = last_timecode;
-      }
+    free_dump_job(job);
 
-      if (!seen_starting_timecode)
-      {
-        starting_timecode = last_timecode;
-        seen_starting_timecode = true;
-      }
-    }
+    wav_err_clear();
+    if (show_stats) print_memory_stats();
+    return rv;
   }
 
-  if (seen_starting_timecode)
+  if (sequence)
   {
-    log_info(0, "Timecode range %s --> %s", 
-                timecode_to_str(&starting_timecode),
-                timecode_to_str(&last_timecode));
+    if (optind + 1 < argc) usage (EXIT_FAILURE);
+    files = discover_sequence(filename, &num_files);
+  }
+  else
+  {
+    num_files = argc - optind;
+    files = wav_malloc(num_files * sizeof(char*));
+    for (size_t i = 0; i < num_files; ++i) files[i] = wav_strdup(argv[optind + i]);
+  }
 
-    // Add to linked list of ranges for JSON.
-    timecode_range_append(&output_data->timecode_range_ptr, 
-                          create_timecode_range(&starting_timecode, &last_timecode));
+  // A checkpoint is of one file, and following one only makes sense for the last.
+  if (num_files > 1 && (checkpoint_seconds > 0 || follow_file))
+  {
+    usage (EXIT_FAILURE);
   }
 
-exit:
-  wav_close(fptr);
 
-  // Extract start and end timecodes.
-  if (!output_data->timecode_range_ptr)
+  /*
+   * Do the work
+   */
+  job = create_dump_job(filename, channel, fps);
+
+  if (follow_file)
   {
-    log_error(415, "No timecode found in file.");
+    if (follow(job) != 0) return_fail;
   }
   else
   {
-    output_data->start = output_data->timecode_range_ptr->start;
+    if (dump_job_open(job, true) != 0) return_fail;
 
-    for (SMPTETimecodeRange* ptr = output_data->timecode_range_ptr; 
-         ptr; 
-         ptr = ptr->next_ptr)
+    if (checkpoint_seconds > 0)
     {
-      if (!ptr->next_ptr)
-      {
-        output_data->end = output_data->timecode_range_ptr->end;
-      }
+      if (resume) dump_job_resume(job);
+
+      job->checkpoint_interval = (WavU64)(checkpoint_seconds * job->decoder.sample_rate);
+      job->next_checkpoint = job->decoder.sample_count + job->checkpoint_interval;
+    }
+
+    if (num_files > 1)
+    {
+      add_output_file(job->output_data, files[0], 0);
+    }
+
+    if (dump_job_read(job) != 0) return_fail;
+
+    for (size_t i = 1; i < num_files; ++i)
+    {
+      if (dump_job_continue(job, files[i]) != 0 || dump_job_read(job) != 0) return_fail;
+    }
+
+    // The decode is complete, so the last checkpoint is no use.
+    if (checkpoint_seconds > 0)
+    {
+      char* path = checkpoint_path(filename);
+      unlink(path);
+      wav_free(path);
     }
   }
 
+exit:
+  dump_job_finish(job);
 
   if (json_output)
   {
-    output_data_to_json(output_data);
+    output_data_to_json(job->output_data, NULL, stdout);
   }
 
+  free_dump_job(job);
+
+  for (size_t i = 0; i < num_files; ++i) wav_free(files[i]);
+  wav_free(files);
+
+  wav_err_clear();
+  if (show_stats) print_memory_stats();
+
   return rv;
 }
@@ -0,0 +1,1004 @@
+/*
+ * Index the timecode of an archive of recordings, so that we can find which
+ * files cover a timecode without decoding or searching through all of them.
+ *
+ * Each timecode range in a file becomes a segment of a timeline that's keyed
+ * by the recording date from the bext chunk and the time of day from the LTC.
+ * The index is a single file holding the segments sorted by their start, laid
+ * out as an implicit interval tree: the sorted array is treated as a binary
+ * search tree whose node at index i is at level (number of trailing 1 bits
+ * of i), and each segment also holds the largest end in its subtree. A query
+ * visits O(log n) nodes plus the segments it finds, and as the index is
+ * mapped into memory, only the pages on the way are read from disk.
+ *
+ * The index is never changed in place. Adding files writes a new index with
+ * the old segments merged in, and renames it over the old one.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wav.h"
+#include "ltc.h"
+
+static const char false = 0;
+static const char true = 1;
+
+#define return_fail {rv = EXIT_FAILURE; goto exit;}
+
+static const uint32_t BEXT = (uint32_t)'txeb';
+static const uint32_t RIFF = (uint32_t)'FFIR';
+static const uint32_t WAVE = (uint32_t)'EVAW';
+
+// Offset of the 10 character OriginationDate field in the body of a bext chunk.
+static const size_t BEXT_ORIGINATION_DATE_OFFSET = 320;
+
+static const uint32_t INDEX_MAGIC = (uint32_t)'XDTL';
+static const uint32_t INDEX_VERSION = 1;
+
+/*
+ * Positions on the timeline are in ticks of 1/600 s, a whole number of
+ * ticks per frame at all of the usual frame rates, counted from midnight
+ * at the start of 1970-01-01. Files without a bext date are indexed as if
+ * they were recorded on that day.
+ */
+#define TICKS_PER_SECOND 600
+#define TICKS_PER_DAY (24LL * 60 * 60 * TICKS_PER_SECOND)
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_segments;
+  uint64_t num_files;
+  uint64_t num_days;
+  uint64_t names_size;
+  int32_t  max_level;     // Level of the root of the interval tree
+  uint32_t fps;           // Frame rate of the first file indexed
+} IndexHeader;
+
+/*
+ * A timecode range of a file, covering ticks [start, end).
+ */
+typedef struct
+{
+  int64_t  start;
+  int64_t  end;
+  int64_t  max_end;       // Largest end in the subtree rooted here
+  uint64_t start_sample;  // Sample index of the first bit of the first frame
+  uint32_t file;          // Index into the file names
+  uint32_t sample_rate;
+  uint32_t fps;
+  uint32_t reserved;
+} Segment;
+
+/*
+ * The index file is laid out as:
+ *
+ *   IndexHeader
+ *   Segment  segments[num_segments]    sorted by start, then end
+ *   uint64_t name_offsets[num_files]   into names
+ *   int64_t  days[num_days]            distinct days with segments, sorted
+ *   char     names[names_size]         NUL terminated file names
+ */
+typedef struct
+{
+  void*        map;
+  size_t       map_size;
+  IndexHeader* header;
+  Segment*     segments;
+  uint64_t*    name_offsets;
+  int64_t*     days;
+  const char*  names;
+} Index;
+
+static int verbosity = 0;
+
+static void decoder_log(void* context, int level, int status_code,
+                        const char* fmt, va_list args)
+{
+  const char* filename = context;
+
+  if (status_code != 0)
+  {
+    fprintf(stderr, "%s: %d: ", filename, status_code);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+  }
+  else if (verbosity >= level + 1)
+  {
+    printf(" *** %s:", filename);
+    vprintf(fmt, args);
+    printf("\n");
+  }
+}
+
+/*
+ * Dates, as days since 1970-01-01 in the proleptic Gregorian calendar.
+ */
+static int64_t days_from_date(int year, unsigned month, unsigned day)
+{
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  unsigned year_of_era = year - era * 400;
+  unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+  return era * 146097 + day_of_era - 719468;
+}
+
+static void date_from_days(int64_t days, int* year_ptr, unsigned* month_ptr, unsigned* day_ptr)
+{
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  unsigned day_of_era = days - era * 146097;
+  unsigned year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  unsigned mp = (5 * day_of_year + 2) / 153;
+
+  *day_ptr = day_of_year - (153 * mp + 2) / 5 + 1;
+  *month_ptr = mp < 10 ? mp + 3 : mp - 9;
+  *year_ptr = year_of_era + era * 400 + (*month_ptr <= 2);
+}
+
+/*
+ * Parse "yyyy-mm-dd". The bext spec allows any separator, so any is accepted.
+ * Returns 0 on success.
+ */
+static int parse_date(const char* str, int64_t* days_ptr)
+{
+  int year;
+  unsigned month, day;
+
+  if (sscanf(str, "%4d%*1[-_:/. ]%2u%*1[-_:/. ]%2u", &year, &month, &day) != 3
+      || month < 1 || month > 12 || day < 1 || day > 31)
+  {
+    return -1;
+  }
+
+  *days_ptr = days_from_date(year, month, day);
+  return 0;
+}
+
+static char* date_to_str(int64_t days, char* buffer, size_t size)
+{
+  int year;
+  unsigned month, day;
+
+  date_from_days(days, &year, &month, &day);
+  snprintf(buffer, size, "%04d-%02u-%02u", year, month, day);
+  return buffer;
+}
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+/*
+ * Read the recording date from the bext chunk of 'filename'. Returns 0 on
+ * success, or -1 if the file has no bext chunk or the date can't be parsed.
+ */
+static int read_recording_date(const char* filename, int64_t* days_ptr)
+{
+  int rv = -1;
+  uint32_t header[3];
+  FILE* fptr = fopen(filename, "r");
+
+  if (!fptr) return -1;
+
+  if (fread(header, 4, 3, fptr) != 3 || header[0] != RIFF || header[2] != WAVE)
+  {
+    goto exit;
+  }
+
+  while (true)
+  {
+    uint32_t chunk_header[2];
+
+    if (fread(chunk_header, 4, 2, fptr) != 2)
+    {
+      break; // EOF
+    }
+
+    uint32_t chunk_size = chunk_header[1];
+
+    if (chunk_header[0] == BEXT && chunk_size >= BEXT_ORIGINATION_DATE_OFFSET + 10)
+    {
+      char date[11] = {0};
+
+      if (fseek(fptr, BEXT_ORIGINATION_DATE_OFFSET, SEEK_CUR) == 0
+          && fread(date, 10, 1, fptr) == 1
+          && parse_date(date, days_ptr) == 0)
+      {
+        rv = 0;
+      }
+      break;
+    }
+
+    if (fseek(fptr, chunk_size + (chunk_size & 1), SEEK_CUR) != 0)
+    {
+      break;
+    }
+  }
+
+exit:
+  fclose(fptr);
+  return rv;
+}
+
+/*
+ * Building
+ */
+typedef struct
+{
+  Segment* segments;
+  size_t   num_segments;
+  size_t   max_segments;
+  char**   names;
+  size_t   num_files;
+  size_t   max_files;
+} IndexBuilder;
+
+static Segment* builder_add_segment(IndexBuilder* builder)
+{
+  if (builder->num_segments == builder->max_segments)
+  {
+    builder->max_segments = builder->max_segments ? builder->max_segments * 2 : 1024;
+    builder->segments = realloc(builder->segments, builder->max_segments * sizeof(Segment));
+  }
+
+  Segment* segment = &builder->segments[builder->num_segments++];
+  memset(segment, 0, sizeof(Segment));
+  return segment;
+}
+
+static uint32_t builder_add_file(IndexBuilder* builder, const char* name)
+{
+  if (builder->num_files == builder->max_files)
+  {
+    builder->max_files = builder->max_files ? builder->max_files * 2 : 1024;
+    builder->names = realloc(builder->names, builder->max_files * sizeof(char*));
+  }
+
+  builder->names[builder->num_files] = strdup(name);
+  return builder->num_files++;
+}
+
+static void free_builder(IndexBuilder* builder)
+{
+  for (size_t i = 0; i < builder->num_files; ++i)
+  {
+    free(builder->names[i]);
+  }
+  free(builder->names);
+  free(builder->segments);
+}
+
+/*
+ * Decode the LTC in 'channel' of 'filename' and add its timecode ranges to
+ * 'builder'. 'buffer' holds 'block_size' samples. Returns the number of
+ * segments added, or -1 on failure; the reason will have been printed.
+ */
+static int index_file(IndexBuilder* builder, const char* filename,
+                      unsigned channel, int fps,
+                      WavI16* buffer, size_t block_size)
+{
+  int rv = -1;
+  LtcDecoder decoder = {0};
+  int64_t day = 0;
+  WavFile* fptr;
+
+  wav_err_clear();
+  fptr = wav_open(filename, "r");
+  ltc_decoder_init(&decoder, 0, fps, decoder_log, (void*)filename);
+
+  if (!fptr)
+  {
+    fprintf(stderr, "%s: Out of memory opening input file\n", filename);
+    goto exit;
+  }
+
+  if (wav_err()->code != WAV_OK)
+  {
+    fprintf(stderr, "%s: %s\n", filename, wav_err()->message);
+    goto exit;
+  }
+
+  if (channel >= wav_get_num_channels(fptr))
+  {
+    fprintf(stderr, "%s: Input has no channel %u\n", filename, channel);
+    goto exit;
+  }
+
+  decoder.sample_rate = wav_get_sample_rate(fptr);
+
+  // A range must only cover timecode that's actually in the file.
+  decoder.split_on_jump = true;
+
+  while (true)
+  {
+    size_t num_audio_samples = wav_read_channel_i16(fptr, channel, buffer, block_size);
+
+    if (num_audio_samples == 0)
+    {
+      if (wav_err()->code != WAV_OK)
+      {
+        fprintf(stderr, "%s: %s\n", filename, wav_err()->message);
+        goto exit;
+      }
+      break;
+    }
+
+    if (ltc_decoder_process(&decoder, buffer, num_audio_samples) != 0)
+    {
+      goto exit;
+    }
+  }
+
+  ltc_decoder_finish(&decoder);
+
+  if (!decoder.timecode_range_ptr)
+  {
+    fprintf(stderr, "%s: No timecode found in file.\n", filename);
+    goto exit;
+  }
+
+  if (read_recording_date(filename, &day) != 0 && verbosity >= 1)
+  {
+    printf(" *** %s: No recording date, indexing as 1970-01-01\n", filename);
+  }
+
+  /*
+   * The date is that of the first frame. Each range is put on whichever
+   * day brings it closest to where the first frame and the samples since
+   * then say it should be, so that ranges after midnight go on the next day.
+   */
+  const SMPTETimecodeRange* first_range = decoder.timecode_range_ptr;
+  const int64_t ticks_per_frame = TICKS_PER_SECOND / decoder.fps;
+  const int64_t first_start = day * TICKS_PER_DAY
+                            + timecode_to_frames(&first_range->start, decoder.fps) * ticks_per_frame;
+  uint32_t file = builder_add_file(builder, filename);
+
+  rv = 0;
+
+  for (SMPTETimecodeRange* range = decoder.timecode_range_ptr; range; range = range->next_ptr)
+  {
+    Segment* segment = builder_add_segment(builder);
+    int64_t elapsed = (int64_t)(range->start_sample - first_range->start_sample)
+                    * TICKS_PER_SECOND / decoder.sample_rate;
+    int64_t start_of_day = timecode_to_frames(&range->start, decoder.fps) * ticks_per_frame;
+    int64_t end_of_day = (timecode_to_frames(&range->end, decoder.fps) + 1) * ticks_per_frame;
+    int64_t predicted = first_start + elapsed;
+
+    segment->start = floor_div(predicted - start_of_day + TICKS_PER_DAY / 2, TICKS_PER_DAY)
+                   * TICKS_PER_DAY + start_of_day;
+    segment->end = segment->start - start_of_day + end_of_day;
+    if (end_of_day <= start_of_day) segment->end += TICKS_PER_DAY;
+    segment->start_sample = range->start_sample;
+    segment->file = file;
+    segment->sample_rate = decoder.sample_rate;
+    segment->fps = decoder.fps;
+    rv++;
+  }
+
+exit:
+  ltc_decoder_free(&decoder);
+  if (fptr) wav_close(fptr);
+  return rv;
+}
+
+static int compare_segments(const void* a, const void* b)
+{
+  const Segment* x = a;
+  const Segment* y = b;
+
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  if (x->end != y->end) return x->end < y->end ? -1 : 1;
+  return 0;
+}
+
+static int compare_days(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static int64_t max3(int64_t a, int64_t b, int64_t c)
+{
+  int64_t m = a > b ? a : b;
+  return m > c ? m : c;
+}
+
+/*
+ * Fill in the max_end of 'n' segments sorted by start, and return the level
+ * of the root of the implicit tree.
+ *
+ * Leaves are at even indices. The node at index i on level k has children at
+ * i -/+ 2^(k-1); a right child past the end of the array stands for the
+ * largest end among the segments that do exist in that subtree.
+ */
+static int build_interval_tree(Segment* segments, size_t n)
+{
+  int64_t last = 0;             // max_end of the last node on the current level
+  size_t last_i = 0;
+  int k;
+
+  if (n == 0) return -1;
+
+  for (size_t i = 0; i < n; i += 2)
+  {
+    last_i = i;
+    last = segments[i].max_end = segments[i].end;
+  }
+
+  for (k = 1; ((size_t)1 << k) <= n; ++k)
+  {
+    size_t x = (size_t)1 << (k - 1);
+
+    for (size_t i = (x << 1) - 1; i < n; i += x << 2)
+    {
+      int64_t left = segments[i - x].max_end;
+      int64_t right = i + x < n ? segments[i + x].max_end : last;
+
+      segments[i].max_end = max3(segments[i].end, left, right);
+    }
+
+    last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+    if (last_i < n && segments[last_i].max_end > last) last = segments[last_i].max_end;
+  }
+
+  return k - 1;
+}
+
+static int write_all(FILE* fptr, const void* data, size_t size)
+{
+  return size == 0 || fwrite(data, size, 1, fptr) == 1 ? 0 : -1;
+}
+
+/*
+ * Sort the segments of 'builder' and write them to 'filename', by way of a
+ * temporary file so that readers only ever see a complete index.
+ */
+static int write_index(IndexBuilder* builder, const char* filename)
+{
+  int rv = -1;
+  IndexHeader header = {0};
+  uint64_t* name_offsets = calloc(builder->num_files, sizeof(uint64_t));
+  size_t max_days = builder->num_segments + 1;
+  int64_t* days = malloc(max_days * sizeof(int64_t));
+  size_t num_days = 0;
+  size_t tmp_size = strlen(filename) + 5;
+  char* tmp_filename = malloc(tmp_size);
+  FILE* fptr = NULL;
+
+  snprintf(tmp_filename, tmp_size, "%s.tmp", filename);
+
+  qsort(builder->segments, builder->num_segments, sizeof(Segment), compare_segments);
+
+  /*
+   * A segment is on every day that it overlaps, so that queries for one day
+   * find segments that start the day before.
+   */
+  for (size_t i = 0; i < builder->num_segments; ++i)
+  {
+    int64_t first = floor_div(builder->segments[i].start, TICKS_PER_DAY);
+    int64_t last = floor_div(builder->segments[i].end - 1, TICKS_PER_DAY);
+
+    for (int64_t day = first; day <= last; ++day)
+    {
+      if (num_days > 0 && days[num_days - 1] == day) continue;
+      if (num_days == max_days)
+      {
+        max_days *= 2;
+        days = realloc(days, max_days * sizeof(int64_t));
+      }
+      days[num_days++] = day;
+    }
+  }
+
+  qsort(days, num_days, sizeof(int64_t), compare_days);
+  size_t unique_days = 0;
+  for (size_t i = 0; i < num_days; ++i)
+  {
+    if (unique_days == 0 || days[unique_days - 1] != days[i]) days[unique_days++] = days[i];
+  }
+
+  for (size_t i = 0; i < builder->num_files; ++i)
+  {
+    name_offsets[i] = header.names_size;
+    header.names_size += strlen(builder->names[i]) + 1;
+  }
+
+  header.magic = INDEX_MAGIC;
+  header.version = INDEX_VERSION;
+  header.num_segments = builder->num_segments;
+  header.num_files = builder->num_files;
+  header.num_days = unique_days;
+  header.max_level = build_interval_tree(builder->segments, builder->num_segments);
+  header.fps = builder->num_segments > 0 ? builder->segments[0].fps : 0;
+
+  fptr = fopen(tmp_filename, "w");
+  if (!fptr)
+  {
+    fprintf(stderr, "Failed to create '%s'\n", tmp_filename);
+    goto exit;
+  }
+
+  if (write_all(fptr, &header, sizeof(header)) != 0
+      || write_all(fptr, builder->segments, builder->num_segments * sizeof(Segment)) != 0
+      || write_all(fptr, name_offsets, builder->num_files * sizeof(uint64_t)) != 0
+      || write_all(fptr, days, unique_days * sizeof(int64_t)) != 0)
+  {
+    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    goto exit;
+  }
+
+  for (size_t i = 0; i < builder->num_files; ++i)
+  {
+    if (write_all(fptr, builder->names[i], strlen(builder->names[i]) + 1) != 0)
+    {
+      fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+      goto exit;
+    }
+  }
+
+  if (fclose(fptr) != 0)
+  {
+    fptr = NULL;
+    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    goto exit;
+  }
+  fptr = NULL;
+
+  if (rename(tmp_filename, filename) != 0)
+  {
+    fprintf(stderr, "Failed to replace '%s'\n", filename);
+    goto exit;
+  }
+
+  rv = 0;
+
+exit:
+  if (fptr) fclose(fptr);
+  if (rv != 0) unlink(tmp_filename);
+  free(tmp_filename);
+  free(days);
+  free(name_offsets);
+  return rv;
+}
+
+/*
+ * Reading
+ */
+
+/*
+ * Map 'filename' into memory. Returns 0 on success, 1 if the index doesn't
+ * exist, or -1 on failure; the reason will have been printed.
+ */
+static int open_index(Index* index, const char* filename)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+
+  memset(index, 0, sizeof(Index));
+
+  if (fd == -1) return 1;
+
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader))
+  {
+    fprintf(stderr, "'%s' is not an index\n", filename);
+    close(fd);
+    return -1;
+  }
+
+  index->map_size = st.st_size;
+  index->map = mmap(NULL, index->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (index->map == MAP_FAILED)
+  {
+    index->map = NULL;
+    fprintf(stderr, "Failed to map '%s'\n", filename);
+    return -1;
+  }
+
+  index->header = index->map;
+
+  IndexHeader* header = index->header;
+  uint64_t size = sizeof(IndexHeader) + header->num_segments * sizeof(Segment)
+                + header->num_files * sizeof(uint64_t) + header->num_days * sizeof(int64_t)
+                + header->names_size;
+
+  if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION
+      || size != index->map_size)
+  {
+    fprintf(stderr, "'%s' is not an index, or is from a different version\n", filename);
+    munmap(index->map, index->map_size);
+    index->map = NULL;
+    return -1;
+  }
+
+  index->segments = (Segment*)(header + 1);
+  index->name_offsets = (uint64_t*)(index->segments + header->num_segments);
+  index->days = (int64_t*)(index->name_offsets + header->num_files);
+  index->names = (const char*)(index->days + header->num_days);
+
+  return 0;
+}
+
+static void close_index(Index* index)
+{
+  if (index->map) munmap(index->map, index->map_size);
+  index->map = NULL;
+}
+
+static const char* index_file_name(const Index* index, uint32_t file)
+{
+  return index->names + index->name_offsets[file];
+}
+
+/*
+ * Call 'found' for each segment that covers ticks [start, end).
+ */
+typedef void (*FoundFunc)(const Index* index, const Segment* segment, int64_t position);
+
+static void query_index(const Index* index, int64_t start, int64_t end, FoundFunc found)
+{
+  struct { size_t x; int k; bool visited; } stack[128];
+  const Segment* segments = index->segments;
+  const size_t n = index->header->num_segments;
+  int t = 0;
+
+  if (n == 0) return;
+
+  stack[t].x = ((size_t)1 << index->header->max_level) - 1;
+  stack[t].k = index->header->max_level;
+  stack[t++].visited = false;
+
+  while (t > 0)
+  {
+    size_t x = stack[--t].x;
+    int k = stack[t].k;
+    bool visited = stack[t].visited;
+
+    if (k <= 3)
+    {
+      // Small subtrees are quicker to scan in order.
+      size_t i0 = x >> k << k;
+      size_t i1 = i0 + ((size_t)1 << (k + 1)) - 1;
+
+      if (i1 > n) i1 = n;
+      for (size_t i = i0; i < i1 && segments[i].start < end; ++i)
+      {
+        if (start < segments[i].end) found(index, &segments[i], start);
+      }
+    }
+    else if (!visited)
+    {
+      // Come back to this node after its left subtree.
+      size_t y = x - ((size_t)1 << (k - 1));
+
+      stack[t].x = x;
+      stack[t].k = k;
+      stack[t++].visited = true;
+
+      if (y >= n || segments[y].max_end > start)
+      {
+        stack[t].x = y;
+        stack[t].k = k - 1;
+        stack[t++].visited = false;
+      }
+    }
+    else if (x < n && segments[x].start < end)
+    {
+      if (start < segments[x].end) found(index, &segments[x], start);
+
+      stack[t].x = x + ((size_t)1 << (k - 1));
+      stack[t].k = k - 1;
+      stack[t++].visited = false;
+    }
+  }
+}
+
+static void print_segment(const Index* index, const Segment* segment, int64_t position)
+{
+  SMPTETimecode start, end;
+  char date[16];
+  const int64_t ticks_per_frame = TICKS_PER_SECOND / segment->fps;
+  WavU64 sample = segment->start_sample
+                + (position - segment->start) * segment->sample_rate / TICKS_PER_SECOND;
+
+  frames_to_timecode(&start, floor_div(segment->start, ticks_per_frame), segment->fps);
+  frames_to_timecode(&end, floor_div(segment->end, ticks_per_frame) - 1, segment->fps);
+
+  printf("%s\t%llu\t%s\t%s\t%s\n", index_file_name(index, segment->file),
+         (unsigned long long)sample,
+         date_to_str(floor_div(segment->start, TICKS_PER_DAY), date, sizeof(date)),
+         timecode_to_str(&start), timecode_to_str(&end));
+}
+
+/*
+ * Print the segments covering 'timecode' on 'day', or on every day in the
+ * index if 'day' is NULL.
+ */
+static void query_timecode(const Index* index, const SMPTETimecode* timecode, int fps,
+                           const int64_t* day)
+{
+  const int64_t time_of_day = timecode_to_frames(timecode, fps) * (TICKS_PER_SECOND / fps);
+
+  if (day)
+  {
+    int64_t position = *day * TICKS_PER_DAY + time_of_day;
+    query_index(index, position, position + 1, print_segment);
+    return;
+  }
+
+  for (size_t i = 0; i < index->header->num_days; ++i)
+  {
+    int64_t position = index->days[i] * TICKS_PER_DAY + time_of_day;
+    query_index(index, position, position + 1, print_segment);
+  }
+}
+
+static int compare_names(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Add 'name' to 'names' as an absolute path, so that the same file given
+ * another way, or from another directory, is the same entry in the index.
+ * A file that can't be resolved keeps its name, for indexing to report.
+ */
+static void add_name(char*** names_ptr, size_t* num_names_ptr, const char* name)
+{
+  char* path = realpath(name, NULL);
+
+  *names_ptr = realloc(*names_ptr, (*num_names_ptr + 1) * sizeof(char*));
+  (*names_ptr)[(*num_names_ptr)++] = path ? path : strdup(name);
+}
+
+static void usage (int status)
+{
+  printf ("ltcindex - Index the LTC of an archive of recordings, and search it.\n\n");
+  printf ("Usage: ltcindex [ OPTIONS ] <index> <filename> [ <filename> ... ]\n");
+  printf ("       ltcindex [ OPTIONS ] -q <index> <timecode> [ <timecode> ... ]\n\n");
+  printf ("Files are added to the index, replacing any that are already in it. A\n");
+  printf ("filename of - reads the names of the files from stdin, one per line.\n");
+  printf ("A query prints the file, sample, date and range covering each timecode.\n\n");
+  printf ("Options:\n\
+  -c, --channel <num>     channel containing LTC (default 0)\n\
+  -f, --fps <num>         override detected framerate when indexing; frame\n\
+                          rate of queries (default: that of the first file)\n\
+  -q, --query             search the index for timecodes (HH:MM:SS:FF)\n\
+  -d, --date <yyyy-mm-dd> only search recordings made on this date\n\
+  -v, --verbose           set debug info display\n\
+  -h, --help              display this help and exit\n\
+\n");
+
+  exit (status);
+}
+
+static struct option const long_options[] =
+{
+  {"help", no_argument, 0, 'h'},
+  {"channel", required_argument, 0, 'c'},
+  {"fps", required_argument, 0, 'f'},
+  {"query", no_argument, 0, 'q'},
+  {"date", required_argument, 0, 'd'},
+  {"verbose", no_argument, 0, 'v'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+  int rv = EXIT_SUCCESS;
+  int fps = 0;
+  unsigned channel = 0;
+  bool query = false;
+  bool have_date = false;
+  int64_t date = 0;
+  int c;
+  Index index = {0};
+  IndexBuilder builder = {0};
+  char** new_names = NULL;
+  size_t num_new_names = 0;
+  WavI16* buffer = NULL;
+  static const size_t block_size = 4096;
+
+  while ((c = getopt_long (argc, argv,
+         "c:" /* channel */
+         "f:" /* fps */
+         "q"  /* query */
+         "d:" /* date */
+         "v"  /* verbose */
+         "h", /* help */
+         long_options, (int *) 0)) != EOF)
+  {
+    switch (c) {
+      case 'c':
+        channel = atoi(optarg);
+        break;
+
+      case 'f':
+        fps = atoi(optarg);
+        break;
+
+      case 'q':
+        query = true;
+        break;
+
+      case 'd':
+        if (parse_date(optarg, &date) != 0)
+        {
+          fprintf(stderr, "Invalid date '%s'\n", optarg);
+          usage (EXIT_FAILURE);
+        }
+        have_date = true;
+        break;
+
+      case 'v':
+        verbosity++;
+        break;
+
+      case 'h':
+        usage (0);
+
+      default:
+        usage (EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind < 2)
+  {
+    usage(EXIT_FAILURE);
+  }
+
+  if (fps != 0 && (fps < 0 || TICKS_PER_SECOND % fps != 0))
+  {
+    fprintf(stderr, "Unsupported frame rate %d\n", fps);
+    return EXIT_FAILURE;
+  }
+
+  const char* index_filename = argv[optind++];
+  int open_rv = open_index(&index, index_filename);
+
+  if (open_rv < 0 || (query && open_rv > 0))
+  {
+    if (open_rv > 0) fprintf(stderr, "Failed to open '%s'\n", index_filename);
+    return_fail;
+  }
+
+  if (query)
+  {
+    if (fps == 0) fps = index.header->fps ? index.header->fps : 25;
+
+    for (int i = optind; i < argc; ++i)
+    {
+      SMPTETimecode timecode;
+
+      if (timecode_from_str(argv[i], &timecode) != 0 || timecode.frame >= fps)
+      {
+        fprintf(stderr, "Invalid timecode '%s'\n", argv[i]);
+        rv = EXIT_FAILURE;
+        continue;
+      }
+
+      query_timecode(&index, &timecode, fps, have_date ? &date : NULL);
+    }
+
+    goto exit;
+  }
+
+  /*
+   * Collect the names of the files to add, so that their old segments can
+   * be dropped from the index.
+   */
+  for (int i = optind; i < argc; ++i)
+  {
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t num_bytes;
+
+    if (strcmp(argv[i], "-") != 0)
+    {
+      add_name(&new_names, &num_new_names, argv[i]);
+      continue;
+    }
+
+    while ((num_bytes = getline(&line, &len, stdin)) != -1)
+    {
+      while (num_bytes > 0 && (line[num_bytes - 1] == '\n' || line[num_bytes - 1] == '\r'))
+      {
+        line[--num_bytes] = '\0';
+      }
+      if (num_bytes == 0) continue;
+
+      add_name(&new_names, &num_new_names, line);
+    }
+    free(line);
+  }
+
+  qsort(new_names, num_new_names, sizeof(char*), compare_names);
+
+  if (index.map)
+  {
+    uint32_t* file_map = malloc(index.header->num_files * sizeof(uint32_t));
+
+    for (uint64_t i = 0; i < index.header->num_files; ++i)
+    {
+      const char* name = index_file_name(&index, i);
+
+      if (bsearch(&name, new_names, num_new_names, sizeof(char*), compare_names))
+      {
+        file_map[i] = UINT32_MAX;
+      }
+      else
+      {
+        file_map[i] = builder_add_file(&builder, name);
+      }
+    }
+
+    for (uint64_t i = 0; i < index.header->num_segments; ++i)
+    {
+      const Segment* old_segment = &index.segments[i];
+
+      if (file_map[old_segment->file] == UINT32_MAX) continue;
+
+      Segment* segment = builder_add_segment(&builder);
+      *segment = *old_segment;
+      segment->file = file_map[old_segment->file];
+    }
+
+    free(file_map);
+    close_index(&index);
+  }
+
+  buffer = malloc(block_size * sizeof(WavI16));
+
+  size_t num_failed = 0;
+  for (size_t i = 0; i < num_new_names; ++i)
+  {
+    if (i > 0 && strcmp(new_names[i], new_names[i - 1]) == 0) continue;
+
+    int num_segments = index_file(&builder, new_names[i], channel, fps, buffer, block_size);
+
+    if (num_segments < 0)
+    {
+      num_failed++;
+    }
+    else if (verbosity >= 1)
+    {
+      printf("INDEXED %s (%d ranges)\n", new_names[i], num_segments);
+    }
+  }
+
+  if (write_index(&builder, index_filename) != 0)
+  {
+    return_fail;
+  }
+
+  printf("Index has %zu files and %zu ranges", builder.num_files, builder.num_segments);
+  if (num_failed > 0) printf("; %zu files could not be indexed", num_failed);
+  printf("\n");
+
+exit:
+  close_index(&index);
+  free_builder(&builder);
+  for (size_t i = 0; i < num_new_names; ++i)
+  {
+    free(new_names[i]);
+  }
+  free(new_names);
+  free(buffer);
+
+  return rv;
+}
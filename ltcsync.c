@@ -0,0 +1,420 @@
+/*
+ * Sync a recording to its LTC in a single pass.
+ *
+ * This does the work of running ltcdump to find the offset, pad_wav to pad
+ * the start of the audio to a frame boundary and riff_merge to put back the
+ * meta data chunks that pad_wav drops. Only the first few frames of LTC are
+ * decoded, and then the input is streamed to the output once.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "wav.h"
+#include "ltc.h"
+
+static const char false = 0;
+static const char true = 1;
+
+#define return_fail {rv = EXIT_FAILURE; goto exit;}
+
+static const uint32_t BEXT = (uint32_t)'txeb';
+static const uint32_t DATA = (uint32_t)'atad';
+static const uint32_t RIFF = (uint32_t)'FFIR';
+static const uint32_t WAVE = (uint32_t)'EVAW';
+
+// Offset of the 64 bit TimeReference field in the body of a bext chunk.
+static const size_t BEXT_TIME_REFERENCE_OFFSET = 338;
+
+static int verbosity = 0;
+
+static void decoder_log(void* context, int level, int status_code,
+                        const char* fmt, va_list args)
+{
+  (void)context;
+
+  if (status_code != 0)
+  {
+    fprintf(stderr, "%d: ", status_code);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+  }
+  else if (verbosity >= level)
+  {
+    printf(" *** ");
+    vprintf(fmt, args);
+    printf("\n");
+  }
+}
+
+/*
+ * Ask whether to overwrite. Returns true if the user said yes.
+ */
+static bool confirm_overwrite(const char* what)
+{
+  char* line = NULL;
+  size_t len = 0;
+  ssize_t num_bytes;
+  bool overwrite;
+
+  printf("%s already exists. Overwirte ?  [y/N] ", what);
+
+  num_bytes = getline(&line, &len, stdin);
+  if (num_bytes == -1)
+  {
+    fprintf(stderr, "Failed to read line of input from user.\n");
+    overwrite = false;
+  }
+  else
+  {
+    overwrite = line[0] == 'y' || line[0] == 'Y';
+  }
+
+  free(line);
+  return overwrite;
+}
+
+/*
+ * Copy 'in_fptr' to 'out_fptr' chunk by chunk, inserting 'pad_bytes' of
+ * silence at the start of the data chunk. The bext TimeReference is moved
+ * back by 'pad_samples' so that it still refers to the first sample.
+ */
+static int write_padded(FILE* in_fptr, FILE* out_fptr,
+                        size_t pad_samples, size_t pad_bytes)
+{
+  uint32_t header[3];
+  uint8_t zero_block[4096] = {0};
+
+  if (fread(header, 4, 3, in_fptr) != 3 || header[0] != RIFF || header[2] != WAVE)
+  {
+    fprintf(stderr, "Not a RIFF WAVE file (%d)\n", __LINE__);
+    return -1;
+  }
+
+  // RIFF size is patched at the end.
+  if (fwrite(header, 4, 3, out_fptr) != 3)
+  {
+    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    return -1;
+  }
+
+  while (true)
+  {
+    uint32_t chunk_header[2];
+
+    if (fread(chunk_header, 4, 2, in_fptr) != 2)
+    {
+      break; // EOF
+    }
+
+    uint32_t chunk_size = chunk_header[1];
+    uint32_t padded_size = chunk_size + (chunk_size & 1);
+
+    if (verbosity >= 1)
+    {
+      printf(" *** Chunk %.4s, size=%d\n", (char*)&chunk_header[0], chunk_size);
+    }
+
+    if (chunk_header[0] == DATA)
+    {
+      if ((uint64_t)chunk_size + pad_bytes > UINT32_MAX)
+      {
+        fprintf(stderr, "Padded data chunk would be larger than 4 GB\n");
+        return -1;
+      }
+
+      chunk_header[1] += pad_bytes;
+      if (fwrite(chunk_header, 4, 2, out_fptr) != 2)
+      {
+        fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+        return -1;
+      }
+
+      for (size_t remaining = pad_bytes; remaining > 0; )
+      {
+        size_t len = remaining < sizeof(zero_block) ? remaining : sizeof(zero_block);
+        if (fwrite(zero_block, len, 1, out_fptr) != 1)
+        {
+          fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+          return -1;
+        }
+        remaining -= len;
+      }
+
+      if (wav_copy_bytes(in_fptr, out_fptr, chunk_size) != 0)
+      {
+        fprintf(stderr, "%s (%d)\n", wav_err()->message, __LINE__);
+        wav_err_clear();
+        return -1;
+      }
+
+      // The pad byte now depends on the new size.
+      if (chunk_size & 1) fseek(in_fptr, 1, SEEK_CUR);
+      if ((chunk_header[1] & 1) && fputc(0, out_fptr) == EOF)
+      {
+        fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+        return -1;
+      }
+    }
+    else if (chunk_header[0] == BEXT && chunk_size >= BEXT_TIME_REFERENCE_OFFSET + 8)
+    {
+      uint8_t* body = malloc(padded_size);
+      uint64_t time_reference;
+
+      if (!body || fread(body, padded_size, 1, in_fptr) != 1)
+      {
+        fprintf(stderr, "EOF on input (%d)\n", __LINE__);
+        free(body);
+        return -1;
+      }
+
+      memcpy(&time_reference, body + BEXT_TIME_REFERENCE_OFFSET, 8);
+      time_reference = time_reference >= pad_samples ? time_reference - pad_samples : 0;
+      memcpy(body + BEXT_TIME_REFERENCE_OFFSET, &time_reference, 8);
+
+      if (fwrite(chunk_header, 4, 2, out_fptr) != 2
+          || fwrite(body, padded_size, 1, out_fptr) != 1)
+      {
+        fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+        free(body);
+        return -1;
+      }
+
+      free(body);
+    }
+    else
+    {
+      if (fwrite(chunk_header, 4, 2, out_fptr) != 2)
+      {
+        fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+        return -1;
+      }
+
+      if (wav_copy_bytes(in_fptr, out_fptr, padded_size) != 0)
+      {
+        fprintf(stderr, "%s (%d)\n", wav_err()->message, __LINE__);
+        wav_err_clear();
+        return -1;
+      }
+    }
+  }
+
+  // Patch the RIFF size.
+  off_t file_size = ftello(out_fptr);
+  uint32_t riff_size = file_size - 8;
+
+  if (file_size - 8 > UINT32_MAX
+      || fseek(out_fptr, 4, SEEK_SET) == -1
+      || fwrite(&riff_size, 4, 1, out_fptr) != 1)
+  {
+    fprintf(stderr, "Failed to set filesize (%d)\n", __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Create a new file next to 'filename' to write it in, so that 'filename' is
+ * only replaced once the output is complete. Its name, which the caller frees,
+ * is returned in '*tmp_filename_ptr'.
+ */
+static FILE* create_temp_file(const char* filename, char** tmp_filename_ptr)
+{
+  size_t len = strlen(filename) + 64;
+  char* tmp_filename = malloc(len);
+  int fd = -1;
+
+  if (!tmp_filename) return NULL;
+
+  for (unsigned long n = 0; fd == -1; ++n)
+  {
+    snprintf(tmp_filename, len, "%s.%d.%lu.tmp", filename, (int)getpid(), n);
+    fd = open(tmp_filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+    if (fd == -1 && errno != EEXIST)
+    {
+      free(tmp_filename);
+      return NULL;
+    }
+  }
+
+  FILE* fptr = fdopen(fd, "w");
+  if (!fptr)
+  {
+    close(fd);
+    unlink(tmp_filename);
+    free(tmp_filename);
+    return NULL;
+  }
+
+  *tmp_filename_ptr = tmp_filename;
+  return fptr;
+}
+
+static void usage (int status)
+{
+  printf ("ltcsync - Pad a recording to the start of its first LTC frame, keeping meta data.\n\n");
+  printf ("Usage: ltcsync [ OPTIONS ] <input filename> <output filename>\n\n");
+  printf ("Options:\n\
+  -c, --channel <num>     channel containing LTC (default 0)\n\
+  -f, --fps <num>         override detected framerate\n\
+  -n, --dry-run           only report the padding; don't write the output\n\
+  -v, --verbose           set debug info display\n\
+  -h, --help              display this help and exit\n\
+\n");
+
+  exit (status);
+}
+
+static struct option const long_options[] =
+{
+  {"help", no_argument, 0, 'h'},
+  {"channel", required_argument, 0, 'c'},
+  {"fps", required_argument, 0, 'f'},
+  {"dry-run", no_argument, 0, 'n'},
+  {"verbose", no_argument, 0, 'v'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+  int rv = EXIT_SUCCESS;
+  int fps = 0;
+  unsigned channel = 0;
+  bool dry_run = false;
+  int c;
+  LtcDecoder decoder = {0};
+  SMPTETimecode start;
+  size_t frame_size = 0;
+  FILE* in_fptr = NULL;
+  FILE* out_fptr = NULL;
+  char* tmp_filename = NULL;
+
+  while ((c = getopt_long (argc, argv,
+         "c:" /* channel */
+         "f:" /* fps */
+         "n"  /* dry run */
+         "v"  /* verbose */
+         "h", /* help */
+         long_options, (int *) 0)) != EOF)
+  {
+    switch (c) {
+      case 'c':
+        channel = atoi(optarg);
+        break;
+
+      case 'f':
+        fps = atoi(optarg);
+        break;
+
+      case 'n':
+        dry_run = true;
+        break;
+
+      case 'v':
+        verbosity++;
+        break;
+
+      case 'h':
+        usage (0);
+
+      default:
+        usage (EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind != (dry_run ? 1 : 2))
+  {
+    usage(EXIT_FAILURE);
+  }
+
+  const char* input_filename = argv[optind];
+  const char* output_filename = dry_run ? NULL : argv[optind + 1];
+
+  // Check that output file doesn't exist
+  if (output_filename && access(output_filename, F_OK) != -1)
+  {
+    size_t len = strlen(output_filename) + 8;
+    char* what = malloc(len);
+    snprintf(what, len, "File '%s'", output_filename);
+
+    bool overwrite = confirm_overwrite(what);
+    free(what);
+    if (!overwrite) return EXIT_SUCCESS;
+  }
+
+  /*
+   * Find out how much to pad.
+   */
+  if (ltc_decoder_find_first_frame(&decoder, input_filename, channel, fps,
+                                   decoder_log, NULL, &frame_size) != 0)
+  {
+    ltc_decoder_free(&decoder);
+    return EXIT_FAILURE;
+  }
+
+  size_t pad_samples = ltc_decoder_pad_to_frame(&decoder, &start);
+
+  printf("FPS: %d\n", decoder.fps);
+  printf("Discarded bits at start: %zu\n", decoder.discarded_bits_at_start);
+  printf("First frame: %s at sample %llu\n", timecode_to_str(&decoder.first_timecode),
+         (unsigned long long)decoder.first_sample);
+  printf("Padding: %zu samples\n", pad_samples);
+  printf("Start: %s\n", timecode_to_str(&start));
+
+  if (dry_run)
+  {
+    ltc_decoder_free(&decoder);
+    return EXIT_SUCCESS;
+  }
+
+  /*
+   * Stream the input to the output with the padding inserted.
+   */
+  in_fptr = fopen(input_filename, "r");
+  if (!in_fptr)
+  {
+    fprintf(stderr, "Failed to open '%s'\n", input_filename);
+    return_fail;
+  }
+
+  out_fptr = create_temp_file(output_filename, &tmp_filename);
+  if (!out_fptr)
+  {
+    fprintf(stderr, "Failed to create '%s'\n", output_filename);
+    return_fail;
+  }
+
+  if (write_padded(in_fptr, out_fptr, pad_samples, pad_samples * frame_size) != 0)
+  {
+    return_fail;
+  }
+
+exit:
+  ltc_decoder_free(&decoder);
+  if (in_fptr) fclose(in_fptr);
+  if (out_fptr && fclose(out_fptr) != 0)
+  {
+    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    rv = EXIT_FAILURE;
+  }
+
+  if (tmp_filename)
+  {
+    if (rv == EXIT_SUCCESS && rename(tmp_filename, output_filename) != 0)
+    {
+      fprintf(stderr, "Failed to create '%s': %s (%d)\n", output_filename, strerror(errno), __LINE__);
+      rv = EXIT_FAILURE;
+    }
+
+    if (rv != EXIT_SUCCESS) unlink(tmp_filename);
+    free(tmp_filename);
+  }
+
+  return rv;
+}
@@ -9,38 +9,65 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
 #include "wav.h"
+#include "ltc.h"
 
 typedef enum {
   UNITS_MICROSECONDS,
   UNITS_SAMPLES
 } Units;
 
-typedef char bool;
-//static const char false = 0;
+static const char false = 0;
 static const char true = 1;
 
+/*
+ * Block of silence that padding is written from. It's never written to, so
+ * it's shared by all the threads in multitrack mode.
+ */
+#define ZERO_BLOCK_SIZE (256 * 1024)
+static uint8_t* zero_block = NULL;
+
+/*
+ * Pad (n > 0) or trim (n < 0) the start of a wav file.
+ *
+ * The padding is written from 'zero_block' and the audio is copied with
+ * wav_copy(), which lets the kernel do the copy. If 'sample_rate' is
+ * non-zero, the input must have that sample rate.
+ */
 int pad_start_of_wav_file(const char* input_filename,
                           const char* output_filename,
-                          size_t n,
-                          Units units)
+                          long long n,
+                          Units units,
+                          WavU32 sample_rate)
 {
   int rv = -1;
-  // Num of samples to write out in each block.
-  static const size_t block_size = 4096;
-  uint8_t* buffer = NULL;
-  size_t num_samples;
+  long long num_samples;
   WavFile* in_fptr = wav_open(input_filename, "r");
-  WavFile* out_fptr = wav_open(output_filename, "w");
+  WavFile* out_fptr = NULL;
+
+  if (!in_fptr)
+  {
+    fprintf(stderr, "Out of memory opening wav files\n");
+    goto exit;
+  }
+
+  if (wav_file_err(in_fptr)->code != WAV_OK)
+  {
+    fprintf(stderr, "Error opening wav file: %s\n", wav_file_err(in_fptr)->message);
+    goto exit;
+  }
 
   WavU16 n_channels = wav_get_num_channels(in_fptr);
   size_t sample_size = wav_get_sample_size(in_fptr);
 
-  wav_set_num_channels(out_fptr, n_channels);
-  wav_set_sample_size(out_fptr, sample_size);
-  wav_set_format(out_fptr, wav_get_format(in_fptr));
-  wav_set_sample_rate(out_fptr, wav_get_sample_rate(in_fptr));
-  wav_set_valid_bits_per_sample(out_fptr, wav_get_valid_bits_per_sample(in_fptr));
+  if (sample_rate != 0 && wav_get_sample_rate(in_fptr) != sample_rate)
+  {
+    fprintf(stderr, "Sample rate of '%s' is %u, not %u\n", 
+            input_filename, wav_get_sample_rate(in_fptr), sample_rate);
+    goto exit;
+  }
 
   // Convert microseconds to num samples.
   if (units == UNITS_SAMPLES)
@@ -49,85 +76,260 @@ int pad_start_of_wav_file(const char* input_filename,
   }
   else
   {
-    num_samples = wav_get_sample_rate(in_fptr) * n / 1000000;
+    num_samples = (long long)wav_get_sample_rate(in_fptr) * n / 1000000;
+  }
+
+  if (num_samples < 0)
+  {
+    /*
+     * Trim by skipping samples at the start of the input.
+     */
+    if ((size_t)-num_samples >= wav_get_length(in_fptr))
+    {
+      fprintf(stderr, "Can't trim %lld samples from a file of %zu samples\n", 
+              -num_samples, wav_get_length(in_fptr));
+      goto exit;
+    }
+
+    if (wav_seek(in_fptr, (long)-num_samples, SEEK_SET) != 0)
+    {
+      fprintf(stderr, "Error seeking in wav file: %s\n", wav_err()->message);
+      goto exit;
+    }
   }
 
-  buffer = malloc(sample_size * num_samples * n_channels);
-  memset(buffer, 0, sample_size * num_samples * n_channels);
-  size_t samples_written = wav_write(out_fptr, buffer, num_samples);
+  // Only once the input is known to be good, so a bad one leaves the output be.
+  out_fptr = wav_open(output_filename, "w");
 
-  if (samples_written != num_samples && wav_err()->code != WAV_OK)
+  if (!out_fptr)
   {
-    fprintf(stderr, "Error writing wav file: %s", wav_err()->message);
-    goto exit;    
+    fprintf(stderr, "Out of memory opening wav files\n");
+    goto exit;
   }
- 
-  free(buffer);
 
-  /*
-  ssize_t num_blocks_to_skip = num_samples / block_size;
-  ssize_t num_samples_to_skip = num_samples % block_size;
-  */
+  if (wav_file_err(out_fptr)->code != WAV_OK)
+  {
+    fprintf(stderr, "Error opening wav file: %s\n", wav_file_err(out_fptr)->message);
+    goto exit;
+  }
+
+  wav_set_num_channels(out_fptr, n_channels);
+  wav_set_sample_size(out_fptr, sample_size);
+  wav_set_format(out_fptr, wav_get_format(in_fptr));
+  wav_set_sample_rate(out_fptr, wav_get_sample_rate(in_fptr));
+  wav_set_valid_bits_per_sample(out_fptr, wav_get_valid_bits_per_sample(in_fptr));
 
-  buffer = malloc(sample_size * n_channels * block_size);
+  // Only write the header sizes once, at the end.
+  if (wav_set_write_buffer(out_fptr, 0, 0) != 0)
+  {
+    fprintf(stderr, "Error writing wav file: %s\n", wav_err()->message);
+    goto exit;
+  }
 
-  while (true)
+  if (num_samples > 0)
   {
-    size_t samples_read = wav_read(in_fptr, buffer, block_size);
+    /*
+     * Pad with silence, one block at a time.
+     */
+    size_t block_size = ZERO_BLOCK_SIZE / (sample_size * n_channels);
 
-    if (samples_read != block_size)
+    for (size_t remaining = num_samples; remaining > 0; )
     {
-      if (wav_err()->code != WAV_OK)
+      size_t len = remaining < block_size ? remaining : block_size;
+      size_t samples_written = wav_write(out_fptr, zero_block, len);
+
+      if (samples_written != len)
       {
-        fprintf(stderr, "Error reading wav file: %s", wav_err()->message);
-        goto exit;
+        fprintf(stderr, "Error writing wav file: %s\n", wav_err()->message);
+        goto exit;    
       }
-    }
-
-    /* if (num_blocks_to_skip-- > 0) continue;
 
-    size_t shortened_block_size = block_size - num_samples_to_skip;
-    size_t samples_written = wav_write(out_fptr, 
-                                       buffer + num_samples_to_skip, 
-                                       samples_read - num_samples_to_skip);
-    num_samples_to_skip = 0;
-
-    if (samples_written != samples_read - shortened_block_size  && wav_err()->code != WAV_OK)
-    {
-      fprintf(stderr, "Error writing wav file: %s", wav_err()->message);
-      goto exit;
+      remaining -= len;
     }
-    */
+  }
 
-    samples_written = wav_write(out_fptr, buffer, samples_read);
+  /*
+   * Copy the audio.
+   */
+  size_t samples_to_copy = wav_get_length(in_fptr) - wav_tell(in_fptr);
+  size_t samples_copied = wav_copy(out_fptr, in_fptr, samples_to_copy);
 
-    if (samples_written != samples_read && wav_err()->code != WAV_OK)
-    {
-      fprintf(stderr, "Error writing wav file: %s", wav_err()->message);
-      goto exit;
-    }
+  if (samples_copied != samples_to_copy)
+  {
+    fprintf(stderr, "Error copying wav file: %s\n", wav_err()->message);
+    goto exit;
+  }
 
-    if (samples_read != block_size) break;
+  if (wav_flush(out_fptr) != 0)
+  {
+    fprintf(stderr, "Error writing wav file: %s\n", wav_err()->message);
+    goto exit;
   }
 
   rv = 0;
 
 exit:
-  free(buffer);
-  wav_close(in_fptr);
-  wav_close(out_fptr);
+  if (in_fptr) wav_close(in_fptr);
+  if (out_fptr) wav_close(out_fptr);
 
   return rv;
 }
 
 
+/*
+ * Multitrack mode
+ *
+ * The offset is found once from the LTC in a reference file and all the
+ * tracks are padded by it at the same time, one thread per output.
+ */
+typedef struct
+{
+  const char* input_filename;
+  char* output_filename;
+  long long num_samples;
+  WavU32 sample_rate;
+  pthread_t thread;
+  bool started;
+  int rv;
+} PadJob;
+
+static void* pad_worker(void* arg)
+{
+  PadJob* job = arg;
+
+  job->rv = pad_start_of_wav_file(job->input_filename, job->output_filename,
+                                  job->num_samples, UNITS_SAMPLES, job->sample_rate);
+
+  printf("%s %s\n", job->rv == 0 ? "PADDED" : "FAILED", job->output_filename);
+
+  return NULL;
+}
+
+static void decoder_log(void* context, int level, int status_code,
+                        const char* fmt, va_list args)
+{
+  (void)context;
+  (void)level;
+
+  if (status_code != 0)
+  {
+    fprintf(stderr, "%d: ", status_code);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+  }
+}
+
+/*
+ * Ask whether to overwrite. Returns true if the user said yes.
+ */
+static bool confirm_overwrite(const char* what)
+{
+  char* line = NULL;
+  size_t len = 0;
+  ssize_t num_bytes;
+  bool overwrite;
+
+  printf("%s already exists. Overwirte ?  [y/N] ", what);
+
+  num_bytes = getline(&line, &len, stdin);
+  if (num_bytes == -1)
+  {
+    fprintf(stderr, "Failed to read line of input from user.\n");
+    overwrite = false;
+  }
+  else
+  {
+    overwrite = line[0] == 'y' || line[0] == 'Y';
+  }
+
+  free(line);
+  return overwrite;
+}
+
+static int pad_tracks(const char* reference_filename, unsigned channel, int fps,
+                      const char* output_dir, char** track_filenames, int num_tracks)
+{
+  int rv = EXIT_SUCCESS;
+  LtcDecoder decoder;
+  size_t num_existing = 0;
+  PadJob* jobs = calloc(num_tracks, sizeof(PadJob));
+
+  /*
+   * Work out the padding from the reference.
+   */
+  if (ltc_decoder_find_first_frame(&decoder, reference_filename, channel, fps,
+                                   decoder_log, NULL, NULL) != 0)
+  {
+    ltc_decoder_free(&decoder);
+    free(jobs);
+    return EXIT_FAILURE;
+  }
+
+  SMPTETimecode start;
+  size_t num_samples = ltc_decoder_pad_to_frame(&decoder, &start);
+
+  printf("Padding: %zu samples\n", num_samples);
+  printf("Start: %s\n", timecode_to_str(&start));
+
+  for (int i = 0; i < num_tracks; ++i)
+  {
+    // basename() may modify its argument.
+    char* track_filename = strdup(track_filenames[i]);
+
+    jobs[i].input_filename = track_filenames[i];
+    jobs[i].num_samples = num_samples;
+    jobs[i].sample_rate = decoder.sample_rate;
+    size_t len = strlen(output_dir) + strlen(basename(track_filename)) + 2;
+    jobs[i].output_filename = malloc(len);
+    snprintf(jobs[i].output_filename, len, "%s/%s", output_dir, basename(track_filename));
+    free(track_filename);
+
+    if (access(jobs[i].output_filename, F_OK) != -1) num_existing++;
+  }
+
+  ltc_decoder_free(&decoder);
+
+  // Ask once, up front, rather than from the worker threads.
+  if (num_existing > 0)
+  {
+    char what[64];
+    snprintf(what, sizeof(what), "%zu output file(s)", num_existing);
+
+    if (!confirm_overwrite(what)) goto exit;
+  }
+
+  for (int i = 0; i < num_tracks; ++i)
+  {
+    jobs[i].started = pthread_create(&jobs[i].thread, NULL, pad_worker, &jobs[i]) == 0;
+
+    // Can't start a thread; do it here instead.
+    if (!jobs[i].started) pad_worker(&jobs[i]);
+  }
+
+  for (int i = 0; i < num_tracks; ++i)
+  {
+    if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+    if (jobs[i].rv != 0) rv = EXIT_FAILURE;
+  }
+
+exit:
+  for (int i = 0; i < num_tracks; ++i) free(jobs[i].output_filename);
+  free(jobs);
+  return rv;
+}
+
 static void usage (int status)
 {
   printf ("pad_wav - Pad beginning of wav file with silence.\n\n");
-  printf ("Usage: pad_wav [ -n xxx | -m xxx] <input filename> <output filename>\n\n");
+  printf ("Usage: pad_wav [ -n xxx | -m xxx] <input filename> <output filename>\n");
+  printf ("       pad_wav -r <reference filename> -o <output dir> <track filename>...\n\n");
   printf ("Options:\n\
-  -n, --num_samples <num>   number of samples to pad\n\
-  -m, --microseconds <num>  number of microseconds to pad\n\
+  -n, --num_samples <num>   number of samples to pad; negative to trim\n\
+  -m, --microseconds <num>  number of microseconds to pad; negative to trim\n\
+  -r, --reference <file>    pad to the first LTC frame in <file>\n\
+  -c, --channel <num>       channel of the reference containing LTC (default 0)\n\
+  -f, --fps <num>           override detected framerate of the reference\n\
+  -o, --output-dir <dir>    directory to write padded tracks to\n\
   -h, --help                display this help and exit\n\
   \n");
 
@@ -139,35 +341,67 @@ static struct option const long_options[] =
   {"help", no_argument, 0, 'h'},
   {"num_samples", required_argument, 0, 'n'},
   {"microseconds", required_argument, 0, 'm'},
+  {"reference", required_argument, 0, 'r'},
+  {"channel", required_argument, 0, 'c'},
+  {"fps", required_argument, 0, 'f'},
+  {"output-dir", required_argument, 0, 'o'},
   {NULL, 0, NULL, 0}
 };
 
 
 int main(int argc, char **argv)
 {
-  int num_samples = -1;
-  int microseconds = -1;
+  long long num_samples = 0;
+  long long microseconds = 0;
+  bool have_num_samples = false;
+  bool have_microseconds = false;
+  const char* reference_filename = NULL;
+  const char* output_dir = NULL;
+  unsigned channel = 0;
+  int fps = 0;
   int c;
 
   while ((c = getopt_long (argc, argv,
          "n:"  /* Number of samples to pad */
          "m:"  /* Number of samples to pad */
+         "r:"  /* LTC reference */
+         "c:"  /* LTC channel */
+         "f:"  /* fps */
+         "o:"  /* output directory */
          "h" , /* help */
          long_options, (int *) 0)) != EOF)
   {
     switch (c) {
       case 'n':
         {
-        num_samples = atoi(optarg);
+        num_samples = atoll(optarg);
+        have_num_samples = true;
         }
         break;
 
       case 'm':
         {
-        microseconds = atoi(optarg);
+        microseconds = atoll(optarg);
+        have_microseconds = true;
         }
         break;
 
+      case 'r':
+        reference_filename = optarg;
+        break;
+
+      case 'c':
+        channel = atoi(optarg);
+        break;
+
+      case 'f':
+        fps = atoi(optarg);
+        break;
+
+      case 'o':
+        output_dir = optarg;
+        break;
+
       case 'h':
         usage (0);
 
@@ -180,6 +414,24 @@ int main(int argc, char **argv)
     usage (EXIT_FAILURE);
   }
 
+  zero_block = calloc(1, ZERO_BLOCK_SIZE);
+
+  if (!zero_block)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  if (reference_filename)
+  {
+    if (!output_dir || have_num_samples || have_microseconds)
+    {
+      usage(EXIT_FAILURE);
+    }
+
+    return pad_tracks(reference_filename, channel, fps, output_dir,
+                      &argv[optind], argc - optind);
+  }
 
   if (argc - optind != 2)
   {
@@ -189,7 +441,7 @@ int main(int argc, char **argv)
   const char* input_filename = argv[optind];
   const char* output_filename = argv[optind + 1];
 
-  if (num_samples == -1 && microseconds == -1)
+  if (!have_num_samples && !have_microseconds)
   {
     fprintf(stderr, "Please use -n or -m to specify how much to pad.\n");
     return EXIT_FAILURE;
@@ -198,28 +450,19 @@ int main(int argc, char **argv)
   // Check that output file doesn't exist
   if (access(output_filename, F_OK) != -1)
   {
-    char* line = NULL;
-    size_t len = 0;
-    ssize_t num_bytes;
-
-    printf("File '%s' already exists. Overwirte ?  [y/N] ", output_filename);
+    size_t len = strlen(output_filename) + 8;
+    char* what = malloc(len);
+    snprintf(what, len, "File '%s'", output_filename);
 
-    num_bytes = getline(&line, &len, stdin);
-    if (num_bytes == -1)
-    {
-      fprintf(stderr, "Failed to read line of input from user.\n");
-      return EXIT_FAILURE;
-    }
-    else if (num_bytes != 2 && (line[0] != 'y' || line[0] != 'Y'))
-    {
-      return EXIT_SUCCESS;
-    }
-    free(line);
+    bool overwrite = confirm_overwrite(what);
+    free(what);
+    if (!overwrite) return EXIT_SUCCESS;
   }
 
   return pad_start_of_wav_file(input_filename, 
 	                output_filename, 
-			num_samples == -1 ? microseconds : num_samples,
-			num_samples == -1 ? UNITS_MICROSECONDS : UNITS_SAMPLES
+			have_num_samples ? num_samples : microseconds,
+			have_num_samples ? UNITS_SAMPLES : UNITS_MICROSECONDS,
+			0
 			)  == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,29 @@
+/*
+ * Static tracepoints (USDT) in the decoder and tools.
+ *
+ * Built with `make USDT=1`, each PROBE is a single nop in the code and a note
+ * in the binary that bpftrace, perf or SystemTap can attach to at run time,
+ * for example:
+ *
+ *   bpftrace -e 'usdt:./ltcdump:ltc:frame { @[arg4 - @last] = count(); @last = arg4; }'
+ *
+ * Otherwise, they compile to nothing and their arguments aren't evaluated.
+ */
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+
+#define PROBE1(provider, name, a)                 DTRACE_PROBE1(provider, name, a)
+#define PROBE2(provider, name, a, b)              DTRACE_PROBE2(provider, name, a, b)
+#define PROBE3(provider, name, a, b, c)           DTRACE_PROBE3(provider, name, a, b, c)
+#define PROBE5(provider, name, a, b, c, d, e)     DTRACE_PROBE5(provider, name, a, b, c, d, e)
+#else
+#define PROBE1(provider, name, a)                 do {} while (0)
+#define PROBE2(provider, name, a, b)              do {} while (0)
+#define PROBE3(provider, name, a, b, c)           do {} while (0)
+#define PROBE5(provider, name, a, b, c, d, e)     do {} while (0)
+#endif
+
+#endif /* __PROBES_H__ */
@@ -4,6 +4,12 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "wav.h"
 
 typedef char bool;
@@ -16,48 +22,59 @@ static const char true = 1;
 static const uint32_t BEXT = (uint32_t)'txeb';
 static const uint32_t IXML = (uint32_t)'LMXi';
 static const uint32_t PAD = (uint32_t)' DAP';
+static const uint32_t JUNK = (uint32_t)'KNUJ';
 static const uint32_t FMT = (uint32_t)' tmf';
 static const uint32_t DATA = (uint32_t)'atad';
 static const uint32_t RIFF = (uint32_t)'FFIR';
 static const uint32_t WAVE = (uint32_t)'EVAW';
 
+#define countof(x)  (sizeof(x) / sizeof(x[0]))
 
-static int transfer(FILE* in_ptr, FILE* out_ptr, size_t bytes) 
-{
-  uint8_t buffer[4096];
-  size_t n;
+static int verbosity = 1;
 
-  while (bytes > sizeof(buffer))
-  {
-    n = fread(buffer, sizeof(buffer), 1, in_ptr); 
-    if (n < 1)
-    {
-      fprintf(stderr, "EOF on input (%d)\n", __LINE__);
-      return -1;
-    }
+/*
+ * Limits the number of chunk copies in flight in batch mode, so that many
+ * workers don't turn a sequential disk into a seeking one.
+ */
+static sem_t io_slots;
+static bool limit_io = false;
 
-    n = fwrite(buffer, sizeof(buffer), 1, out_ptr);
-    if (n < 1)
-    {
-      fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
-      return -1;
-    }
+static int log_info(int level, const char* fmt, ...)
+{
+  int n = 0;
+  va_list args;
+  va_start(args, fmt);
 
-    bytes -= sizeof(buffer);
-  }
-  
- 
-  n = fread(buffer, bytes, 1, in_ptr); 
-  if (n < 1)
+  if (verbosity >= level)
   {
-    fprintf(stderr, "EOF on input (%d)\n", __LINE__);
-    return -1;
+    n = vprintf(fmt, args);
   }
 
-  n = fwrite(buffer, bytes, 1, out_ptr);
-  if (n < 1)
+  va_end(args);
+  return n;
+}
+
+
+/*
+ * Copy 'bytes' bytes from the current position of 'in_ptr' to the current
+ * position of 'out_ptr', leaving both streams positioned after the copied data.
+ *
+ * The copy is done by the kernel where possible; see wav_copy_bytes().
+ */
+static int transfer(FILE* in_ptr, FILE* out_ptr, size_t bytes) 
+{
+  int rv;
+
+  if (limit_io) sem_wait(&io_slots);
+
+  rv = wav_copy_bytes(in_ptr, out_ptr, bytes);
+
+  if (limit_io) sem_post(&io_slots);
+
+  if (rv != 0)
   {
-    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    fprintf(stderr, "%s (%d)\n", wav_err()->message, __LINE__);
+    wav_err_clear();
     return -1;
   }
 
@@ -100,7 +117,7 @@ static int filter_riff(uint32_t* chunk_ids, FILE* in_fptr, FILE *out_fptr)
     return EXIT_FAILURE;
   }
 
-  printf("File size: %d\n", data);
+  log_info(2, "File size: %d\n", data);
 
 
   /*
@@ -113,7 +130,7 @@ static int filter_riff(uint32_t* chunk_ids, FILE* in_fptr, FILE *out_fptr)
     return EXIT_FAILURE;
   }
 
-  printf("File type %.4s, size=%d\n", (char*)&file_type, file_size);
+  log_info(1, "File type %.4s, size=%d\n", (char*)&file_type, file_size);
 
   /*
    * Loop reading chunks
@@ -136,7 +153,7 @@ static int filter_riff(uint32_t* chunk_ids, FILE* in_fptr, FILE *out_fptr)
       return -1;
     }
   
-    printf("Chunk %.4s, size=%d: ", (char*)&chunk_id, chunk_size);
+    log_info(1, "Chunk %.4s, size=%d: ", (char*)&chunk_id, chunk_size);
 
     // A matching chunk?
     bool match = false;
@@ -151,7 +168,7 @@ static int filter_riff(uint32_t* chunk_ids, FILE* in_fptr, FILE *out_fptr)
 
     if (match)
     {
-      printf("COPYING\n");
+      log_info(1, "COPYING\n");
       // Seek back so that we copy the chunk header
       if (fseek(in_fptr, -8, SEEK_CUR) == -1)
       {
@@ -167,7 +184,7 @@ static int filter_riff(uint32_t* chunk_ids, FILE* in_fptr, FILE *out_fptr)
     }
     else
     {
-      printf("SKIPPING\n");
+      log_info(1, "SKIPPING\n");
       fseek(in_fptr, chunk_size, SEEK_CUR);
     }
   }
@@ -177,57 +194,348 @@ static int filter_riff(uint32_t* chunk_ids, FILE* in_fptr, FILE *out_fptr)
 }
 
 
-static void usage (int status) 
+/*
+ * A chunk held in memory while the header region is rebuilt.
+ */
+typedef struct
 {
-  printf ("riff_merge - Merge meta data chunks from one file with data chunks from another\n\n");
-  printf ("Usage: riff_merge <metadata filename> <data filename> <output filename>\n\n");
+  uint32_t id;
+  uint32_t size;
+  uint8_t* body;
+} Chunk;
 
-  exit (status);
+#define MAX_HEADER_CHUNKS 64
+
+/*
+ * Read chunks of 'fptr' into 'chunks'. If 'keep_matching' is set, only chunks
+ * whose ID is in 'chunk_ids' are kept, otherwise only those that aren't. The
+ * 'data' chunk itself is never kept.
+ *
+ * If 'stop_at_data' is set, reading stops at the 'data' chunk, otherwise the
+ * whole file is scanned.
+ *
+ * Returns the number of chunks read, or -1 on error. On success
+ * '*data_offset_ptr' is the file offset of the 'data' chunk header.
+ */
+static int read_chunks(FILE* fptr, uint32_t* chunk_ids, bool keep_matching,
+                       bool stop_at_data, Chunk* chunks, off_t* data_offset_ptr)
+{
+  bool seen_data = false;
+
+  uint32_t header[3];
+  int n_chunks = 0;
+
+  if (fseek(fptr, 0, SEEK_SET) == -1 || fread(header, 4, 3, fptr) != 3)
+  {
+    fprintf(stderr, "EOF on input (%d)\n", __LINE__);
+    return -1;
+  }
+
+  if (header[0] != RIFF || header[2] != WAVE)
+  {
+    fprintf(stderr, "Not a RIFF WAVE file (%d)\n", __LINE__);
+    return -1;
+  }
+
+  while (true)
+  {
+    uint32_t chunk_header[2];
+    off_t offset = ftello(fptr);
+
+    if (fread(chunk_header, 4, 2, fptr) != 2)
+    {
+      if (!seen_data)
+      {
+        fprintf(stderr, "No data chunk found (%d)\n", __LINE__);
+        return -1;
+      }
+      return n_chunks; // EOF
+    }
+
+    bool match = false;
+    for (uint32_t* chunk_id = chunk_ids; *chunk_id; ++chunk_id)
+    {
+      if (*chunk_id == chunk_header[0])
+      {
+        match = true;
+        break;
+      }
+    }
+
+    bool skip = match != keep_matching;
+
+    if (chunk_header[0] == DATA)
+    {
+      *data_offset_ptr = offset;
+      seen_data = true;
+      if (stop_at_data) return n_chunks;
+      skip = true;
+    }
+
+    // Chunks are word aligned; odd sized chunks are followed by a pad byte.
+    uint32_t padded_size = chunk_header[1] + (chunk_header[1] & 1);
+
+    log_info(1, "Chunk %.4s, size=%d: %s\n", (char*)&chunk_header[0], chunk_header[1],
+              skip ? "SKIPPING" : "COPYING");
+
+    if (skip)
+    {
+      if (fseeko(fptr, padded_size, SEEK_CUR) == -1)
+      {
+        fprintf(stderr, "Seek failed on input (%d)\n", __LINE__);
+        return -1;
+      }
+      continue;
+    }
+
+    if (n_chunks == MAX_HEADER_CHUNKS)
+    {
+      fprintf(stderr, "Too many chunks before data chunk (%d)\n", __LINE__);
+      return -1;
+    }
+
+    Chunk* chunk = &chunks[n_chunks++];
+    chunk->id = chunk_header[0];
+    chunk->size = chunk_header[1];
+    chunk->body = calloc(padded_size ? padded_size : 1, 1);
+
+    if (!chunk->body)
+    {
+      fprintf(stderr, "Out of memory (%d)\n", __LINE__);
+      return -1;
+    }
+
+    if (padded_size && fread(chunk->body, padded_size, 1, fptr) != 1)
+    {
+      fprintf(stderr, "EOF on input (%d)\n", __LINE__);
+      return -1;
+    }
+  }
 }
 
-int main(int argc, char **argv)
+/*
+ * Copy the metadata chunks of 'metadata_filename' into 'data_filename',
+ * rewriting only the chunks in front of the 'data' chunk.
+ *
+ * The region between the RIFF header and the 'data' chunk is rebuilt from the
+ * existing non-slack chunks plus the new metadata chunks. Any JUNK/PAD
+ * chunks in that region are treated as free space and whatever is left over
+ * is filled with a single JUNK chunk, so the audio itself never moves.
+ */
+static int merge_in_place(const char* metadata_filename, const char* data_filename)
 {
-  uint32_t data;
-  size_t n;
-  size_t file_size = 0;
-  int m;
-  int rv = EXIT_SUCCESS;
+  int rv = EXIT_FAILURE;
   FILE* meta_in_fptr = NULL;
-  FILE* data_in_fptr = NULL;
-  FILE* out_fptr = NULL;
-  uint32_t metadata_chunk_ids[] = {BEXT, IXML, PAD, 0};
-  uint32_t data_chunk_ids[] = {FMT, DATA, 0};
+  FILE* data_fptr = NULL;
+  Chunk meta_chunks[MAX_HEADER_CHUNKS];
+  Chunk data_chunks[MAX_HEADER_CHUNKS];
+  int n_meta = 0, n_data = 0;
+  off_t meta_data_offset, data_offset;
+  uint8_t* region = NULL;
+  struct stat st;
+
+  // Take the metadata from the metadata file...
+  uint32_t meta_chunk_ids[] = {BEXT, IXML, 0};
+  // ...while the data file loses its slack and any stale metadata.
+  uint32_t data_skip_ids[] = {BEXT, IXML, PAD, JUNK, 0};
 
-  if (argc != 4) usage(EXIT_FAILURE);
+  meta_in_fptr = fopen(metadata_filename, "r");
+  if (!meta_in_fptr)
+  {
+    fprintf(stderr, "Failed to open '%s' (%d)\n", metadata_filename, __LINE__);
+    goto exit;
+  }
 
-  const char* metadata_filename = argv[1];
-  const char* data_filename = argv[2];
-  const char* out_filename = argv[3];
+  data_fptr = fopen(data_filename, "r+");
+  if (!data_fptr)
+  {
+    fprintf(stderr, "Failed to open '%s' (%d)\n", data_filename, __LINE__);
+    goto exit;
+  }
 
-  // Check that output file doesn't exist
-  if (access(out_filename, F_OK) != -1)
+  log_info(1, "Reading meta data from %s...\n", metadata_filename);
+  n_meta = read_chunks(meta_in_fptr, meta_chunk_ids, true, false, meta_chunks, &meta_data_offset);
+  if (n_meta == -1) goto exit;
+
+  log_info(1, "\nReading header of %s...\n", data_filename);
+  n_data = read_chunks(data_fptr, data_skip_ids, false, true, data_chunks, &data_offset);
+  if (n_data == -1) goto exit;
+
+  /*
+   * Lay out the new header region: the kept chunks of the data file, then
+   * the metadata chunks, then JUNK to fill the gap up to the data chunk.
+   */
+  size_t region_size = data_offset - 12;
+  size_t used = 0;
+
+  for (int i = 0; i < n_data; ++i) used += 8 + data_chunks[i].size + (data_chunks[i].size & 1);
+  for (int i = 0; i < n_meta; ++i) used += 8 + meta_chunks[i].size + (meta_chunks[i].size & 1);
+
+  log_info(1, "\nHeader region: %zu bytes, needed: %zu bytes\n", region_size, used);
+
+  if (used > region_size || (used < region_size && region_size - used < 8))
   {
-    char* line = NULL;
-    size_t len = 0;
-    ssize_t num_bytes;
+    fprintf(stderr, "Not enough room in front of the data chunk to merge in place; "
+                    "merge to a new file instead.\n");
+    goto exit;
+  }
 
-    printf("File '%s' already exists. Overwirte ?  [y/N] ", out_filename);
+  region = malloc(region_size);
+  if (!region)
+  {
+    fprintf(stderr, "Out of memory (%d)\n", __LINE__);
+    goto exit;
+  }
 
-    num_bytes = getline(&line, &len, stdin);
-    if (num_bytes == -1)
+  uint8_t* ptr = region;
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    Chunk* chunks = pass == 0 ? data_chunks : meta_chunks;
+    int n = pass == 0 ? n_data : n_meta;
+
+    for (int i = 0; i < n; ++i)
     {
-      return_fail;
+      uint32_t padded_size = chunks[i].size + (chunks[i].size & 1);
+
+      memcpy(ptr, &chunks[i].id, 4);
+      memcpy(ptr + 4, &chunks[i].size, 4);
+      memcpy(ptr + 8, chunks[i].body, padded_size);
+      ptr += 8 + padded_size;
     }
-    else if (num_bytes != 2 && (line[0] != 'y' || line[0] != 'Y'))
+  }
+
+  if (used < region_size)
+  {
+    uint32_t junk_size = region_size - used - 8;
+
+    memcpy(ptr, &JUNK, 4);
+    memcpy(ptr + 4, &junk_size, 4);
+    memset(ptr + 8, 0, junk_size);
+  }
+
+  /*
+   * Write the new header region and patch the RIFF size.
+   */
+  if (fseeko(data_fptr, 12, SEEK_SET) == -1 
+      || fwrite(region, region_size, 1, data_fptr) != 1)
+  {
+    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    goto exit;
+  }
+
+  if (fflush(data_fptr) != 0 || fstat(fileno(data_fptr), &st) == -1)
+  {
+    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    goto exit;
+  }
+
+  uint32_t riff_size = st.st_size - 8;
+  if (fseeko(data_fptr, 4, SEEK_SET) == -1 
+      || fwrite(&riff_size, 4, 1, data_fptr) != 1
+      || fflush(data_fptr) != 0)
+  {
+    fprintf(stderr, "Failed to set filesize (%d)\n", __LINE__);
+    goto exit;
+  }
+
+  log_info(1, "Merged %d chunk(s) into %s\n", n_meta, data_filename);
+  rv = EXIT_SUCCESS;
+
+exit:
+  for (int i = 0; i < n_meta; ++i) free(meta_chunks[i].body);
+  for (int i = 0; i < n_data; ++i) free(data_chunks[i].body);
+  free(region);
+  if (meta_in_fptr) fclose(meta_in_fptr);
+  if (data_fptr) fclose(data_fptr);
+  return rv;
+}
+
+/*
+ * Create a new file next to 'filename' to write it in, so that 'filename' is
+ * only replaced once the merge is complete. Its name, which the caller frees,
+ * is returned in '*tmp_filename_ptr'.
+ */
+static FILE* create_temp_file(const char* filename, char** tmp_filename_ptr)
+{
+  static unsigned long counter = 0;
+  size_t len = strlen(filename) + 64;
+  char* tmp_filename = malloc(len);
+  int fd = -1;
+
+  if (!tmp_filename) return NULL;
+
+  while (fd == -1)
+  {
+    unsigned long n = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+
+    snprintf(tmp_filename, len, "%s.%d.%lu.tmp", filename, (int)getpid(), n);
+    fd = open(tmp_filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+    if (fd == -1 && errno != EEXIST)
     {
-      return_success; 
+      free(tmp_filename);
+      return NULL;
     }
-    free(line);
   }
 
+  FILE* fptr = fdopen(fd, "w");
+  if (!fptr)
+  {
+    close(fd);
+    unlink(tmp_filename);
+    free(tmp_filename);
+    return NULL;
+  }
+
+  *tmp_filename_ptr = tmp_filename;
+  return fptr;
+}
+
+/*
+ * Merge the meta data chunks of 'metadata_filename' with the format and data
+ * chunks of 'data_filename' into a new file 'out_filename'.
+ *
+ * The output is written to a temporary file that's renamed to 'out_filename'
+ * once it's complete, so a failed merge never touches an existing output.
+ * Unless 'overwrite' is set, fails if the output file already exists.
+ */
+static int merge_files(const char* metadata_filename, 
+                       const char* data_filename,
+                       const char* out_filename,
+                       bool overwrite)
+{
+  uint32_t data;
+  size_t n;
+  size_t file_size = 0;
+  int m;
+  int rv = EXIT_SUCCESS;
+  FILE* meta_in_fptr = NULL;
+  FILE* data_in_fptr = NULL;
+  FILE* out_fptr = NULL;
+  char* tmp_filename = NULL;
+  uint32_t metadata_chunk_ids[] = {BEXT, IXML, PAD, 0};
+  uint32_t data_chunk_ids[] = {FMT, DATA, 0};
+
   meta_in_fptr = fopen(metadata_filename, "r");
+  if (!meta_in_fptr)
+  {
+    fprintf(stderr, "Failed to open '%s' (%d)\n", metadata_filename, __LINE__);
+    return_fail;
+  }
+
   data_in_fptr = fopen(data_filename, "r");
-  out_fptr = fopen(out_filename, "w");
+  if (!data_in_fptr)
+  {
+    fprintf(stderr, "Failed to open '%s' (%d)\n", data_filename, __LINE__);
+    return_fail;
+  }
+
+  out_fptr = create_temp_file(out_filename, &tmp_filename);
+  if (!out_fptr)
+  {
+    fprintf(stderr, "Failed to create '%s' (%d)\n", out_filename, __LINE__);
+    return_fail;
+  }
 
   // Write WAVE header
   data = RIFF;
@@ -256,17 +564,17 @@ int main(int argc, char **argv)
 
 
 
-  m = printf("Filtering meta data from %s...\n", "sss");
-  printf("%.*s\n", m-1, "===========================================================================================");
+  m = log_info(1, "Filtering meta data from %s...\n", metadata_filename);
+  log_info(1, "%.*s\n", m-1, "===========================================================================================");
 
   n = filter_riff(metadata_chunk_ids, meta_in_fptr, out_fptr);
   if (n == -1) return_fail;
   file_size += n;
 
-  printf("\n\n\n");
+  log_info(1, "\n\n\n");
 
-  m = printf("Filtering data from %s...\n", "sss");
-  printf("%.*s\n", m-1, "===========================================================================================");
+  m = log_info(1, "Filtering data from %s...\n", data_filename);
+  log_info(1, "%.*s\n", m-1, "===========================================================================================");
   n = filter_riff(data_chunk_ids, data_in_fptr, out_fptr);
   if (n == -1) return_fail;
   file_size += n;
@@ -285,9 +593,350 @@ int main(int argc, char **argv)
   }
 
 exit:
-  fclose(meta_in_fptr);
-  fclose(data_in_fptr);
-  fclose(out_fptr);
+  if (meta_in_fptr) fclose(meta_in_fptr);
+  if (data_in_fptr) fclose(data_in_fptr);
+  if (out_fptr && fclose(out_fptr) != 0)
+  {
+    fprintf(stderr, "Failed to write data (%d)\n", __LINE__);
+    rv = EXIT_FAILURE;
+  }
+
+  if (tmp_filename)
+  {
+    bool renamed = false;
+
+    if (rv == EXIT_SUCCESS)
+    {
+      // link() never replaces an existing file, so the check is atomic.
+      if (overwrite) renamed = rename(tmp_filename, out_filename) == 0;
+
+      if (overwrite ? !renamed : link(tmp_filename, out_filename) != 0)
+      {
+        fprintf(stderr, "Failed to create '%s': %s (%d)\n", out_filename, strerror(errno), __LINE__);
+        rv = EXIT_FAILURE;
+      }
+    }
+
+    if (!renamed) unlink(tmp_filename);
+    free(tmp_filename);
+  }
   return rv;
 }
 
+/*
+ * Batch mode
+ *
+ * A manifest has one merge per line: the metadata, data and output filenames
+ * separated by tabs. Blank lines and lines starting with '#' are ignored.
+ */
+typedef struct
+{
+  char* metadata_filename;
+  char* data_filename;
+  char* out_filename;
+} Job;
+
+typedef struct
+{
+  Job* jobs;
+  size_t num_jobs;
+  size_t next_job;
+  bool overwrite;
+  size_t num_merged, num_skipped, num_failed;
+  pthread_mutex_t mutex;
+} JobQueue;
+
+static int read_manifest(const char* manifest_filename, JobQueue* queue)
+{
+  char* line = NULL;
+  size_t len = 0;
+  size_t capacity = 0;
+  size_t line_no = 0;
+  FILE* fptr = strcmp(manifest_filename, "-") == 0 ? stdin : fopen(manifest_filename, "r");
+
+  if (!fptr)
+  {
+    fprintf(stderr, "Failed to open manifest '%s'\n", manifest_filename);
+    return -1;
+  }
+
+  while (getline(&line, &len, fptr) != -1)
+  {
+    char* fields[3];
+    char* save_ptr = NULL;
+    size_t num_fields = 0;
+
+    ++line_no;
+    line[strcspn(line, "\r\n")] = 0;
+
+    if (line[0] == 0 || line[0] == '#') continue;
+
+    for (char* field = strtok_r(line, "\t", &save_ptr); 
+         field && num_fields < countof(fields); 
+         field = strtok_r(NULL, "\t", &save_ptr))
+    {
+      fields[num_fields++] = field;
+    }
+
+    if (num_fields != 3 || strtok_r(NULL, "\t", &save_ptr))
+    {
+      fprintf(stderr, "%s:%zu: expected <metadata>\\t<data>\\t<output>\n", 
+              manifest_filename, line_no);
+      free(line);
+      if (fptr != stdin) fclose(fptr);
+      return -1;
+    }
+
+    if (queue->num_jobs == capacity)
+    {
+      size_t new_capacity = capacity ? capacity * 2 : 256;
+      Job* jobs = realloc(queue->jobs, new_capacity * sizeof(Job));
+
+      if (!jobs)
+      {
+        fprintf(stderr, "Out of memory reading manifest '%s'\n", manifest_filename);
+        free(line);
+        if (fptr != stdin) fclose(fptr);
+        return -1;
+      }
+
+      queue->jobs = jobs;
+      capacity = new_capacity;
+    }
+
+    Job* job = &queue->jobs[queue->num_jobs++];
+    job->metadata_filename = strdup(fields[0]);
+    job->data_filename = strdup(fields[1]);
+    job->out_filename = strdup(fields[2]);
+  }
+
+  free(line);
+  if (fptr != stdin) fclose(fptr);
+  return 0;
+}
+
+static void* batch_worker(void* arg)
+{
+  JobQueue* queue = arg;
+
+  while (true)
+  {
+    pthread_mutex_lock(&queue->mutex);
+    size_t i = queue->next_job++;
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (i >= queue->num_jobs) break;
+
+    Job* job = &queue->jobs[i];
+
+    // Never prompt in batch mode; existing outputs are skipped unless forced.
+    if (!queue->overwrite && access(job->out_filename, F_OK) != -1)
+    {
+      printf("SKIPPED %s (already exists)\n", job->out_filename);
+      pthread_mutex_lock(&queue->mutex);
+      queue->num_skipped++;
+      pthread_mutex_unlock(&queue->mutex);
+      continue;
+    }
+
+    int rv = merge_files(job->metadata_filename, job->data_filename, 
+                         job->out_filename, queue->overwrite);
+
+    printf("%s %s\n", rv == EXIT_SUCCESS ? "MERGED" : "FAILED", job->out_filename);
+
+    pthread_mutex_lock(&queue->mutex);
+    if (rv == EXIT_SUCCESS) queue->num_merged++; else queue->num_failed++;
+    pthread_mutex_unlock(&queue->mutex);
+  }
+
+  return NULL;
+}
+
+static int merge_batch(const char* manifest_filename, int num_workers, 
+                       int num_io_slots, bool overwrite)
+{
+  JobQueue queue = {0};
+  pthread_t* workers = NULL;
+  int num_started = 0;
+
+  queue.overwrite = overwrite;
+  pthread_mutex_init(&queue.mutex, NULL);
+
+  if (read_manifest(manifest_filename, &queue) == -1) return EXIT_FAILURE;
+
+  if (num_io_slots > 0)
+  {
+    sem_init(&io_slots, 0, num_io_slots);
+    limit_io = true;
+  }
+
+  if ((size_t)num_workers > queue.num_jobs) num_workers = queue.num_jobs;
+
+  workers = calloc(num_workers ? num_workers : 1, sizeof(pthread_t));
+
+  for (; num_started < num_workers; ++num_started)
+  {
+    if (pthread_create(&workers[num_started], NULL, batch_worker, &queue) != 0)
+    {
+      fprintf(stderr, "Failed to start worker thread (%d)\n", __LINE__);
+      break;
+    }
+  }
+
+  // Should we have failed to start any threads, do the work ourselves.
+  if (num_started == 0) batch_worker(&queue);
+
+  for (int i = 0; i < num_started; ++i) pthread_join(workers[i], NULL);
+
+  printf("%zu merged, %zu skipped, %zu failed\n", 
+         queue.num_merged, queue.num_skipped, queue.num_failed);
+
+  for (size_t i = 0; i < queue.num_jobs; ++i)
+  {
+    free(queue.jobs[i].metadata_filename);
+    free(queue.jobs[i].data_filename);
+    free(queue.jobs[i].out_filename);
+  }
+  free(queue.jobs);
+  free(workers);
+  if (limit_io) sem_destroy(&io_slots);
+  pthread_mutex_destroy(&queue.mutex);
+
+  return queue.num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage (int status) 
+{
+  printf ("riff_merge - Merge meta data chunks from one file with data chunks from another\n\n");
+  printf ("Usage: riff_merge <metadata filename> <data filename> <output filename>\n");
+  printf ("       riff_merge -i <metadata filename> <data filename>\n");
+  printf ("       riff_merge -b <manifest filename> [ -j xxx ] [ -J xxx ] [ -f ]\n\n");
+  printf ("Options:\n\
+  -i, --in-place          merge the meta data into the data file, rewriting only\n\
+                          the chunks in front of the audio\n\
+  -b, --batch <file>      run the merges listed in <file> ('-' for stdin), one\n\
+                          tab-separated <metadata> <data> <output> per line\n\
+  -j, --jobs <num>        number of merges to run at once in batch mode\n\
+  -J, --io-jobs <num>     number of chunk copies allowed in flight at once\n\
+  -f, --force             overwrite existing outputs in batch mode\n\
+  -q, --quiet             only report errors\n\
+  -h, --help              display this help and exit\n\
+\n");
+
+  exit (status);
+}
+
+static struct option const long_options[] =
+{
+  {"help", no_argument, 0, 'h'},
+  {"in-place", no_argument, 0, 'i'},
+  {"batch", required_argument, 0, 'b'},
+  {"jobs", required_argument, 0, 'j'},
+  {"io-jobs", required_argument, 0, 'J'},
+  {"force", no_argument, 0, 'f'},
+  {"quiet", no_argument, 0, 'q'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+  bool in_place = false;
+  bool overwrite = false;
+  const char* manifest_filename = NULL;
+  long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_io_slots = 0;
+  int c;
+
+  while ((c = getopt_long (argc, argv,
+         "i"  /* in-place */
+         "b:" /* batch manifest */
+         "j:" /* worker threads */
+         "J:" /* concurrent copies */
+         "f"  /* force */
+         "q"  /* quiet */
+         "h", /* help */
+         long_options, (int *) 0)) != EOF)
+  {
+    switch (c) {
+      case 'i':
+        in_place = true;
+        break;
+
+      case 'b':
+        manifest_filename = optarg;
+        break;
+
+      case 'j':
+        num_workers = atoi(optarg);
+        break;
+
+      case 'J':
+        num_io_slots = atoi(optarg);
+        break;
+
+      case 'f':
+        overwrite = true;
+        break;
+
+      case 'q':
+        verbosity = 0;
+        break;
+
+      case 'h':
+        usage (0);
+
+      default:
+        usage (EXIT_FAILURE);
+    }
+  }
+
+  if (manifest_filename)
+  {
+    if (argc - optind != 0) usage(EXIT_FAILURE);
+
+    // Per-chunk chatter from parallel merges would just be interleaved noise.
+    verbosity = 0;
+
+    return merge_batch(manifest_filename, num_workers < 1 ? 1 : num_workers, 
+                       num_io_slots, overwrite);
+  }
+
+  if (in_place)
+  {
+    if (argc - optind != 2) usage(EXIT_FAILURE);
+
+    return merge_in_place(argv[optind], argv[optind + 1]);
+  }
+
+  if (argc - optind != 3) usage(EXIT_FAILURE);
+
+  const char* metadata_filename = argv[optind];
+  const char* data_filename = argv[optind + 1];
+  const char* out_filename = argv[optind + 2];
+
+  // Check that output file doesn't exist
+  if (access(out_filename, F_OK) != -1)
+  {
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t num_bytes;
+    bool overwrite;
+
+    printf("File '%s' already exists. Overwirte ?  [y/N] ", out_filename);
+
+    num_bytes = getline(&line, &len, stdin);
+    overwrite = num_bytes != -1 && (line[0] == 'y' || line[0] == 'Y');
+    free(line);
+
+    if (num_bytes == -1)
+    {
+      return EXIT_FAILURE;
+    }
+    else if (!overwrite)
+    {
+      return EXIT_SUCCESS; 
+    }
+  }
+
+  return merge_files(metadata_filename, data_filename, out_filename, true);
+}
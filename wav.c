@@ -1,11 +1,34 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* copy_file_range() */
+#endif
+
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
 #include "wav.h"
 
+/* Static tracepoints, built with -DWITH_USDT; see probes.h */
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+#define WAV_PROBE2(name, a, b)  DTRACE_PROBE2(libwav, name, a, b)
+#else
+#define WAV_PROBE2(name, a, b)  do {} while (0)
+#endif
+
 #if defined(__x86_64) || defined(__amd64) || defined(__i386__) || defined(__x86_64__) || defined(__LITTLE_ENDIAN__)
 #define WAV_ENDIAN_LITTLE 1
 #elif defined(__BIG_ENDIAN__)
@@ -77,6 +100,21 @@ void* wav_realloc(void *p, size_t size)
     return g_alloc_funcs->realloc(g_alloc_context, p, size);
 }
 
+void* wav_calloc(size_t n, size_t size)
+{
+    void *p;
+
+    if (size != 0 && n > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    p = wav_malloc(n * size);
+    if (p != NULL) {
+        memset(p, 0, n * size);
+    }
+    return p;
+}
+
 void wav_free(void *p)
 {
     if (p != NULL) {
@@ -104,7 +142,7 @@ char* wav_strndup(WAV_CONST char *str, size_t n)
     return memcpy(result, str, n);
 }
 
-int wav_vasprintf(char **str, WAV_CONST char *format, va_list args)
+static int wav_vasprintf_with(void *context, WAV_CONST WavAllocFuncs *funcs, char **str, WAV_CONST char *format, va_list args)
 {
     int size = 0;
 
@@ -117,13 +155,18 @@ int wav_vasprintf(char **str, WAV_CONST char *format, va_list args)
         return size;
     }
 
-    *str = wav_malloc((size_t)size + 1);
+    *str = funcs->malloc(context, (size_t)size + 1);
     if (*str == NULL)
         return -1;
 
     return vsprintf(*str, format, args);
 }
 
+int wav_vasprintf(char **str, WAV_CONST char *format, va_list args)
+{
+    return wav_vasprintf_with(g_alloc_context, g_alloc_funcs, str, format, args);
+}
+
 int wav_asprintf(char **str, WAV_CONST char *format, ...)
 {
     va_list args;
@@ -133,40 +176,37 @@ int wav_asprintf(char **str, WAV_CONST char *format, ...)
     return size;
 }
 
-WAV_CONST WavErr* wav_err(void)
+/* Free the message of {err}, which came from {funcs}, and set it to WAV_OK */
+static void wav_err_reset(WavErr *err, void *context, WAV_CONST WavAllocFuncs *funcs)
 {
-    return &g_err;
+    if (err->code != WAV_OK && !err->_is_literal) {
+        funcs->free(context, err->message);
+    }
+    err->code = WAV_OK;
+    err->message = (char*)"";
+    err->_is_literal = 1;
 }
 
-void wav_err_clear(void)
+/* Format the message of {err}, which must be WAV_OK, with memory from {funcs} */
+static void wav_err_format(WavErr *err, void *context, WAV_CONST WavAllocFuncs *funcs, WavErrCode code, WAV_CONST char *format, va_list args)
 {
-    if (g_err.code != WAV_OK) {
-        if (!g_err._is_literal) {
-            wav_free(g_err.message);
-        }
-        g_err.code = WAV_OK;
-        g_err.message = (char*)"";
-        g_err._is_literal = 1;
+    err->code = code;
+    if (wav_vasprintf_with(context, funcs, &err->message, format, args) < 0) {
+        err->message = (char*)"Out of memory";
+        err->_is_literal = 1;
+    } else {
+        err->_is_literal = 0;
     }
 }
 
-WAV_INLINE void wav_err_set(WavErrCode code, WAV_CONST char *format, ...)
+WAV_CONST WavErr* wav_err(void)
 {
-    assert(g_err.code == WAV_OK);
-    va_list args;
-    va_start(args, format);
-    g_err.code = code;
-    wav_vasprintf(&g_err.message, format, args);
-    g_err._is_literal = 0;
-    va_end(args);
+    return &g_err;
 }
 
-WAV_INLINE void wav_err_set_literal(WavErrCode code, WAV_CONST char *message)
+void wav_err_clear(void)
 {
-    assert(g_err.code == WAV_OK);
-    g_err.code = code;
-    g_err.message = (char *)message;
-    g_err._is_literal = 1;
+    wav_err_reset(&g_err, g_alloc_context, g_alloc_funcs);
 }
 
 #pragma pack(push, 1)
@@ -235,8 +275,102 @@ struct _WavFile {
     WavFormatChunk      format_chunk;
     WavFactChunk        fact_chunk;
     WavDataChunk        data_chunk;
+
+    /* Deferred header updates; see wav_set_write_buffer() */
+    int                 defer_sizes;
+    int                 sizes_dirty;
+    size_t              checkpoint_interval;
+    size_t              bytes_since_checkpoint;
+    WavU8*              write_buffer;
+    WavU8*              write_buffer_aligned;
+    size_t              write_buffer_size;
+    size_t              write_buffer_len;
+
+    /* Interleaved frames for wav_read_channel_*() */
+    WavU8*              read_buffer;
+
+    /* The data chunk runs to the end of the file; see wav_set_follow() */
+    int                 follow;
+    WavU64              follow_available;   /* Bytes of data there were at the last update */
+
+    /* The last error on this file, and where its memory comes from */
+    WavErr              err;
+    void*               alloc_context;
+    WAV_CONST WavAllocFuncs* alloc_funcs;
 };
 
+/*
+ * Errors raised on a {WavFile} replace the last one it had, and are copied to
+ * the thread's {g_err} for callers of {wav_err}. Those raised without one,
+ * from {wav_copy_bytes}, only set {g_err}.
+ */
+static void wav_err_set(WavFile *self, WavErrCode code, WAV_CONST char *format, ...)
+{
+    va_list args;
+
+    if (self != NULL) {
+        wav_err_reset(&self->err, self->alloc_context, self->alloc_funcs);
+        va_start(args, format);
+        wav_err_format(&self->err, self->alloc_context, self->alloc_funcs, code, format, args);
+        va_end(args);
+        wav_err_clear();
+    }
+
+    assert(g_err.code == WAV_OK);
+    va_start(args, format);
+    wav_err_format(&g_err, g_alloc_context, g_alloc_funcs, code, format, args);
+    va_end(args);
+}
+
+static void wav_err_set_literal(WavFile *self, WavErrCode code, WAV_CONST char *message)
+{
+    if (self != NULL) {
+        wav_err_reset(&self->err, self->alloc_context, self->alloc_funcs);
+        self->err.code = code;
+        self->err.message = (char *)message;
+        self->err._is_literal = 1;
+        wav_err_clear();
+    }
+
+    assert(g_err.code == WAV_OK);
+    g_err.code = code;
+    g_err.message = (char *)message;
+    g_err._is_literal = 1;
+}
+
+WAV_CONST WavErr* wav_file_err(WAV_CONST WavFile *self)
+{
+    return &self->err;
+}
+
+void wav_file_err_clear(WavFile *self)
+{
+    wav_err_reset(&self->err, self->alloc_context, self->alloc_funcs);
+}
+
+/* Memory that belongs to {self} comes from the allocator it was opened with */
+static void* wav_file_malloc(WAV_CONST WavFile *self, size_t size)
+{
+    return self->alloc_funcs->malloc(self->alloc_context, size);
+}
+
+static void wav_file_free(WAV_CONST WavFile *self, void *p)
+{
+    if (p != NULL) {
+        self->alloc_funcs->free(self->alloc_context, p);
+    }
+}
+
+static char* wav_file_strdup(WAV_CONST WavFile *self, WAV_CONST char *str)
+{
+    size_t len = strlen(str) + 1;
+    void *new = wav_file_malloc(self, len);
+    if (new == NULL)
+        return NULL;
+
+    return memcpy(new, str, len);
+}
+
 static WAV_CONST WavU8 default_sub_format[16] = {
     0x01, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
@@ -248,22 +382,22 @@ void wav_parse_header(WavFile* self)
 
     read_count = fread(&self->riff_chunk, sizeof(WavChunkHeader), 1, self->fp);
     if (read_count != 1) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Unexpected EOF");
+        wav_err_set_literal(self, WAV_ERR_FORMAT, "Unexpected EOF");
         return;
     }
 
     if (self->riff_chunk.id != WAV_RIFF_CHUNK_ID) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Not a RIFF file");
+        wav_err_set_literal(self, WAV_ERR_FORMAT, "Not a RIFF file");
         return;
     }
 
     read_count = fread(&self->riff_chunk.wave_id, 4, 1, self->fp);
     if (read_count != 1) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Unexpected EOF");
+        wav_err_set_literal(self, WAV_ERR_FORMAT, "Unexpected EOF");
         return;
     }
     if (self->riff_chunk.wave_id != WAV_WAVE_ID) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Not a WAVE file");
+        wav_err_set_literal(self, WAV_ERR_FORMAT, "Not a WAVE file");
         return;
     }
 
@@ -274,34 +408,46 @@ void wav_parse_header(WavFile* self)
 
         read_count = fread(&header, sizeof(WavChunkHeader), 1, self->fp);
         if (read_count != 1) {
-            wav_err_set_literal(WAV_ERR_FORMAT, "Unexpected EOF");
+            wav_err_set_literal(self, WAV_ERR_FORMAT, "Unexpected EOF");
             return;
         }
 
         switch (header.id) {
-            case WAV_FORMAT_CHUNK_ID:
+            case WAV_FORMAT_CHUNK_ID: {
+                size_t body_size = header.size < sizeof(self->format_chunk.body) ? header.size : sizeof(self->format_chunk.body);
+                WavU16 format_tag;
+
                 self->format_chunk.header = header;
                 self->format_chunk.offset = (WavU64)ftell(self->fp);
-                read_count = fread(&self->format_chunk.body, header.size, 1, self->fp);
+                read_count = fread(&self->format_chunk.body, body_size, 1, self->fp);
                 if (read_count != 1) {
-                    wav_err_set_literal(WAV_ERR_FORMAT, "Unexpected EOF");
+                    wav_err_set_literal(self, WAV_ERR_FORMAT, "Unexpected EOF");
                     return;
                 }
-                if (self->format_chunk.body.format_tag != WAV_FORMAT_PCM &&
-                    self->format_chunk.body.format_tag != WAV_FORMAT_IEEE_FLOAT &&
-                    self->format_chunk.body.format_tag != WAV_FORMAT_ALAW &&
-                    self->format_chunk.body.format_tag != WAV_FORMAT_MULAW)
+                if (header.size > body_size && fseek(self->fp, header.size - body_size, SEEK_CUR) < 0) {
+                    wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+                    return;
+                }
+                format_tag = self->format_chunk.body.format_tag;
+                if (format_tag == WAV_FORMAT_EXTENSIBLE && body_size == sizeof(self->format_chunk.body)) {
+                    format_tag = wav_get_sub_format(self);
+                }
+                if (format_tag != WAV_FORMAT_PCM &&
+                    format_tag != WAV_FORMAT_IEEE_FLOAT &&
+                    format_tag != WAV_FORMAT_ALAW &&
+                    format_tag != WAV_FORMAT_MULAW)
                 {
-                    wav_err_set(WAV_ERR_FORMAT, "Unsupported format tag: %#010x", self->format_chunk.body.format_tag);
+                    wav_err_set(self, WAV_ERR_FORMAT, "Unsupported format tag: %#010x", format_tag);
                     return;
                 }
                 break;
+            }
             case WAV_FACT_CHUNK_ID:
                 self->fact_chunk.header = header;
                 self->fact_chunk.offset = (WavU64)ftell(self->fp);
                 read_count = fread(&self->fact_chunk.body, header.size, 1, self->fp);
                 if (read_count != 1) {
-                    wav_err_set(WAV_ERR_FORMAT, "Unexpected EOF");
+                    wav_err_set(self, WAV_ERR_FORMAT, "Unexpected EOF");
                 }
                 break;
             case WAV_DATA_CHUNK_ID:
@@ -310,7 +456,7 @@ void wav_parse_header(WavFile* self)
                 break;
             default:
                 if (fseek(self->fp, header.size, SEEK_CUR) < 0) {
-                    wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+                    wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
                     return;
                 }
                 break;
@@ -327,59 +473,89 @@ void wav_write_header(WavFile* self)
         (self->data_chunk.header.id == WAV_DATA_CHUNK_ID ? (sizeof(WavChunkHeader) + self->data_chunk.header.size) : 0);
 
     if (fseek(self->fp, 0, SEEK_SET) != 0) {
-        wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+        wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
         return;
     }
     if (fwrite(&self->riff_chunk, sizeof(WavChunkHeader) + 4, 1, self->fp) != 1) {
-        wav_err_set(WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+        wav_err_set(self, WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
         return;
     }
 
     if (self->format_chunk.header.id == WAV_FORMAT_CHUNK_ID) {
         if (fseek(self->fp, (long)(self->format_chunk.offset - sizeof(WavChunkHeader)), SEEK_SET) != 0) {
-            wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
             return;
         }
         if (fwrite(&self->format_chunk.header, sizeof(WavChunkHeader), 1, self->fp) != 1) {
-            wav_err_set(WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
             return;
         }
         if (fwrite(&self->format_chunk.body, self->format_chunk.header.size, 1, self->fp) != 1) {
-            wav_err_set(WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
             return;
         }
     }
 
     if (self->fact_chunk.header.id == WAV_FACT_CHUNK_ID) {
         if (fseek(self->fp, (long)(self->fact_chunk.offset - sizeof(WavChunkHeader)), SEEK_SET) != 0) {
-            wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
             return;
         }
         if (fwrite(&self->fact_chunk.header, sizeof(WavChunkHeader), 1, self->fp) != 1) {
-            wav_err_set(WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
             return;
         }
         if (fwrite(&self->fact_chunk.body, self->fact_chunk.header.size, 1, self->fp) != 1) {
-            wav_err_set(WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
             return;
         }
     }
 
     if (self->data_chunk.header.id == WAV_DATA_CHUNK_ID) {
         if (fseek(self->fp, (long)(self->data_chunk.offset - sizeof(WavChunkHeader)), SEEK_SET) != 0) {
-            wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
             return;
         }
         if (fwrite(&self->data_chunk.header, sizeof(WavChunkHeader), 1, self->fp) != 1) {
-            wav_err_set(WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+            wav_err_set(self, WAV_ERR_OS, "Error while writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
             return;
         }
     }
 }
 
-void wav_init(WavFile* self, WAV_CONST char* filename, WAV_CONST char* mode)
+static void wav_init_stream(WavFile* self);
+
+/* Clear {self}, but for the allocator it was opened with */
+static void wav_reset(WavFile* self)
 {
+    void* alloc_context = self->alloc_context;
+    WAV_CONST WavAllocFuncs* alloc_funcs = self->alloc_funcs;
+
     memset(self, 0, sizeof(WavFile));
+    self->alloc_context = alloc_context;
+    self->alloc_funcs = alloc_funcs;
+    self->err.message = (char*)"";
+    self->err._is_literal = 1;
+}
+
+/* Allocate a cleared {WavFile} whose memory will come from {funcs} */
+static WavFile* wav_alloc(void* context, WAV_CONST WavAllocFuncs* funcs)
+{
+    WavFile* self = funcs->malloc(context, sizeof(WavFile));
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->alloc_context = context;
+    self->alloc_funcs = funcs;
+    wav_reset(self);
+
+    return self;
+}
+
+void wav_init(WavFile* self, WAV_CONST char* filename, WAV_CONST char* mode)
+{
+    wav_reset(self);
 
     if (strncmp(mode, "r", 1) == 0 || strncmp(mode, "rb", 2) == 0) {
         self->mode = "rb";
@@ -398,18 +574,24 @@ void wav_init(WavFile* self, WAV_CONST char* filename, WAV_CONST char* mode)
     } else if (strncmp(mode, "a+", 2) == 0 || strncmp(mode, "ab+", 3) == 0 || strncmp(mode, "a+b", 3) == 0) {
         self->mode = "ab+";
     } else {
-        wav_err_set(WAV_ERR_MODE, "Mode is incorrect: %s", mode);
+        wav_err_set(self, WAV_ERR_MODE, "Mode is incorrect: %s", mode);
         return;
     }
 
-    self->filename = wav_strdup(filename);
+    self->filename = wav_file_strdup(self, filename);
 
     self->fp = fopen(filename, self->mode);
     if (self->fp == NULL) {
-        wav_err_set(WAV_ERR_OS, "Error when opening %s [errno %d: %s]", filename, errno, strerror(errno));
+        wav_err_set(self, WAV_ERR_OS, "Error when opening %s [errno %d: %s]", filename, errno, strerror(errno));
         return;
     }
 
+    wav_init_stream(self);
+}
+
+/* Read or create the header of the newly opened {self->fp} */
+static void wav_init_stream(WavFile* self)
+{
     if (self->mode[0] == 'r') {
         wav_parse_header(self);
         return;
@@ -417,11 +599,12 @@ void wav_init(WavFile* self, WAV_CONST char* filename, WAV_CONST char* mode)
 
     if (self->mode[0] == 'a') {
         wav_parse_header(self);
-        if (g_err.code == WAV_OK) {
+        if (self->err.code == WAV_OK) {
             // If the header parsing was successful, return immediately.
             return;
         } else {
             // Header parsing failed. Regard it as a new file.
+            wav_file_err_clear(self);
             wav_err_clear();
             rewind(self->fp);
         }
@@ -456,7 +639,14 @@ void wav_finalize(WavFile* self)
 {
     int ret;
 
-    wav_free(self->filename);
+    if (self->fp != NULL && self->defer_sizes) {
+        wav_flush(self);
+    }
+
+    wav_file_free(self, self->filename);
+    wav_file_free(self, self->write_buffer);
+    wav_file_free(self, self->read_buffer);
+    wav_file_err_clear(self);
 
     if (self->fp == NULL) {
         return;
@@ -471,7 +661,12 @@ void wav_finalize(WavFile* self)
 
 WavFile* wav_open(WAV_CONST char* filename, WAV_CONST char* mode)
 {
-    WavFile* self = wav_malloc(sizeof(WavFile));
+    return wav_open_with_allocator(filename, mode, g_alloc_context, g_alloc_funcs);
+}
+
+WavFile* wav_open_with_allocator(WAV_CONST char* filename, WAV_CONST char* mode, void* context, WAV_CONST WavAllocFuncs* funcs)
+{
+    WavFile* self = wav_alloc(context, funcs);
     if (self == NULL) {
         return NULL;
     }
@@ -481,10 +676,175 @@ WavFile* wav_open(WAV_CONST char* filename, WAV_CONST char* mode)
     return self;
 }
 
+#if !defined(_WIN32)
+WavFile* wav_open_memory(WAV_CONST void* buffer, size_t size)
+{
+    return wav_open_memory_with_allocator(buffer, size, g_alloc_context, g_alloc_funcs);
+}
+
+WavFile* wav_open_memory_with_allocator(WAV_CONST void* buffer, size_t size, void* alloc_context, WAV_CONST WavAllocFuncs* alloc_funcs)
+{
+    WavFile* self = wav_alloc(alloc_context, alloc_funcs);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->mode = "rb";
+    self->filename = wav_file_strdup(self, "(memory)");
+
+    /* glibc doesn't copy the buffer when it's opened for reading */
+    self->fp = fmemopen((void*)buffer, size, "rb");
+    if (self->fp == NULL) {
+        wav_err_set(self, WAV_ERR_OS, "Error when opening %s [errno %d: %s]", self->filename, errno, strerror(errno));
+        return self;
+    }
+
+    wav_init_stream(self);
+
+    return self;
+}
+#endif
+
+#if defined(__GLIBC__)
+typedef struct {
+    void*       context;
+    WavIoFuncs  funcs;
+    WavI64      pos;
+    WavFile*    file;       /* whose allocator the cookie came from */
+} WavIoCookie;
+
+static ssize_t wav_cookie_read(void *cookie, char *buffer, size_t size)
+{
+    WavIoCookie* io = cookie;
+    WavI64 n = io->funcs.read(io->context, buffer, size);
+
+    if (n > 0) {
+        io->pos += n;
+    }
+
+    return (ssize_t)n;
+}
+
+static int wav_cookie_seek(void *cookie, off64_t *offset, int origin)
+{
+    WavIoCookie* io = cookie;
+    WavI64 target;
+    char discard[4096];
+
+    if (io->funcs.seek != NULL) {
+        WavI64 pos = *offset;
+
+        if (io->funcs.seek(io->context, &pos, origin) != 0) {
+            return -1;
+        }
+        io->pos = pos;
+        *offset = pos;
+        return 0;
+    }
+
+    /* Not seekable: only allow moving forwards, by reading */
+    if (origin == SEEK_SET) {
+        target = *offset;
+    } else if (origin == SEEK_CUR) {
+        target = io->pos + *offset;
+    } else {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    if (target < io->pos) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    while (io->pos < target) {
+        size_t len = target - io->pos < (WavI64)sizeof(discard) ? (size_t)(target - io->pos) : sizeof(discard);
+        if (wav_cookie_read(io, discard, len) <= 0) {
+            return -1;
+        }
+    }
+
+    *offset = io->pos;
+    return 0;
+}
+
+static int wav_cookie_close(void *cookie)
+{
+    WavIoCookie* io = cookie;
+
+    if (io->funcs.close != NULL) {
+        io->funcs.close(io->context);
+    }
+    wav_file_free(io->file, io);
+
+    return 0;
+}
+
+WavFile* wav_open_callbacks_with_allocator(void* context, WAV_CONST WavIoFuncs* funcs, void* alloc_context, WAV_CONST WavAllocFuncs* alloc_funcs)
+{
+    cookie_io_functions_t cookie_funcs = {wav_cookie_read, NULL, wav_cookie_seek, wav_cookie_close};
+    WavIoCookie* io;
+    WavFile* self = wav_alloc(alloc_context, alloc_funcs);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->mode = "rb";
+    self->filename = wav_file_strdup(self, "(stream)");
+
+    io = wav_file_malloc(self, sizeof(WavIoCookie));
+    if (io == NULL) {
+        wav_err_set_literal(self, WAV_ERR_OS, "Out of memory");
+        return self;
+    }
+    io->context = context;
+    io->funcs = *funcs;
+    io->pos = 0;
+    io->file = self;
+
+    self->fp = fopencookie(io, "rb", cookie_funcs);
+    if (self->fp == NULL) {
+        wav_err_set(self, WAV_ERR_OS, "Error when opening %s [errno %d: %s]", self->filename, errno, strerror(errno));
+        wav_file_free(self, io);
+        return self;
+    }
+
+    /* stdio seeks back into its read-ahead when skipping chunks, which a stream can't do */
+    if (funcs->seek == NULL) {
+        setvbuf(self->fp, NULL, _IONBF, 0);
+    }
+
+    wav_init_stream(self);
+
+    return self;
+}
+#else
+WavFile* wav_open_callbacks_with_allocator(void* context, WAV_CONST WavIoFuncs* funcs, void* alloc_context, WAV_CONST WavAllocFuncs* alloc_funcs)
+{
+    WavFile* self = wav_alloc(alloc_context, alloc_funcs);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    (void)context;
+    (void)funcs;
+
+    self->mode = "rb";
+    wav_err_set_literal(self, WAV_ERR_OS, "Callback streams are not supported on this platform");
+
+    return self;
+}
+#endif
+
+WavFile* wav_open_callbacks(void* context, WAV_CONST WavIoFuncs* funcs)
+{
+    return wav_open_callbacks_with_allocator(context, funcs, g_alloc_context, g_alloc_funcs);
+}
+
 void wav_close(WavFile* self)
 {
     wav_finalize(self);
-    wav_free(self);
+    wav_file_free(self, self);
 }
 
 WavFile* wav_reopen(WavFile* self, WAV_CONST char* filename, WAV_CONST char* mode)
@@ -494,90 +854,443 @@ WavFile* wav_reopen(WavFile* self, WAV_CONST char* filename, WAV_CONST char* mod
     return self;
 }
 
-size_t wav_read(WavFile* self, void *buffer, size_t count)
+/* Write out any frames held in the write buffer */
+static int wav_drain_write_buffer(WavFile* self)
+{
+    size_t len = self->write_buffer_len;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    self->write_buffer_len = 0;
+    if (fwrite(self->write_buffer_aligned, len, 1, self->fp) != 1) {
+        wav_err_set(self, WAV_ERR_OS, "Error when writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t wav_read_frames(WavFile* self, void *buffer, size_t count)
 {
     size_t read_count;
     WavU16 n_channels = wav_get_num_channels(self);
     size_t sample_size = wav_get_sample_size(self);
+    long int pos;
     size_t len_remain;
 
     if (strncmp(self->mode, "wb", 2) == 0 || strncmp(self->mode, "wbx", 3) == 0 || strncmp(self->mode, "ab", 2) == 0) {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not readable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not readable");
         return 0;
     }
 
-    if (self->format_chunk.body.format_tag == WAV_FORMAT_EXTENSIBLE) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Extensible format is not supported");
+    pos = wav_tell(self);
+    if (pos < 0 || (size_t)pos >= wav_get_length(self)) {
         return 0;
     }
+    len_remain = wav_get_length(self) - (size_t)pos;
+    count = (count <= len_remain) ? count : len_remain;
 
-    len_remain = wav_get_length(self) - (size_t)wav_tell(self);
-    if (g_err.code != WAV_OK) {
+    if (count == 0) {
         return 0;
     }
-    count = (count <= len_remain) ? count : len_remain;
 
-    if (count == 0) {
+    if (wav_drain_write_buffer(self) != 0) {
         return 0;
     }
 
     read_count = fread(buffer, sample_size, n_channels * count, self->fp);
     if (ferror(self->fp)) {
-        wav_err_set(WAV_ERR_OS, "Error when reading %s [errno %d: %s]", self->filename, errno, strerror(errno));
+        wav_err_set(self, WAV_ERR_OS, "Error when reading %s [errno %d: %s]", self->filename, errno, strerror(errno));
         return 0;
     }
 
     return read_count / n_channels;
 }
 
-WAV_INLINE void wav_update_sizes(WavFile *self)
+size_t wav_read(WavFile* self, void *buffer, size_t count)
+{
+    size_t read_count;
+
+    WAV_PROBE2(read_entry, self, count);
+    read_count = wav_read_frames(self, buffer, count);
+    WAV_PROBE2(read_return, self, read_count);
+
+    return read_count;
+}
+
+#define WAV_READ_CHANNEL_FRAMES     1024
+
+/* G.711 expansion to 16 bits */
+static WAV_CONST WavI16 wav_alaw_table[256] = {
+     -5504,  -5248,  -6016,  -5760,  -4480,  -4224,  -4992,  -4736,
+     -7552,  -7296,  -8064,  -7808,  -6528,  -6272,  -7040,  -6784,
+     -2752,  -2624,  -3008,  -2880,  -2240,  -2112,  -2496,  -2368,
+     -3776,  -3648,  -4032,  -3904,  -3264,  -3136,  -3520,  -3392,
+    -22016, -20992, -24064, -23040, -17920, -16896, -19968, -18944,
+    -30208, -29184, -32256, -31232, -26112, -25088, -28160, -27136,
+    -11008, -10496, -12032, -11520,  -8960,  -8448,  -9984,  -9472,
+    -15104, -14592, -16128, -15616, -13056, -12544, -14080, -13568,
+      -344,   -328,   -376,   -360,   -280,   -264,   -312,   -296,
+      -472,   -456,   -504,   -488,   -408,   -392,   -440,   -424,
+       -88,    -72,   -120,   -104,    -24,     -8,    -56,    -40,
+      -216,   -200,   -248,   -232,   -152,   -136,   -184,   -168,
+     -1376,  -1312,  -1504,  -1440,  -1120,  -1056,  -1248,  -1184,
+     -1888,  -1824,  -2016,  -1952,  -1632,  -1568,  -1760,  -1696,
+      -688,   -656,   -752,   -720,   -560,   -528,   -624,   -592,
+      -944,   -912,  -1008,   -976,   -816,   -784,   -880,   -848,
+      5504,   5248,   6016,   5760,   4480,   4224,   4992,   4736,
+      7552,   7296,   8064,   7808,   6528,   6272,   7040,   6784,
+      2752,   2624,   3008,   2880,   2240,   2112,   2496,   2368,
+      3776,   3648,   4032,   3904,   3264,   3136,   3520,   3392,
+     22016,  20992,  24064,  23040,  17920,  16896,  19968,  18944,
+     30208,  29184,  32256,  31232,  26112,  25088,  28160,  27136,
+     11008,  10496,  12032,  11520,   8960,   8448,   9984,   9472,
+     15104,  14592,  16128,  15616,  13056,  12544,  14080,  13568,
+       344,    328,    376,    360,    280,    264,    312,    296,
+       472,    456,    504,    488,    408,    392,    440,    424,
+        88,     72,    120,    104,     24,      8,     56,     40,
+       216,    200,    248,    232,    152,    136,    184,    168,
+      1376,   1312,   1504,   1440,   1120,   1056,   1248,   1184,
+      1888,   1824,   2016,   1952,   1632,   1568,   1760,   1696,
+       688,    656,    752,    720,    560,    528,    624,    592,
+       944,    912,   1008,    976,    816,    784,    880,    848,
+};
+
+static WAV_CONST WavI16 wav_mulaw_table[256] = {
+    -32124, -31100, -30076, -29052, -28028, -27004, -25980, -24956,
+    -23932, -22908, -21884, -20860, -19836, -18812, -17788, -16764,
+    -15996, -15484, -14972, -14460, -13948, -13436, -12924, -12412,
+    -11900, -11388, -10876, -10364,  -9852,  -9340,  -8828,  -8316,
+     -7932,  -7676,  -7420,  -7164,  -6908,  -6652,  -6396,  -6140,
+     -5884,  -5628,  -5372,  -5116,  -4860,  -4604,  -4348,  -4092,
+     -3900,  -3772,  -3644,  -3516,  -3388,  -3260,  -3132,  -3004,
+     -2876,  -2748,  -2620,  -2492,  -2364,  -2236,  -2108,  -1980,
+     -1884,  -1820,  -1756,  -1692,  -1628,  -1564,  -1500,  -1436,
+     -1372,  -1308,  -1244,  -1180,  -1116,  -1052,   -988,   -924,
+      -876,   -844,   -812,   -780,   -748,   -716,   -684,   -652,
+      -620,   -588,   -556,   -524,   -492,   -460,   -428,   -396,
+      -372,   -356,   -340,   -324,   -308,   -292,   -276,   -260,
+      -244,   -228,   -212,   -196,   -180,   -164,   -148,   -132,
+      -120,   -112,   -104,    -96,    -88,    -80,    -72,    -64,
+       -56,    -48,    -40,    -32,    -24,    -16,     -8,      0,
+     32124,  31100,  30076,  29052,  28028,  27004,  25980,  24956,
+     23932,  22908,  21884,  20860,  19836,  18812,  17788,  16764,
+     15996,  15484,  14972,  14460,  13948,  13436,  12924,  12412,
+     11900,  11388,  10876,  10364,   9852,   9340,   8828,   8316,
+      7932,   7676,   7420,   7164,   6908,   6652,   6396,   6140,
+      5884,   5628,   5372,   5116,   4860,   4604,   4348,   4092,
+      3900,   3772,   3644,   3516,   3388,   3260,   3132,   3004,
+      2876,   2748,   2620,   2492,   2364,   2236,   2108,   1980,
+      1884,   1820,   1756,   1692,   1628,   1564,   1500,   1436,
+      1372,   1308,   1244,   1180,   1116,   1052,    988,    924,
+       876,    844,    812,    780,    748,    716,    684,    652,
+       620,    588,    556,    524,    492,    460,    428,    396,
+       372,    356,    340,    324,    308,    292,    276,    260,
+       244,    228,    212,    196,    180,    164,    148,    132,
+       120,    112,    104,     96,     88,     80,     72,     64,
+        56,     48,     40,     32,     24,     16,      8,      0,
+};
+
+/* Format of the samples, looking through WAV_FORMAT_EXTENSIBLE */
+static WavU16 wav_sample_format(WAV_CONST WavFile* self)
+{
+    if (self->format_chunk.body.format_tag == WAV_FORMAT_EXTENSIBLE) {
+        return wav_get_sub_format(self);
+    }
+    return self->format_chunk.body.format_tag;
+}
+
+/* Convert a float sample to a left-justified 32 bit int, clipping */
+WAV_INLINE WavI32 wav_float_to_i32(double x)
+{
+    x *= 2147483648.0;
+    if (x >= 2147483647.0) {
+        return 2147483647;
+    }
+    if (x <= -2147483648.0) {
+        return (WavI32)-2147483647 - 1;
+    }
+    return (WavI32)x;
+}
+
+/* Take every {stride} bytes of {src} as a sample and convert it to a left-justified 32 bit int */
+static void wav_extract_i32(WAV_CONST WavU8* src, size_t stride, WavU16 format, size_t sample_size, WavI32* dst, size_t n)
+{
+    size_t i;
+
+    switch (format) {
+        case WAV_FORMAT_PCM:
+            switch (sample_size) {
+                case 1:
+                    for (i = 0; i < n; i++, src += stride) {
+                        dst[i] = ((WavI32)src[0] - 128) * (1 << 24);
+                    }
+                    break;
+                case 2:
+                    for (i = 0; i < n; i++, src += stride) {
+                        WavI16 x;
+                        memcpy(&x, src, 2);
+                        dst[i] = (WavI32)x * (1 << 16);
+                    }
+                    break;
+                case 3:
+                    for (i = 0; i < n; i++, src += stride) {
+                        dst[i] = (WavI32)((WavU32)src[0] << 8 | (WavU32)src[1] << 16 | (WavU32)src[2] << 24);
+                    }
+                    break;
+                default:
+                    /* Anything wider is truncated to its top 32 bits */
+                    for (i = 0; i < n; i++, src += stride) {
+                        memcpy(&dst[i], src + sample_size - 4, 4);
+                    }
+                    break;
+            }
+            break;
+        case WAV_FORMAT_IEEE_FLOAT:
+            if (sample_size == 4) {
+                for (i = 0; i < n; i++, src += stride) {
+                    float x;
+                    memcpy(&x, src, 4);
+                    dst[i] = wav_float_to_i32(x);
+                }
+            } else {
+                for (i = 0; i < n; i++, src += stride) {
+                    double x;
+                    memcpy(&x, src, 8);
+                    dst[i] = wav_float_to_i32(x);
+                }
+            }
+            break;
+        case WAV_FORMAT_ALAW:
+            for (i = 0; i < n; i++, src += stride) {
+                dst[i] = (WavI32)wav_alaw_table[src[0]] * (1 << 16);
+            }
+            break;
+        case WAV_FORMAT_MULAW:
+            for (i = 0; i < n; i++, src += stride) {
+                dst[i] = (WavI32)wav_mulaw_table[src[0]] * (1 << 16);
+            }
+            break;
+    }
+}
+
+/* Keep the top 16 bits of each sample */
+static void wav_narrow_i32(WAV_CONST WavI32* src, WavI16* dst, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_srai_epi32(_mm_loadu_si128((WAV_CONST __m128i*)(src + i)), 16);
+        __m128i b = _mm_srai_epi32(_mm_loadu_si128((WAV_CONST __m128i*)(src + i + 4)), 16);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] = (WavI16)(src[i] >> 16);
+    }
+}
+
+/* Convert left-justified 32 bit ints to floats in [-1, 1), in place */
+static void wav_i32_to_float(void* buffer, size_t n)
+{
+    WavI32* src = buffer;
+    float* dst = buffer;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((WAV_CONST __m128i*)(src + i));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] = (float)src[i] * (1.0f / 2147483648.0f);
+    }
+}
+
+typedef enum {
+    WAV_SAMPLE_I16,
+    WAV_SAMPLE_I32,
+    WAV_SAMPLE_F32,
+} WavSampleType;
+
+static size_t wav_read_channel(WavFile* self, unsigned channel, void* buffer, size_t count, WavSampleType type)
+{
+    WavU16 format = wav_sample_format(self);
+    WavU16 n_channels = wav_get_num_channels(self);
+    size_t sample_size = wav_get_sample_size(self);
+    size_t block_align = self->format_chunk.body.block_align;
+    size_t done = 0;
+
+    if (channel >= n_channels) {
+        wav_err_set(self, WAV_ERR_PARAM, "Invalid channel: %u", channel);
+        return 0;
+    }
+
+    if ((format == WAV_FORMAT_PCM && sample_size > 8) ||
+        (format == WAV_FORMAT_IEEE_FLOAT && sample_size != 4 && sample_size != 8) ||
+        ((format == WAV_FORMAT_ALAW || format == WAV_FORMAT_MULAW) && sample_size != 1))
+    {
+        wav_err_set(self, WAV_ERR_FORMAT, "Unsupported sample size: %zu", sample_size);
+        return 0;
+    }
+
+    if (self->read_buffer == NULL) {
+        self->read_buffer = wav_file_malloc(self, WAV_READ_CHANNEL_FRAMES * block_align);
+        if (self->read_buffer == NULL) {
+            wav_err_set_literal(self, WAV_ERR_OS, "Out of memory");
+            return 0;
+        }
+    }
+
+    while (done < count) {
+        WavI32 wide[WAV_READ_CHANNEL_FRAMES];
+        WAV_CONST WavU8* src = self->read_buffer + channel * sample_size;
+        size_t n = count - done < WAV_READ_CHANNEL_FRAMES ? count - done : WAV_READ_CHANNEL_FRAMES;
+        size_t i;
+
+        n = wav_read(self, self->read_buffer, n);
+        if (n == 0) {
+            break;
+        }
+
+        switch (type) {
+            case WAV_SAMPLE_I16: {
+                WavI16* dst = (WavI16*)buffer + done;
+                if (format == WAV_FORMAT_PCM && sample_size == 2) {
+                    for (i = 0; i < n; i++, src += block_align) {
+                        memcpy(&dst[i], src, 2);
+                    }
+                } else {
+                    wav_extract_i32(src, block_align, format, sample_size, wide, n);
+                    wav_narrow_i32(wide, dst, n);
+                }
+                break;
+            }
+            case WAV_SAMPLE_I32:
+                wav_extract_i32(src, block_align, format, sample_size, (WavI32*)buffer + done, n);
+                break;
+            case WAV_SAMPLE_F32: {
+                float* dst = (float*)buffer + done;
+                if (format == WAV_FORMAT_IEEE_FLOAT && sample_size == 4) {
+                    for (i = 0; i < n; i++, src += block_align) {
+                        memcpy(&dst[i], src, 4);
+                    }
+                } else if (format == WAV_FORMAT_IEEE_FLOAT) {
+                    for (i = 0; i < n; i++, src += block_align) {
+                        double x;
+                        memcpy(&x, src, 8);
+                        dst[i] = (float)x;
+                    }
+                } else {
+                    /* Floats and int32s are the same size, so convert in place */
+                    wav_extract_i32(src, block_align, format, sample_size, (WavI32*)dst, n);
+                    wav_i32_to_float(dst, n);
+                }
+                break;
+            }
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+
+size_t wav_read_channel_i16(WavFile* self, unsigned channel, WavI16* buffer, size_t count)
+{
+    return wav_read_channel(self, channel, buffer, count, WAV_SAMPLE_I16);
+}
+
+size_t wav_read_channel_i32(WavFile* self, unsigned channel, WavI32* buffer, size_t count)
+{
+    return wav_read_channel(self, channel, buffer, count, WAV_SAMPLE_I32);
+}
+
+size_t wav_read_channel_f32(WavFile* self, unsigned channel, float* buffer, size_t count)
+{
+    return wav_read_channel(self, channel, buffer, count, WAV_SAMPLE_F32);
+}
+
+WAV_INLINE int wav_update_sizes(WavFile *self)
 {
     long int save_pos = ftell(self->fp);
     if (fseek(self->fp, (long)(sizeof(WavChunkHeader) - 4), SEEK_SET) != 0) {
-        wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
-        return;
+        wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+        return -1;
     }
     if (fwrite(&self->riff_chunk.size, 4, 1, self->fp) != 1) {
-        wav_err_set(WAV_ERR_OS, "fwrite() failed [errno %d: %s]", errno, strerror(errno));
-        return;
+        wav_err_set(self, WAV_ERR_OS, "fwrite() failed [errno %d: %s]", errno, strerror(errno));
+        return -1;
     }
     if (self->fact_chunk.header.id == WAV_FACT_CHUNK_ID) {
         if (fseek(self->fp, (long)self->fact_chunk.offset, SEEK_SET) != 0) {
-            wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
-            return;
+            wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+            return -1;
         }
         if (fwrite(&self->fact_chunk.body.sample_length, 4, 1, self->fp) != 1) {
-            wav_err_set(WAV_ERR_OS, "fwrite() failed [errno %d: %s]", errno, strerror(errno));
-            return;
+            wav_err_set(self, WAV_ERR_OS, "fwrite() failed [errno %d: %s]", errno, strerror(errno));
+            return -1;
         }
     }
     if (fseek(self->fp, (long)(self->data_chunk.offset - 4), SEEK_SET) != 0) {
-        wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
-        return;
+        wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+        return -1;
     }
     if (fwrite(&self->data_chunk.header.size, 4, 1, self->fp) != 1) {
-        wav_err_set(WAV_ERR_OS, "fwrite() failed [errno %d: %s]", errno, strerror(errno));
-        return;
+        wav_err_set(self, WAV_ERR_OS, "fwrite() failed [errno %d: %s]", errno, strerror(errno));
+        return -1;
     }
     if (fseek(self->fp, save_pos, SEEK_SET) != 0) {
-        wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
-        return;
+        wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+        return -1;
     }
+
+    return 0;
 }
 
-size_t wav_write(WavFile* self, WAV_CONST void *buffer, size_t count)
+/* Account for {bytes} of audio having been written and update the header, now or later */
+static int wav_add_to_sizes(WavFile *self, size_t bytes, size_t frames)
+{
+    self->riff_chunk.size += bytes;
+    if (self->fact_chunk.header.id == WAV_FACT_CHUNK_ID) {
+        self->fact_chunk.body.sample_length += frames;
+    }
+    self->data_chunk.header.size += bytes;
+
+    if (!self->defer_sizes) {
+        return wav_update_sizes(self);
+    }
+
+    self->sizes_dirty = 1;
+    self->bytes_since_checkpoint += bytes;
+    if (self->checkpoint_interval != 0 && self->bytes_since_checkpoint >= self->checkpoint_interval) {
+        return wav_flush(self) == 0 ? 0 : -1;
+    }
+
+    return 0;
+}
+
+static size_t wav_write_frames(WavFile* self, WAV_CONST void *buffer, size_t count)
 {
     size_t write_count;
     WavU16 n_channels = wav_get_num_channels(self);
     size_t sample_size = wav_get_sample_size(self);
 
     if (strncmp(self->mode, "rb", 2) == 0) {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return 0;
     }
 
     if (self->format_chunk.body.format_tag == WAV_FORMAT_EXTENSIBLE) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Extensible format is not supported");
+        wav_err_set_literal(self, WAV_ERR_FORMAT, "Extensible format is not supported");
         return 0;
     }
 
@@ -585,28 +1298,217 @@ size_t wav_write(WavFile* self, WAV_CONST void *buffer, size_t count)
         return 0;
     }
 
-    wav_tell(self);
-    if (g_err.code != WAV_OK) {
+    if (wav_tell(self) < 0) {
         return 0;
     }
 
-    write_count = fwrite(buffer, sample_size, n_channels * count, self->fp);
+    if (self->write_buffer != NULL) {
+        size_t len = sample_size * n_channels * count;
+
+        /* Small writes are gathered in the buffer; large ones go straight through */
+        if (self->write_buffer_len + len > self->write_buffer_size && wav_drain_write_buffer(self) != 0) {
+            return 0;
+        }
+        if (len < self->write_buffer_size) {
+            memcpy(self->write_buffer_aligned + self->write_buffer_len, buffer, len);
+            self->write_buffer_len += len;
+            write_count = n_channels * count;
+        } else {
+            write_count = fwrite(buffer, sample_size, n_channels * count, self->fp);
+        }
+    } else {
+        write_count = fwrite(buffer, sample_size, n_channels * count, self->fp);
+    }
     if (ferror(self->fp)) {
-        wav_err_set(WAV_ERR_OS, "Error when writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
+        wav_err_set(self, WAV_ERR_OS, "Error when writing to %s [errno %d: %s]", self->filename, errno, strerror(errno));
         return 0;
     }
 
-    self->riff_chunk.size += write_count * sample_size;
-    if (self->fact_chunk.header.id == WAV_FACT_CHUNK_ID) {
-        self->fact_chunk.body.sample_length += write_count / n_channels;
+    if (wav_add_to_sizes(self, write_count * sample_size, write_count / n_channels) != 0)
+        return 0;
+
+    return write_count / n_channels;
+}
+
+size_t wav_write(WavFile* self, WAV_CONST void *buffer, size_t count)
+{
+    size_t write_count;
+
+    WAV_PROBE2(write_entry, self, count);
+    write_count = wav_write_frames(self, buffer, count);
+    WAV_PROBE2(write_return, self, write_count);
+
+    return write_count;
+}
+
+#define WAV_COPY_BUFFER_SIZE    ((size_t)1 << 20)
+#define WAV_COPY_BUFFER_ALIGN   ((size_t)4096)
+
+#if defined(__linux__)
+/* Copy up to {bytes} bytes in the kernel; returns the number of bytes copied. */
+static WavU64 wav_copy_bytes_kernel(int in_fd, off_t *in_off, int out_fd, off_t *out_off, WavU64 bytes)
+{
+    WavU64 done = 0;
+    ssize_t n;
+
+    /* copy_file_range() shares extents on reflink filesystems (XFS, btrfs) */
+    while (done < bytes) {
+        n = copy_file_range(in_fd, in_off, out_fd, out_off, (size_t)(bytes - done), 0);
+        if (n <= 0) {
+            break;
+        }
+        done += (WavU64)n;
+    }
+
+    /* sendfile() works across filesystems on kernels where copy_file_range() gives EXDEV */
+    if (done < bytes && lseek(out_fd, *out_off, SEEK_SET) != -1) {
+        while (done < bytes) {
+            n = sendfile(out_fd, in_fd, in_off, (size_t)(bytes - done));
+            if (n <= 0) {
+                break;
+            }
+            done += (WavU64)n;
+            *out_off += n;
+        }
     }
-    self->data_chunk.header.size += write_count * sample_size;
 
-    wav_update_sizes(self);
-    if (g_err.code != WAV_OK)
+    return done;
+}
+#endif
+
+static void* wav_copy_malloc(WavFile *self, size_t size)
+{
+    return self != NULL ? wav_file_malloc(self, size) : wav_malloc(size);
+}
+
+static void wav_copy_free(WavFile *self, void *p)
+{
+    if (self != NULL) {
+        wav_file_free(self, p);
+    } else {
+        wav_free(p);
+    }
+}
+
+/* Copy {bytes} bytes, with memory from and errors on {self} if it's not NULL */
+static int wav_copy_file_bytes(WavFile *self, FILE *in, FILE *out, WavU64 bytes)
+{
+    WavU8 *buffer, *aligned;
+
+#if defined(__linux__)
+    int in_fd = fileno(in);
+    int out_fd = fileno(out);
+
+    /* Streams not backed by a file descriptor can only be copied in userspace */
+    if (in_fd != -1 && out_fd != -1) {
+        off_t in_off, out_off;
+
+        if (fflush(out) != 0) {
+            wav_err_set(self, WAV_ERR_OS, "fflush() failed [errno %d: %s]", errno, strerror(errno));
+            return -1;
+        }
+
+        in_off = ftello(in);
+        out_off = ftello(out);
+        if (in_off == -1 || out_off == -1) {
+            wav_err_set(self, WAV_ERR_OS, "ftello() failed [errno %d: %s]", errno, strerror(errno));
+            return -1;
+        }
+
+        bytes -= wav_copy_bytes_kernel(in_fd, &in_off, out_fd, &out_off, bytes);
+
+        /* Resynchronise the streams with what the kernel did behind their backs */
+        if (fseeko(in, in_off, SEEK_SET) != 0 || fseeko(out, out_off, SEEK_SET) != 0) {
+            wav_err_set(self, WAV_ERR_OS, "fseeko() failed [errno %d: %s]", errno, strerror(errno));
+            return -1;
+        }
+
+        if (bytes == 0) {
+            return 0;
+        }
+    }
+#endif
+
+    buffer = wav_copy_malloc(self, WAV_COPY_BUFFER_SIZE + WAV_COPY_BUFFER_ALIGN);
+    if (buffer == NULL) {
+        wav_err_set_literal(self, WAV_ERR_OS, "Out of memory");
+        return -1;
+    }
+    aligned = buffer + (WAV_COPY_BUFFER_ALIGN - (WavUIntPtr)buffer % WAV_COPY_BUFFER_ALIGN) % WAV_COPY_BUFFER_ALIGN;
+
+    while (bytes > 0) {
+        size_t len = bytes < WAV_COPY_BUFFER_SIZE ? (size_t)bytes : WAV_COPY_BUFFER_SIZE;
+
+        if (fread(aligned, len, 1, in) != 1) {
+            if (ferror(in)) {
+                wav_err_set(self, WAV_ERR_OS, "fread() failed [errno %d: %s]", errno, strerror(errno));
+            } else {
+                wav_err_set_literal(self, WAV_ERR_FORMAT, "Unexpected EOF");
+            }
+            wav_copy_free(self, buffer);
+            return -1;
+        }
+        if (fwrite(aligned, len, 1, out) != 1) {
+            wav_err_set(self, WAV_ERR_OS, "fwrite() failed [errno %d: %s]", errno, strerror(errno));
+            wav_copy_free(self, buffer);
+            return -1;
+        }
+
+        bytes -= len;
+    }
+
+    wav_copy_free(self, buffer);
+    return 0;
+}
+
+int wav_copy_bytes(FILE *in, FILE *out, WavU64 bytes)
+{
+    return wav_copy_file_bytes(NULL, in, out, bytes);
+}
+
+size_t wav_copy(WavFile* self, WavFile* src, size_t count)
+{
+    long int pos;
+    size_t len_remain;
+
+    if (strncmp(self->mode, "rb", 2) == 0) {
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return 0;
+    }
 
-    return write_count / n_channels;
+    if (src->mode[0] != 'r' && strchr(src->mode, '+') == NULL) {
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not readable");
+        return 0;
+    }
+
+    if (self->format_chunk.body.block_align != src->format_chunk.body.block_align) {
+        wav_err_set_literal(self, WAV_ERR_PARAM, "Source and destination frame sizes differ");
+        return 0;
+    }
+
+    pos = wav_tell(src);
+    if (pos < 0) {
+        return 0;
+    }
+    len_remain = wav_get_length(src) - (size_t)pos;
+    count = (count <= len_remain) ? count : len_remain;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (wav_drain_write_buffer(self) != 0) {
+        return 0;
+    }
+
+    if (wav_copy_file_bytes(self, src->fp, self->fp, (WavU64)count * self->format_chunk.body.block_align) != 0) {
+        return 0;
+    }
+
+    if (wav_add_to_sizes(self, count * self->format_chunk.body.block_align, count) != 0)
+        return 0;
+
+    return count;
 }
 
 long int wav_tell(WAV_CONST WavFile* self)
@@ -614,10 +1516,12 @@ long int wav_tell(WAV_CONST WavFile* self)
     long pos = ftell(self->fp);
 
     if (pos == -1L) {
-        wav_err_set(WAV_ERR_OS, "ftell() failed [errno %d: %s]", errno, strerror(errno));
+        wav_err_set((WavFile*)self, WAV_ERR_OS, "ftell() failed [errno %d: %s]", errno, strerror(errno));
         return -1L;
     }
 
+    pos += (long)self->write_buffer_len;
+
     assert(pos >= (long)self->data_chunk.offset);
 
     return (long)(((WavU64)pos - self->data_chunk.offset) / (self->format_chunk.body.block_align));
@@ -634,18 +1538,22 @@ int wav_seek(WavFile* self, long int offset, int origin)
         offset += (long)length;
     }
 
+    if (wav_drain_write_buffer(self) != 0) {
+        return (int)self->err.code;
+    }
+
     /* POSIX allows seeking beyond file end */
     if (offset >= 0) {
         offset *= self->format_chunk.body.block_align;
     } else {
-        wav_err_set_literal(WAV_ERR_PARAM, "Invalid seek");
-        return (int)g_err.code;
+        wav_err_set_literal(self, WAV_ERR_PARAM, "Invalid seek");
+        return (int)self->err.code;
     }
 
     ret = fseek(self->fp, (long)self->data_chunk.offset + offset, SEEK_SET);
 
     if (ret != 0) {
-        wav_err_set(WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
+        wav_err_set(self, WAV_ERR_OS, "fseek() failed [errno %d: %s]", errno, strerror(errno));
         return (int)ret;
     }
 
@@ -659,24 +1567,130 @@ void wav_rewind(WavFile* self)
 
 int wav_eof(WAV_CONST WavFile* self)
 {
-    return feof(self->fp) || ftell(self->fp) == (long)(self->data_chunk.offset + self->data_chunk.header.size);
+    return feof(self->fp) || ftell(self->fp) + (long)self->write_buffer_len == (long)(self->data_chunk.offset + self->data_chunk.header.size);
+}
+
+int wav_update_length(WavFile* self)
+{
+    WavU32 size;
+    long int save_pos, end;
+
+    save_pos = ftell(self->fp);
+    if (save_pos == -1L) {
+        wav_err_set(self, WAV_ERR_OS, "ftell() failed [errno %d: %s]", errno, strerror(errno));
+        return (int)self->err.code;
+    }
+
+    if (fseek(self->fp, (long)(self->data_chunk.offset - 4), SEEK_SET) != 0 ||
+        fread(&size, 4, 1, self->fp) != 1 ||
+        fseek(self->fp, 0, SEEK_END) != 0 ||
+        (end = ftell(self->fp)) == -1L ||
+        fseek(self->fp, save_pos, SEEK_SET) != 0)
+    {
+        wav_err_set(self, WAV_ERR_OS, "Error when reading %s [errno %d: %s]", self->filename, errno, strerror(errno));
+        return (int)self->err.code;
+    }
+
+    WavU64 available = (WavU64)end > self->data_chunk.offset ? (WavU64)end - self->data_chunk.offset : 0;
+
+    if (size == 0 || size == 0xffffffff) {
+        /*
+         * A placeholder, that the writer fills in when it stops. Until then,
+         * when following, hold back what was written since the last update:
+         * it may be a chunk that the writer has put after the data.
+         */
+        if (self->follow) {
+            WavU64 settled = self->follow_available < available ? self->follow_available : available;
+
+            self->follow_available = available;
+            available = settled;
+        }
+        size = available < 0xffffffff ? (WavU32)available : 0xffffffff;
+    } else if (available < size) {
+        /* Only count frames that have been completely written */
+        size = (WavU32)available;
+    }
+    self->data_chunk.header.size = size;
+
+    /* The writer may have added more since we last hit the end */
+    clearerr(self->fp);
+
+    return 0;
+}
+
+int wav_set_follow(WavFile* self, int follow)
+{
+    if (self->mode[0] != 'r') {
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not readable");
+        return (int)self->err.code;
+    }
+
+    self->follow = follow;
+
+    return wav_update_length(self);
 }
 
 int wav_flush(WavFile* self)
 {
-    int ret = fflush(self->fp);
+    int ret;
+
+    if (wav_drain_write_buffer(self) != 0) {
+        return (int)self->err.code;
+    }
+
+    if (self->sizes_dirty) {
+        if (wav_update_sizes(self) != 0) {
+            return (int)self->err.code;
+        }
+        self->sizes_dirty = 0;
+        self->bytes_since_checkpoint = 0;
+    }
+
+    ret = fflush(self->fp);
 
     if (ret != 0) {
-        wav_err_set(WAV_ERR_OS, "fflush() failed [errno %d: %s]", errno, strerror(errno));
+        wav_err_set(self, WAV_ERR_OS, "fflush() failed [errno %d: %s]", errno, strerror(errno));
     }
 
     return ret;
 }
 
+int wav_set_write_buffer(WavFile* self, size_t buffer_size, size_t checkpoint_interval)
+{
+    if (self->mode[0] == 'r' && strchr(self->mode, '+') == NULL) {
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
+        return (int)self->err.code;
+    }
+
+    if (wav_flush(self) != 0) {
+        return (int)self->err.code;
+    }
+
+    if (buffer_size == 0) {
+        buffer_size = WAV_COPY_BUFFER_SIZE;
+    }
+
+    wav_file_free(self, self->write_buffer);
+    self->write_buffer = wav_file_malloc(self, buffer_size + WAV_COPY_BUFFER_ALIGN);
+    if (self->write_buffer == NULL) {
+        wav_err_set_literal(self, WAV_ERR_OS, "Out of memory");
+        return (int)self->err.code;
+    }
+    self->write_buffer_aligned = self->write_buffer + (WAV_COPY_BUFFER_ALIGN - (WavUIntPtr)self->write_buffer % WAV_COPY_BUFFER_ALIGN) % WAV_COPY_BUFFER_ALIGN;
+    self->write_buffer_size = buffer_size;
+    self->write_buffer_len = 0;
+
+    self->defer_sizes = 1;
+    self->checkpoint_interval = checkpoint_interval;
+    self->bytes_since_checkpoint = 0;
+
+    return 0;
+}
+
 void wav_set_format(WavFile* self, WavU16 format)
 {
     if (self->mode[0] == 'r') {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return;
     }
 
@@ -709,12 +1723,12 @@ void wav_set_format(WavFile* self, WavU16 format)
 void wav_set_num_channels(WavFile* self, WavU16 num_channels)
 {
     if (self->mode[0] == 'r') {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return;
     }
 
     if (num_channels < 1) {
-        wav_err_set(WAV_ERR_PARAM, "Invalid number of channels: %u", num_channels);
+        wav_err_set(self, WAV_ERR_PARAM, "Invalid number of channels: %u", num_channels);
         return;
     }
 
@@ -732,7 +1746,7 @@ void wav_set_num_channels(WavFile* self, WavU16 num_channels)
 void wav_set_sample_rate(WavFile* self, WavU32 sample_rate)
 {
     if (self->mode[0] == 'r') {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return;
     }
 
@@ -748,17 +1762,17 @@ void wav_set_sample_rate(WavFile* self, WavU32 sample_rate)
 void wav_set_valid_bits_per_sample(WavFile* self, WavU16 bits)
 {
     if (self->mode[0] == 'r') {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return;
     }
 
     if (bits < 1 || bits > 8 * self->format_chunk.body.block_align / self->format_chunk.body.num_channels) {
-        wav_err_set(WAV_ERR_PARAM, "Invalid ValidBitsPerSample: %u", bits);
+        wav_err_set(self, WAV_ERR_PARAM, "Invalid ValidBitsPerSample: %u", bits);
         return;
     }
 
     if ((self->format_chunk.body.format_tag == WAV_FORMAT_ALAW || self->format_chunk.body.format_tag == WAV_FORMAT_MULAW) && bits != 8) {
-        wav_err_set(WAV_ERR_PARAM, "Invalid ValidBitsPerSample: %u", bits);
+        wav_err_set(self, WAV_ERR_PARAM, "Invalid ValidBitsPerSample: %u", bits);
         return;
     }
 
@@ -775,12 +1789,12 @@ void wav_set_valid_bits_per_sample(WavFile* self, WavU16 bits)
 void wav_set_sample_size(WavFile* self, size_t sample_size)
 {
     if (self->mode[0] == 'r') {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return;
     }
 
     if (sample_size < 1) {
-        wav_err_set(WAV_ERR_PARAM, "Invalid sample size: %zu", sample_size);
+        wav_err_set(self, WAV_ERR_PARAM, "Invalid sample size: %zu", sample_size);
         return;
     }
 
@@ -797,12 +1811,12 @@ void wav_set_sample_size(WavFile* self, size_t sample_size)
 void wav_set_channel_mask(WavFile* self, WavU32 channel_mask)
 {
     if (self->mode[0] == 'r') {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return;
     }
 
     if (self->format_chunk.body.format_tag != WAV_FORMAT_EXTENSIBLE) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Extensible format is not supported");
+        wav_err_set_literal(self, WAV_ERR_FORMAT, "Extensible format is not supported");
         return;
     }
 
@@ -814,12 +1828,12 @@ void wav_set_channel_mask(WavFile* self, WavU32 channel_mask)
 void wav_set_sub_format(WavFile* self, WavU16 sub_format)
 {
     if (self->mode[0] == 'r') {
-        wav_err_set_literal(WAV_ERR_MODE, "This WavFile is not writable");
+        wav_err_set_literal(self, WAV_ERR_MODE, "This WavFile is not writable");
         return;
     }
 
     if (self->format_chunk.body.format_tag != WAV_FORMAT_EXTENSIBLE) {
-        wav_err_set_literal(WAV_ERR_FORMAT, "Extensible format is not supported");
+        wav_err_set_literal(self, WAV_ERR_FORMAT, "Extensible format is not supported");
         return;
     }
 
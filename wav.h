@@ -20,6 +20,7 @@ extern "C" {
 
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdio.h>
 
 #if !defined(_MSC_VER) || _MSC_VER >= 1800
 #define WAV_INLINE static inline
@@ -98,6 +99,7 @@ void wav_set_allocator(void *context, WAV_CONST WavAllocFuncs *funcs);
 
 void* wav_malloc(size_t size);
 void* wav_realloc(void *p, size_t size);
+void* wav_calloc(size_t n, size_t size);
 void wav_free(void *p);
 
 char* wav_strdup(WAV_CONST char *str);
@@ -117,19 +119,89 @@ typedef struct _WavFile WavFile;
  *  @return             NULL if the memory allocation for the {WavFile} object failed. Non-NULL means the memory allocation succeeded, but there can be other errors, which can be obtained using {wav_errno} or {wav_error}.
  */
 WavFile* wav_open(WAV_CONST char* filename, WAV_CONST char* mode);
+
+/** Open a wav file with its own allocator
+ *
+ *  @param context      Passed to {funcs}
+ *  @param funcs        Used for the {WavFile} object, its buffers and the messages of its errors, instead of the allocator set by {wav_set_allocator}. It must stay valid until {wav_close}.
+ *  @return             Same as {wav_open}.
+ */
+WavFile* wav_open_with_allocator(WAV_CONST char* filename, WAV_CONST char* mode, void* context, WAV_CONST WavAllocFuncs* funcs);
 void     wav_close(WavFile* self);
 WavFile* wav_reopen(WavFile* self, WAV_CONST char* filename, WAV_CONST char* mode);
 
+/** Open a wav file held in memory for reading
+ *
+ *  @param buffer       The contents of the wav file. It is not copied, so it must stay valid until {wav_close}.
+ *  @param size         The size of {buffer} in bytes
+ *  @return             Same as {wav_open}.
+ */
+WavFile* wav_open_memory(WAV_CONST void* buffer, size_t size);
+
+/** Open a wav file held in memory for reading, with its own allocator
+ *
+ *  @param alloc_context    Passed to {alloc_funcs}
+ *  @param alloc_funcs      As for {wav_open_with_allocator}.
+ *  @return                 Same as {wav_open}.
+ */
+WavFile* wav_open_memory_with_allocator(WAV_CONST void* buffer, size_t size, void* alloc_context, WAV_CONST WavAllocFuncs* alloc_funcs);
+
+typedef struct {
+    WavI64  (*read)(void *context, void *buffer, size_t size);
+    int     (*seek)(void *context, WavI64 *offset, int origin);
+    void    (*close)(void *context);
+} WavIoFuncs;
+
+/** Open a wav file for reading through callbacks
+ *
+ *  @param context      Passed to each of the callbacks
+ *  @param funcs        {read} returns the number of bytes read, 0 at the end of the input or -1 on error.
+ *                      {seek} moves to {*offset} relative to {origin} (as {fseek}), sets {*offset} to the new position and returns 0, or returns -1 on error.
+ *                      {close} is called from {wav_close}.
+ *                      {seek} and {close} may be NULL.
+ *  @return             Same as {wav_open}.
+ *  @remarks            Without a {seek} callback the input can only be read forwards, which is enough to read a stream such as a socket from start to end. Only available with glibc.
+ */
+WavFile* wav_open_callbacks(void* context, WAV_CONST WavIoFuncs* funcs);
+
+/** Open a wav file for reading through callbacks, with its own allocator
+ *
+ *  @param alloc_context    Passed to {alloc_funcs}
+ *  @param alloc_funcs      As for {wav_open_with_allocator}; the state kept for the callbacks comes from it too.
+ *  @return                 Same as {wav_open}.
+ */
+WavFile* wav_open_callbacks_with_allocator(void* context, WAV_CONST WavIoFuncs* funcs, void* alloc_context, WAV_CONST WavAllocFuncs* alloc_funcs);
+
+/** Get the last error on a wav file
+ *
+ *  @remarks        Each {WavFile} keeps its own error until {wav_file_err_clear} or {wav_close}, whichever thread it is used on. The error is also copied to the calling thread's {wav_err}.
+ */
+WAV_CONST WavErr* wav_file_err(WAV_CONST WavFile* self);
+void wav_file_err_clear(WavFile* self);
+
 /** Read a block of samples from the wav file
  *
  *  @param buffer       A pointer to a buffer where the data will be placed
  *  @param count        The number of frames (block size)
  *  @param self         The pointer to the {WavFile} structure
  *  @return             The number of frames read. If returned value is less than {count}, either EOF reached or an error occured
- *  @remarks            This API does not support extensible format. For extensible format, use {wave_read_raw} instead.
  */
 size_t wav_read(WavFile* self, void *buffer, size_t count);
 
+/** Read one channel of the wav file, converting it to a common sample type
+ *
+ *  @param self         The pointer to the {WavFile} structure
+ *  @param channel      The index of the channel to read
+ *  @param buffer       A pointer to a buffer where the {count} samples will be placed
+ *  @param count        The number of frames to read
+ *  @return             The number of samples read. If returned value is less than {count}, either EOF reached or an error occured
+ *  @remarks            Reads 8/16/24/32 bit PCM, 32/64 bit float, A-law and mu-law, including in extensible format.
+ *                      Integer output is left-justified, so the most significant bits of wider samples are kept. Float output is in [-1, 1).
+ */
+size_t wav_read_channel_i16(WavFile* self, unsigned channel, WavI16* buffer, size_t count);
+size_t wav_read_channel_i32(WavFile* self, unsigned channel, WavI32* buffer, size_t count);
+size_t wav_read_channel_f32(WavFile* self, unsigned channel, float* buffer, size_t count);
+
 /** Write a block of samples to the wav file
  *
  *  @param buffer   A pointer to the buffer of data
@@ -140,6 +212,26 @@ size_t wav_read(WavFile* self, void *buffer, size_t count);
  */
 size_t wav_write(WavFile* self, WAV_CONST void *buffer, size_t count);
 
+/** Copy a block of frames from one wav file to another
+ *
+ *  @param self     The pointer to the {WavFile} structure to write to
+ *  @param src      The pointer to the {WavFile} structure to read from, positioned at the first frame to copy
+ *  @param count    The number of frames
+ *  @return         The number of frames copied. If returned value is less than {count}, either EOF reached or an error occured.
+ *  @remarks        Both files must have the same frame size. The data is not converted, so the formats should match. On Linux the copy is done in the kernel where possible, which shares extents on filesystems that support reflinks.
+ */
+size_t wav_copy(WavFile* self, WavFile* src, size_t count);
+
+/** Copy raw bytes between two stdio streams
+ *
+ *  @param in       The stream to read from, at its current position
+ *  @param out      The stream to write to, at its current position
+ *  @param bytes    The number of bytes to copy
+ *  @return         0 on success, -1 on error. Both streams are left positioned after the copied data.
+ *  @remarks        Uses copy_file_range() and then sendfile() on Linux, falling back to a copy through a large aligned buffer.
+ */
+int wav_copy_bytes(FILE *in, FILE *out, WavU64 bytes);
+
 /** Tell the current position in the wav file.
  *
  *  @param self     The pointer to the WavFile structure.
@@ -157,8 +249,41 @@ void wav_rewind(WavFile* self);
  */
 int wav_eof(WAV_CONST WavFile* self);
 
+/** Re-read the length of a wav file that is still being written
+ *
+ *  @param self     The pointer to the WavFile structure.
+ *  @return         0 on success, otherwise non-zero.
+ *  @remarks        The length is taken from the data chunk header, but never includes frames past the current end of the file. A placeholder size of 0 or 0xffffffff is taken to run to the end of the file; see {wav_set_follow}.
+ */
+int wav_update_length(WavFile* self);
+
+/** Follow a wav file that is still being recorded
+ *
+ *  @param self     The pointer to the WavFile structure, opened for reading.
+ *  @param follow   Non-zero to treat a data chunk whose size is still a placeholder (0 or 0xffffffff) as running to the end of the file. Zero once the writer has finished.
+ *  @return         0 on success, otherwise non-zero.
+ *  @remarks        Recorders often only write the size of the data chunk when they stop. Call {wav_update_length} to pick up frames written since.
+ *                  A real size in the header is always trusted. While the size is a placeholder, the bytes written since the last update are held back until the next, as they may be a chunk written after the data just before the header is finalized.
+ */
+int wav_set_follow(WavFile* self, int follow);
+
+/** Flush buffered frames and bring the header sizes up to date
+ *
+ *  @param self     The pointer to the WavFile structure.
+ *  @return         0 on success, otherwise non-zero.
+ */
 int wav_flush(WavFile* self);
 
+/** Buffer writes and defer updating the header until {wav_flush} or {wav_close}
+ *
+ *  @param self                 The {WavFile} object, opened for writing
+ *  @param buffer_size          The size of the write buffer in bytes, or 0 for the default of 1 MB
+ *  @param checkpoint_interval  Update the header on disk after this many bytes of audio, or 0 to only update it on {wav_flush} or {wav_close}
+ *  @return                     0 on success, otherwise non-zero.
+ *  @remarks                    By default every {wav_write} and {wav_copy} rewrites the sizes in the header so that the file is always valid, which costs several seeks per call. In this mode the sizes are kept in memory, so a file that isn't closed will have a truncated header unless a checkpoint interval is given.
+ */
+int wav_set_write_buffer(WavFile* self, size_t buffer_size, size_t checkpoint_interval);
+
 /** Set the format code
  *
  *  @param self     The {WavFile} object
@@ -0,0 +1,747 @@
+/*
+ * Find the offset between two recordings of the same take, such as a
+ * camera's scratch audio and the sound recorder's track, when there's no LTC
+ * to line them up with. The number printed is what to pad the target with,
+ * in samples, so that it lines up with the reference:
+ *
+ *   pad_wav -n $(wav_offset ref.wav cam.wav) cam.wav synced.wav
+ *
+ * The search is coarse to fine. The envelopes of both whole files, decimated
+ * to a few hundred samples a second, are cross-correlated with an FFT to find
+ * the offset to within a few milliseconds. It is then refined at the full
+ * sample rate over the loudest stretch the two have in common, each step
+ * searching a narrower range of offsets at a finer decimation.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wav.h"
+#include "ltc.h"
+
+static const char false = 0;
+static const char true = 1;
+
+#define return_fail {rv = EXIT_FAILURE; goto exit;}
+
+// The envelopes are decimated to no more than this rate...
+#define COARSE_MAX_RATE       1000
+// ...and length, which bounds the size of the FFT.
+#define COARSE_MAX_LENGTH     (1 << 20)
+// Seconds of audio to refine the offset over.
+#define REFINE_SECONDS        30
+// Decimation of each refinement step over the last.
+#define REFINE_STEP           8
+// Correlation under which the offset is probably wrong.
+#define WEAK_CORRELATION      0.1
+
+#define READ_BLOCK_SIZE       65536
+
+static int verbosity = 0;
+
+typedef struct
+{
+  const char* filename;
+  unsigned channel;
+  WavU32 sample_rate;
+  size_t length;          // In samples
+  float* envelope;        // Mean magnitude of each 'factor' samples
+  size_t envelope_length;
+} Track;
+
+/*
+ * Open 'track' to check its channel and find its length.
+ */
+static int open_track(Track* track)
+{
+  int rv = -1;
+  WavFile* fptr = wav_open(track->filename, "r");
+
+  if (!fptr)
+  {
+    fprintf(stderr, "Out of memory opening '%s'\n", track->filename);
+    return -1;
+  }
+
+  if (wav_file_err(fptr)->code != WAV_OK)
+  {
+    fprintf(stderr, "Error opening '%s': %s\n", track->filename, wav_file_err(fptr)->message);
+    goto exit;
+  }
+
+  if (track->channel >= wav_get_num_channels(fptr))
+  {
+    fprintf(stderr, "'%s' has no channel %u\n", track->filename, track->channel);
+    goto exit;
+  }
+
+  track->sample_rate = wav_get_sample_rate(fptr);
+  track->length = wav_get_length(fptr);
+  rv = 0;
+
+exit:
+  wav_close(fptr);
+  return rv;
+}
+
+/*
+ * Read 'count' samples of the track's channel from 'start' into 'buffer'.
+ * Anything before the start or past the end of the file is zero.
+ */
+static int read_track(const Track* track, long start, float* buffer, size_t count)
+{
+  int rv = -1;
+  WavFile* fptr = NULL;
+
+  memset(buffer, 0, count * sizeof(float));
+
+  if (start < 0)
+  {
+    if ((size_t)-start >= count) return 0;
+    buffer += -start;
+    count -= -start;
+    start = 0;
+  }
+
+  if ((size_t)start >= track->length) return 0;
+  if (count > track->length - start) count = track->length - start;
+
+  fptr = wav_open(track->filename, "r");
+  if (!fptr || wav_file_err(fptr)->code != WAV_OK || wav_seek(fptr, start, SEEK_SET) != 0)
+  {
+    fprintf(stderr, "Error reading '%s': %s\n", track->filename,
+            fptr ? wav_file_err(fptr)->message : "Out of memory");
+    goto exit;
+  }
+
+  if (wav_read_channel_f32(fptr, track->channel, buffer, count) != count)
+  {
+    fprintf(stderr, "Error reading '%s': %s\n", track->filename, wav_file_err(fptr)->message);
+    goto exit;
+  }
+
+  rv = 0;
+
+exit:
+  if (fptr) wav_close(fptr);
+  return rv;
+}
+
+
+/*
+ * Envelopes
+ *
+ * Each file is split into as many pieces as there are threads for it, and
+ * every piece is read by its own thread with its own WavFile, straight into
+ * its part of the envelope.
+ */
+typedef struct
+{
+  const Track* track;
+  size_t start, end;      // Samples, with 'start' a multiple of 'factor'
+  size_t factor;
+  pthread_t thread;
+  bool started;
+  int rv;
+} EnvelopeJob;
+
+static void* envelope_worker(void* arg)
+{
+  EnvelopeJob* job = arg;
+  const Track* track = job->track;
+  size_t block_size = READ_BLOCK_SIZE < job->factor ? job->factor : READ_BLOCK_SIZE;
+  float* buffer = malloc(block_size * sizeof(float));
+  float* envelope = track->envelope + job->start / job->factor;
+  WavFile* fptr = NULL;
+
+  job->rv = -1;
+
+  if (!buffer)
+  {
+    fprintf(stderr, "Out of memory reading '%s'\n", track->filename);
+    goto exit;
+  }
+
+  fptr = wav_open(track->filename, "r");
+  if (!fptr || wav_file_err(fptr)->code != WAV_OK || wav_seek(fptr, job->start, SEEK_SET) != 0)
+  {
+    fprintf(stderr, "Error reading '%s': %s\n", track->filename,
+            fptr ? wav_file_err(fptr)->message : "Out of memory");
+    goto exit;
+  }
+
+  for (size_t pos = job->start; pos < job->end; )
+  {
+    size_t len = job->end - pos < block_size ? job->end - pos : block_size;
+
+    if (wav_read_channel_f32(fptr, track->channel, buffer, len) != len)
+    {
+      fprintf(stderr, "Error reading '%s': %s\n", track->filename, wav_file_err(fptr)->message);
+      goto exit;
+    }
+
+    // Blocks are a multiple of 'factor', apart from the last one in the file.
+    for (size_t i = 0; i < len; i += job->factor)
+    {
+      size_t n = len - i < job->factor ? len - i : job->factor;
+      float sum = 0;
+
+      for (size_t j = 0; j < n; ++j) sum += fabsf(buffer[i + j]);
+      *envelope++ = sum / n;
+    }
+
+    pos += len;
+  }
+
+  job->rv = 0;
+
+exit:
+  if (fptr) wav_close(fptr);
+  free(buffer);
+  return NULL;
+}
+
+static int read_envelopes(Track* tracks, int num_tracks, size_t factor, int num_threads)
+{
+  int rv = 0;
+  int pieces = num_threads / num_tracks > 0 ? num_threads / num_tracks : 1;
+  EnvelopeJob* jobs = calloc(num_tracks * pieces, sizeof(EnvelopeJob));
+
+  if (!jobs)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  for (int i = 0; i < num_tracks; ++i)
+  {
+    tracks[i].envelope_length = (tracks[i].length + factor - 1) / factor;
+    tracks[i].envelope = malloc(tracks[i].envelope_length * sizeof(float));
+
+    if (!tracks[i].envelope)
+    {
+      fprintf(stderr, "Out of memory\n");
+      free(jobs);
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < num_tracks; ++i)
+  {
+    size_t blocks_per_piece = (tracks[i].envelope_length + pieces - 1) / pieces;
+
+    for (int j = 0; j < pieces; ++j)
+    {
+      EnvelopeJob* job = &jobs[i * pieces + j];
+      size_t start = j * blocks_per_piece * factor;
+      size_t end = start + blocks_per_piece * factor;
+
+      job->track = &tracks[i];
+      job->factor = factor;
+      job->start = start < tracks[i].length ? start : tracks[i].length;
+      job->end = end < tracks[i].length ? end : tracks[i].length;
+      job->started = pthread_create(&job->thread, NULL, envelope_worker, job) == 0;
+
+      // Can't start a thread; do it here instead.
+      if (!job->started) envelope_worker(job);
+    }
+  }
+
+  for (int i = 0; i < num_tracks * pieces; ++i)
+  {
+    if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+    if (jobs[i].rv != 0) rv = -1;
+  }
+
+  free(jobs);
+  return rv;
+}
+
+
+/*
+ * FFT
+ *
+ * In place, iterative radix-2, for power of two sizes. The inverse isn't
+ * scaled.
+ */
+typedef struct
+{
+  double re, im;
+} Complex;
+
+static void fft(Complex* x, size_t n, const Complex* twiddles, bool inverse)
+{
+  // Bit reversed order.
+  for (size_t i = 1, j = 0; i < n; ++i)
+  {
+    size_t bit = n >> 1;
+
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j |= bit;
+
+    if (i < j)
+    {
+      Complex t = x[i];
+      x[i] = x[j];
+      x[j] = t;
+    }
+  }
+
+  // 'twiddles' holds exp(-2 pi i k / n) for k < n / 2.
+  for (size_t len = 2; len <= n; len <<= 1)
+  {
+    size_t half = len >> 1;
+    size_t stride = n / len;
+
+    for (size_t i = 0; i < n; i += len)
+    {
+      for (size_t k = 0; k < half; ++k)
+      {
+        Complex w = twiddles[k * stride];
+        Complex* a = &x[i + k];
+        Complex* b = &x[i + k + half];
+        double im = inverse ? -w.im : w.im;
+        double t_re = b->re * w.re - b->im * im;
+        double t_im = b->re * im + b->im * w.re;
+
+        b->re = a->re - t_re;
+        b->im = a->im - t_im;
+        a->re += t_re;
+        a->im += t_im;
+      }
+    }
+  }
+}
+
+/*
+ * Cross-correlate the envelopes of 'ref' and 'target' to find the lag, in
+ * envelope samples, at which target[t + lag] best matches ref[t]. Only lags
+ * of up to 'max_lag' either way are considered.
+ */
+static int coarse_lag(const Track* ref, const Track* target, long max_lag, long* lag_ptr)
+{
+  size_t n = 2;
+  double ref_mean = 0, target_mean = 0;
+  Complex* x;
+  Complex* twiddles;
+
+  while (n < ref->envelope_length + target->envelope_length) n <<= 1;
+
+  x = calloc(n, sizeof(Complex));
+  twiddles = malloc(n / 2 * sizeof(Complex));
+
+  if (!x || !twiddles)
+  {
+    fprintf(stderr, "Out of memory\n");
+    free(x);
+    free(twiddles);
+    return -1;
+  }
+
+  for (size_t k = 0; k < n / 2; ++k)
+  {
+    twiddles[k].re = cos(2 * M_PI * k / n);
+    twiddles[k].im = -sin(2 * M_PI * k / n);
+  }
+
+  for (size_t i = 0; i < ref->envelope_length; ++i) ref_mean += ref->envelope[i];
+  for (size_t i = 0; i < target->envelope_length; ++i) target_mean += target->envelope[i];
+  ref_mean /= ref->envelope_length;
+  target_mean /= target->envelope_length;
+
+  // Both real signals go through one FFT, as the real and imaginary parts.
+  for (size_t i = 0; i < ref->envelope_length; ++i) x[i].re = ref->envelope[i] - ref_mean;
+  for (size_t i = 0; i < target->envelope_length; ++i) x[i].im = target->envelope[i] - target_mean;
+
+  fft(x, n, twiddles, false);
+
+  /*
+   * Separate the two spectra, R[k] = (X[k] + X*[n - k]) / 2 and
+   * T[k] = (X[k] - X*[n - k]) / 2i, and replace X[k] with R*[k] T[k], whose
+   * inverse is the cross-correlation. k and n - k are done together.
+   */
+  for (size_t k = 0; k <= n / 2; ++k)
+  {
+    size_t m = (n - k) & (n - 1);
+    Complex a = x[k], b = x[m];
+    double r_re = (a.re + b.re) / 2, r_im = (a.im - b.im) / 2;
+    double t_re = (a.im + b.im) / 2, t_im = (b.re - a.re) / 2;
+
+    // R*[k] T[k]; at n - k both are conjugated, and so is the product.
+    x[k].re = r_re * t_re + r_im * t_im;
+    x[k].im = r_re * t_im - r_im * t_re;
+    x[m].re = x[k].re;
+    x[m].im = -x[k].im;
+  }
+
+  fft(x, n, twiddles, true);
+
+  // Lags for which the two overlap at all, no further than 'max_lag'.
+  long lo = -(long)ref->envelope_length + 1;
+  long hi = (long)target->envelope_length - 1;
+  long best_lag = 0;
+  double best = -INFINITY;
+
+  if (lo < -max_lag) lo = -max_lag;
+  if (hi > max_lag) hi = max_lag;
+
+  for (long lag = lo; lag <= hi; ++lag)
+  {
+    double c = x[lag < 0 ? n + lag : (size_t)lag].re;
+
+    if (c > best)
+    {
+      best = c;
+      best_lag = lag;
+    }
+  }
+
+  free(x);
+  free(twiddles);
+
+  if (lo > hi)
+  {
+    fprintf(stderr, "The files don't overlap at any offset that's allowed\n");
+    return -1;
+  }
+
+  *lag_ptr = best_lag;
+  return 0;
+}
+
+
+/*
+ * Refinement
+ *
+ * Both signals are box-averaged over 'step' samples, using running sums, and
+ * correlated at offsets 'step' apart. Polarity is ignored, as a microphone
+ * may be wired either way round.
+ */
+typedef struct
+{
+  const double* ref_sums;     // Running sums of the reference segment...
+  const double* target_sums;  // ...and of the target around it
+  size_t length;              // Samples in the reference segment
+  long target_start;          // Offset of the target buffer from the segment
+} Segment;
+
+static double correlate(const Segment* segment, const double* a, size_t step, long lag)
+{
+  size_t n = segment->length / step;
+  const double* sums = segment->target_sums + (lag - segment->target_start);
+  double sum_b = 0, sum_bb = 0, sum_ab = 0, sum_aa = 0;
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    double b = sums[(i + 1) * step] - sums[i * step];
+
+    sum_b += b;
+    sum_bb += b * b;
+    sum_ab += a[i] * b;
+    sum_aa += a[i] * a[i];
+  }
+
+  // 'a' already has a mean of zero.
+  double var_b = sum_bb - sum_b * sum_b / n;
+  if (sum_aa <= 0 || var_b <= 0) return 0;
+
+  return sum_ab / sqrt(sum_aa * var_b);
+}
+
+/*
+ * Refine 'lag', in samples, to within a sample by correlating the tracks over
+ * the loudest REFINE_SECONDS they have in common at that lag, searching
+ * 'span' samples either side of it. The correlation is returned in
+ * '*r_ptr'.
+ */
+static int refine_lag(const Track* ref, const Track* target, size_t factor,
+                      long* lag_ptr, double* r_ptr)
+{
+  int rv = -1;
+  long lag = *lag_ptr;
+  long coarse = lag / (long)factor;
+  long span = 4 * factor;
+  long pad = span + factor;
+  float* ref_buffer = NULL;
+  float* target_buffer = NULL;
+  double* ref_sums = NULL;
+  double* target_sums = NULL;
+  double* a = NULL;
+  double r = 0;
+
+  /*
+   * Choose the envelope window in which both tracks are loudest.
+   */
+  long first = coarse < 0 ? -coarse : 0;
+  long last = (long)ref->envelope_length;
+
+  if (last > (long)target->envelope_length - coarse) last = target->envelope_length - coarse;
+
+  size_t window = (size_t)REFINE_SECONDS * ref->sample_rate / factor;
+  if (window > (size_t)(last - first)) window = last - first;
+
+  long best_start = first;
+  double energy = 0, best_energy = 0;
+
+  for (long t = first; t < last; ++t)
+  {
+    energy += (double)ref->envelope[t] * target->envelope[t + coarse];
+
+    if (t - first >= (long)window)
+    {
+      long s = t - window;
+      energy -= (double)ref->envelope[s] * target->envelope[s + coarse];
+    }
+
+    if (t - first + 1 >= (long)window && energy > best_energy)
+    {
+      best_energy = energy;
+      best_start = t + 1 - window;
+    }
+  }
+
+  long start = best_start * factor;
+  size_t length = window * factor;
+
+  if (length > ref->length - start) length = ref->length - start;
+
+  if (verbosity > 0)
+  {
+    fprintf(stderr, "Refining over %.1f s at %.1f s of the reference\n",
+            (double)length / ref->sample_rate, (double)start / ref->sample_rate);
+  }
+
+  /*
+   * Read the segment, and the target around it, at the full rate.
+   */
+  size_t target_length = length + 2 * pad;
+
+  ref_buffer = malloc(length * sizeof(float));
+  target_buffer = malloc(target_length * sizeof(float));
+  ref_sums = malloc((length + 1) * sizeof(double));
+  target_sums = malloc((target_length + 1) * sizeof(double));
+  a = malloc(length * sizeof(double));
+
+  if (!ref_buffer || !target_buffer || !ref_sums || !target_sums || !a)
+  {
+    fprintf(stderr, "Out of memory\n");
+    goto exit;
+  }
+
+  if (read_track(ref, start, ref_buffer, length) != 0) goto exit;
+  if (read_track(target, start + lag - pad, target_buffer, target_length) != 0) goto exit;
+
+  ref_sums[0] = 0;
+  for (size_t i = 0; i < length; ++i) ref_sums[i + 1] = ref_sums[i] + ref_buffer[i];
+
+  target_sums[0] = 0;
+  for (size_t i = 0; i < target_length; ++i) target_sums[i + 1] = target_sums[i] + target_buffer[i];
+
+  Segment segment = {ref_sums, target_sums, length, lag - pad};
+  size_t step = factor;
+
+  do
+  {
+    step = step / REFINE_STEP > 0 ? step / REFINE_STEP : 1;
+
+    // The decimated reference, with its mean removed.
+    size_t n = length / step;
+    if (n < 2) continue;
+
+    double mean = ref_sums[n * step] / (n * step) * step;
+
+    for (size_t i = 0; i < n; ++i) a[i] = ref_sums[(i + 1) * step] - ref_sums[i * step] - mean;
+
+    long best_lag = lag;
+    double best = -1;
+
+    for (long k = lag - span; k <= lag + span; k += step)
+    {
+      double c = correlate(&segment, a, step, k);
+
+      if (fabs(c) > best)
+      {
+        best = fabs(c);
+        best_lag = k;
+        r = c;
+      }
+    }
+
+    if (verbosity > 1)
+    {
+      fprintf(stderr, "Step %zu: offset %ld, correlation %.3f\n", step, -best_lag, r);
+    }
+
+    lag = best_lag;
+    span = 2 * step;
+  }
+  while (step > 1);
+
+  *lag_ptr = lag;
+  *r_ptr = r;
+  rv = 0;
+
+exit:
+  free(ref_buffer);
+  free(target_buffer);
+  free(ref_sums);
+  free(target_sums);
+  free(a);
+  return rv;
+}
+
+static void usage (int status)
+{
+  printf ("wav_offset - Find the offset between two recordings of the same audio.\n\n");
+  printf ("Usage: wav_offset [ OPTIONS ] <reference filename> <target filename>\n\n");
+  printf ("Prints the number of samples to pad the target with, or to trim from it\n");
+  printf ("if negative, to line it up with the reference, for pad_wav -n.\n\n");
+  printf ("Options:\n\
+  -c, --channel <num>       channel of the reference to use (default 0)\n\
+  -C, --target-channel <num>  channel of the target to use (default 0)\n\
+  -M, --max-offset <secs>   only look for offsets of up to this many seconds\n\
+  -t, --threads <num>       number of threads to read the files with\n\
+  -v, --verbose             print how the offset was found to stderr\n\
+  -h, --help                display this help and exit\n\
+  \n");
+
+  exit (status);
+}
+
+static struct option const long_options[] =
+{
+  {"help", no_argument, 0, 'h'},
+  {"channel", required_argument, 0, 'c'},
+  {"target-channel", required_argument, 0, 'C'},
+  {"max-offset", required_argument, 0, 'M'},
+  {"threads", required_argument, 0, 't'},
+  {"verbose", no_argument, 0, 'v'},
+  {NULL, 0, NULL, 0}
+};
+
+
+int main(int argc, char **argv)
+{
+  int rv = EXIT_SUCCESS;
+  Track tracks[2] = {{0}};
+  double max_offset = 0;
+  long num_threads = 0;
+  int c;
+
+  while ((c = getopt_long (argc, argv,
+         "c:"  /* reference channel */
+         "C:"  /* target channel */
+         "M:"  /* max offset */
+         "t:"  /* threads */
+         "v"   /* verbose */
+         "h" , /* help */
+         long_options, (int *) 0)) != EOF)
+  {
+    switch (c) {
+      case 'c':
+        tracks[0].channel = atoi(optarg);
+        break;
+
+      case 'C':
+        tracks[1].channel = atoi(optarg);
+        break;
+
+      case 'M':
+        max_offset = atof(optarg);
+        break;
+
+      case 't':
+        num_threads = atol(optarg);
+        break;
+
+      case 'v':
+        verbosity++;
+        break;
+
+      case 'h':
+        usage (0);
+
+      default:
+        usage (EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind != 2)
+  {
+    usage (EXIT_FAILURE);
+  }
+
+  if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0) num_threads = 1;
+
+  Track* ref = &tracks[0];
+  Track* target = &tracks[1];
+
+  ref->filename = argv[optind];
+  target->filename = argv[optind + 1];
+
+  if (open_track(ref) != 0 || open_track(target) != 0) return_fail;
+
+  if (ref->sample_rate != target->sample_rate)
+  {
+    fprintf(stderr, "Sample rate of '%s' is %u, not %u\n",
+            target->filename, target->sample_rate, ref->sample_rate);
+    return_fail;
+  }
+
+  if (ref->length == 0 || target->length == 0)
+  {
+    fprintf(stderr, "'%s' is empty\n", ref->length == 0 ? ref->filename : target->filename);
+    return_fail;
+  }
+
+  /*
+   * Decimate by a power of two, to at most COARSE_MAX_RATE and
+   * COARSE_MAX_LENGTH.
+   */
+  size_t factor = 1;
+  size_t longest = ref->length > target->length ? ref->length : target->length;
+
+  while (ref->sample_rate / factor > COARSE_MAX_RATE || longest / factor > COARSE_MAX_LENGTH)
+  {
+    factor <<= 1;
+  }
+
+  if (read_envelopes(tracks, 2, factor, num_threads) != 0) return_fail;
+
+  long max_lag = max_offset > 0 ? (long)(max_offset * ref->sample_rate / factor) : (long)longest;
+  long lag;
+  double r;
+
+  if (coarse_lag(ref, target, max_lag, &lag) != 0) return_fail;
+
+  if (verbosity > 0)
+  {
+    fprintf(stderr, "Coarse offset: %ld samples (decimated by %zu)\n", -lag * (long)factor, factor);
+  }
+
+  lag *= factor;
+  if (refine_lag(ref, target, factor, &lag, &r) != 0) return_fail;
+
+  if (verbosity > 0)
+  {
+    fprintf(stderr, "Offset: %ld samples (%.6f s), correlation %.3f%s\n",
+            -lag, (double)-lag / ref->sample_rate, r, r < 0 ? ", inverted" : "");
+  }
+
+  if (fabs(r) < WEAK_CORRELATION)
+  {
+    fprintf(stderr, "Weak correlation (%.3f); the offset may be wrong\n", r);
+  }
+
+  printf("%ld\n", -lag);
+
+exit:
+  free(ref->envelope);
+  free(target->envelope);
+  return rv;
+}